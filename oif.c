@@ -16,187 +16,3768 @@
 
 
 //#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "oif.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define OIF_X86 1
+#include <immintrin.h>
+#endif
+
+
+/*
+ * Initializes an OIF header. The header can then be
+ * directly used.
+ */
+void
+oif_init_header (
+    struct oif_header *header,
+    unsigned int width,
+    unsigned int height)
+{
+    int i;
+
+    header->magic = OIF_MAGIC;
+    header->version = OIF_VERSION;
+    header->sub_version = OIF_SUBVERSION;
+    header->width = width;
+    header->height = height;
+    header->id = 0;
+    for (i = 0; i < 8; i++) {
+        header->reserved[i] = 0;
+    }
+}
+
+
+/*
+ * Extends rect to the bounding rectangle of rect and add.
+ */
+void
+oif_rect_union (
+    struct oif_rect *rect,
+    const struct oif_rect *add)
+{
+    unsigned int x1;
+    unsigned int y1;
+
+    if ((add->width == 0) || (add->height == 0)) {
+        return;
+    }
+    if ((rect->width == 0) || (rect->height == 0)) {
+        *rect = *add;
+        return;
+    }
+    x1 = (rect->x + rect->width > add->x + add->width) ? rect->x + rect->width : add->x + add->width;
+    y1 = (rect->y + rect->height > add->y + add->height) ? rect->y + rect->height : add->y + add->height;
+    rect->x = (rect->x < add->x) ? rect->x : add->x;
+    rect->y = (rect->y < add->y) ? rect->y : add->y;
+    rect->width = x1 - rect->x;
+    rect->height = y1 - rect->y;
+}
+
+
+/*
+ * Run detection kernels.
+ *
+ * oif_run_end returns the first index j > i with pixel_data[j] != pixel_data[i],
+ * or limit if all pixels up to limit are equal.
+ * oif_run_start returns the first index k >= i where at least three equal
+ * pixels start (k + 2 < size), or size if there is no such index.
+ *
+ * All kernels return identical results, they only differ in the number of
+ * pixels compared per instruction. The kernels are selected at runtime
+ * with oif_select_kernels ().
+ */
+typedef unsigned int (*oif_run_end_fn) (
+    const unsigned int *pixel_data,
+    unsigned int i,
+    unsigned int limit);
+
+typedef unsigned int (*oif_run_start_fn) (
+    const unsigned int *pixel_data,
+    unsigned int i,
+    unsigned int size);
+
+static oif_run_end_fn oif_run_end = 0;
+static oif_run_start_fn oif_run_start = 0;
+
+
+static unsigned int
+oif_run_end_scalar (
+    const unsigned int *pixel_data,
+    unsigned int i,
+    unsigned int limit)
+{
+    unsigned int j = i + 1;
+
+    while ((j < limit) && (pixel_data[j] == pixel_data[i])) {
+        j++;
+    }
+    return j;
+}
+
+
+static unsigned int
+oif_run_start_scalar (
+    const unsigned int *pixel_data,
+    unsigned int i,
+    unsigned int size)
+{
+    unsigned int k;
+
+    for (k = i; k + 2 < size; k++) {
+        if ((pixel_data[k] == pixel_data[k + 1]) && (pixel_data[k] == pixel_data[k + 2])) {
+            return k;
+        }
+    }
+    return size;
+}
+
+
+/*
+ * Portable kernels, comparing two pixels at once with 64 bit loads.
+ */
+static inline unsigned long long
+oif_load64 (
+    const unsigned int *p)
+{
+    unsigned long long v;
+
+    memcpy (&v, p, sizeof (v));
+    return v;
+}
+
+
+static unsigned int
+oif_run_end_portable (
+    const unsigned int *pixel_data,
+    unsigned int i,
+    unsigned int limit)
+{
+    unsigned int j = i + 1;
+    unsigned long long pattern;
+
+    pattern = ((unsigned long long) pixel_data[i] << 32) | pixel_data[i];
+    while ((j + 2 <= limit) && (oif_load64 (pixel_data + j) == pattern)) {
+        j += 2;
+    }
+    while ((j < limit) && (pixel_data[j] == pixel_data[i])) {
+        j++;
+    }
+    return j;
+}
+
+
+static unsigned int
+oif_run_start_portable (
+    const unsigned int *pixel_data,
+    unsigned int i,
+    unsigned int size)
+{
+    unsigned int k;
+
+    /* The pixel pairs at k and k + 1 are equal if and only if
+     * the three pixels starting at k are equal */
+    for (k = i; k + 2 < size; k++) {
+        if (oif_load64 (pixel_data + k) == oif_load64 (pixel_data + k + 1)) {
+            return k;
+        }
+    }
+    return size;
+}
+
+
+#ifdef OIF_X86
+
+/*
+ * SSE2 kernels, comparing four pixels at once.
+ */
+__attribute__ ((target ("sse2")))
+static unsigned int
+oif_run_end_sse2 (
+    const unsigned int *pixel_data,
+    unsigned int i,
+    unsigned int limit)
+{
+    unsigned int j = i + 1;
+    unsigned int mask;
+    __m128i pattern = _mm_set1_epi32 ((int) pixel_data[i]);
+    __m128i v;
+
+    while (j + 4 <= limit) {
+        v = _mm_loadu_si128 ((const __m128i *) (pixel_data + j));
+        mask = _mm_movemask_ps (_mm_castsi128_ps (_mm_cmpeq_epi32 (v, pattern)));
+        if (mask != 0xF) {
+            return j + __builtin_ctz (~mask);
+        }
+        j += 4;
+    }
+    while ((j < limit) && (pixel_data[j] == pixel_data[i])) {
+        j++;
+    }
+    return j;
+}
+
+
+__attribute__ ((target ("sse2")))
+static unsigned int
+oif_run_start_sse2 (
+    const unsigned int *pixel_data,
+    unsigned int i,
+    unsigned int size)
+{
+    unsigned int k = i;
+    unsigned int mask;
+    __m128i a;
+    __m128i b;
+    __m128i c;
+
+    while (k + 6 <= size) {
+        a = _mm_loadu_si128 ((const __m128i *) (pixel_data + k));
+        b = _mm_loadu_si128 ((const __m128i *) (pixel_data + k + 1));
+        c = _mm_loadu_si128 ((const __m128i *) (pixel_data + k + 2));
+        mask = _mm_movemask_ps (_mm_castsi128_ps (
+                   _mm_and_si128 (_mm_cmpeq_epi32 (a, b), _mm_cmpeq_epi32 (b, c))));
+        if (mask) {
+            return k + __builtin_ctz (mask);
+        }
+        k += 4;
+    }
+    return oif_run_start_scalar (pixel_data, k, size);
+}
+
+
+/*
+ * AVX2 kernels, comparing eight pixels at once.
+ */
+__attribute__ ((target ("avx2")))
+static unsigned int
+oif_run_end_avx2 (
+    const unsigned int *pixel_data,
+    unsigned int i,
+    unsigned int limit)
+{
+    unsigned int j = i + 1;
+    unsigned int mask;
+    __m256i pattern = _mm256_set1_epi32 ((int) pixel_data[i]);
+    __m256i v;
+
+    while (j + 8 <= limit) {
+        v = _mm256_loadu_si256 ((const __m256i *) (pixel_data + j));
+        mask = _mm256_movemask_ps (_mm256_castsi256_ps (_mm256_cmpeq_epi32 (v, pattern)));
+        if (mask != 0xFF) {
+            return j + __builtin_ctz (~mask);
+        }
+        j += 8;
+    }
+    while ((j < limit) && (pixel_data[j] == pixel_data[i])) {
+        j++;
+    }
+    return j;
+}
+
+
+__attribute__ ((target ("avx2")))
+static unsigned int
+oif_run_start_avx2 (
+    const unsigned int *pixel_data,
+    unsigned int i,
+    unsigned int size)
+{
+    unsigned int k = i;
+    unsigned int mask;
+    __m256i a;
+    __m256i b;
+    __m256i c;
+
+    while (k + 10 <= size) {
+        a = _mm256_loadu_si256 ((const __m256i *) (pixel_data + k));
+        b = _mm256_loadu_si256 ((const __m256i *) (pixel_data + k + 1));
+        c = _mm256_loadu_si256 ((const __m256i *) (pixel_data + k + 2));
+        mask = _mm256_movemask_ps (_mm256_castsi256_ps (
+                   _mm256_and_si256 (_mm256_cmpeq_epi32 (a, b), _mm256_cmpeq_epi32 (b, c))));
+        if (mask) {
+            return k + __builtin_ctz (mask);
+        }
+        k += 8;
+    }
+    return oif_run_start_scalar (pixel_data, k, size);
+}
+
+#endif /* OIF_X86 */
+
+
+/*
+ * Fill and copy kernels used by the decoder.
+ *
+ * oif_fill writes count times the pixel value to dst, oif_copy copies
+ * count pixels from src to dst. The non-temporal (nt) variants bypass
+ * the cache with streaming stores, which is much faster for write-combined
+ * or uncached memory like a mapped framebuffer. After the nt variants
+ * were used, oif_store_fence () must be called.
+ */
+typedef void (*oif_fill_fn) (
+    unsigned int *dst,
+    unsigned int value,
+    unsigned int count);
+
+typedef void (*oif_copy_fn) (
+    unsigned int *dst,
+    const unsigned int *src,
+    unsigned int count);
+
+static oif_fill_fn oif_fill = 0;
+static oif_fill_fn oif_fill_nt = 0;
+static oif_copy_fn oif_copy = 0;
+static oif_copy_fn oif_copy_nt = 0;
+
+
+static void
+oif_fill_scalar (
+    unsigned int *dst,
+    unsigned int value,
+    unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        *dst++ = value;
+    }
+}
+
+
+static void
+oif_copy_scalar (
+    unsigned int *dst,
+    const unsigned int *src,
+    unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        *dst++ = *src++;
+    }
+}
+
+
+static void
+oif_fill_portable (
+    unsigned int *dst,
+    unsigned int value,
+    unsigned int count)
+{
+    unsigned long long pattern = ((unsigned long long) value << 32) | value;
+
+    for (; count >= 2; count -= 2) {
+        memcpy (dst, &pattern, sizeof (pattern));
+        dst += 2;
+    }
+    if (count) {
+        *dst = value;
+    }
+}
+
+
+/* The memcpy of the C library is already vectorized */
+static void
+oif_copy_portable (
+    unsigned int *dst,
+    const unsigned int *src,
+    unsigned int count)
+{
+    memcpy (dst, src, count * sizeof (unsigned int));
+}
+
+
+#ifdef OIF_X86
+
+__attribute__ ((target ("sse2")))
+static void
+oif_fill_sse2 (
+    unsigned int *dst,
+    unsigned int value,
+    unsigned int count)
+{
+    __m128i v = _mm_set1_epi32 ((int) value);
+
+    for (; count >= 4; count -= 4) {
+        _mm_storeu_si128 ((__m128i *) dst, v);
+        dst += 4;
+    }
+    for (; count > 0; count--) {
+        *dst++ = value;
+    }
+}
+
+
+__attribute__ ((target ("sse2")))
+static void
+oif_fill_nt_sse2 (
+    unsigned int *dst,
+    unsigned int value,
+    unsigned int count)
+{
+    __m128i v = _mm_set1_epi32 ((int) value);
+
+    /* Streaming stores need an aligned destination */
+    for (; (count > 0) && ((unsigned long) dst & 15); count--) {
+        *dst++ = value;
+    }
+    for (; count >= 4; count -= 4) {
+        _mm_stream_si128 ((__m128i *) dst, v);
+        dst += 4;
+    }
+    for (; count > 0; count--) {
+        *dst++ = value;
+    }
+}
+
+
+__attribute__ ((target ("sse2")))
+static void
+oif_copy_nt_sse2 (
+    unsigned int *dst,
+    const unsigned int *src,
+    unsigned int count)
+{
+    for (; (count > 0) && ((unsigned long) dst & 15); count--) {
+        *dst++ = *src++;
+    }
+    for (; count >= 4; count -= 4) {
+        _mm_stream_si128 ((__m128i *) dst, _mm_loadu_si128 ((const __m128i *) src));
+        dst += 4;
+        src += 4;
+    }
+    for (; count > 0; count--) {
+        *dst++ = *src++;
+    }
+}
+
+
+__attribute__ ((target ("avx2")))
+static void
+oif_fill_avx2 (
+    unsigned int *dst,
+    unsigned int value,
+    unsigned int count)
+{
+    __m256i v = _mm256_set1_epi32 ((int) value);
+
+    for (; count >= 8; count -= 8) {
+        _mm256_storeu_si256 ((__m256i *) dst, v);
+        dst += 8;
+    }
+    for (; count > 0; count--) {
+        *dst++ = value;
+    }
+}
+
+
+__attribute__ ((target ("avx2")))
+static void
+oif_fill_nt_avx2 (
+    unsigned int *dst,
+    unsigned int value,
+    unsigned int count)
+{
+    __m256i v = _mm256_set1_epi32 ((int) value);
+
+    for (; (count > 0) && ((unsigned long) dst & 31); count--) {
+        *dst++ = value;
+    }
+    for (; count >= 8; count -= 8) {
+        _mm256_stream_si256 ((__m256i *) dst, v);
+        dst += 8;
+    }
+    for (; count > 0; count--) {
+        *dst++ = value;
+    }
+}
+
+
+__attribute__ ((target ("avx2")))
+static void
+oif_copy_nt_avx2 (
+    unsigned int *dst,
+    const unsigned int *src,
+    unsigned int count)
+{
+    for (; (count > 0) && ((unsigned long) dst & 31); count--) {
+        *dst++ = *src++;
+    }
+    for (; count >= 8; count -= 8) {
+        _mm256_stream_si256 ((__m256i *) dst, _mm256_loadu_si256 ((const __m256i *) src));
+        dst += 8;
+        src += 8;
+    }
+    for (; count > 0; count--) {
+        *dst++ = *src++;
+    }
+}
+
+#endif /* OIF_X86 */
+
+
+/*
+ * Makes the streaming stores of the nt kernels globally visible.
+ */
+static inline void
+oif_store_fence (void)
+{
+#ifdef OIF_X86
+    _mm_sfence ();
+#else
+    __sync_synchronize ();
+#endif
+}
+
+
+/*
+ * Sets the kernels used by the encoder and decoder. With OIF_KERNEL_AUTO
+ * the fastest kernels supported by the CPU are used.
+ * Returns the kernel type actually selected.
+ */
+static int
+oif_set_kernels (
+    int kernels)
+{
+#ifdef OIF_X86
+    if (kernels == OIF_KERNEL_AUTO) {
+        __builtin_cpu_init ();
+        if (__builtin_cpu_supports ("avx2")) {
+            kernels = OIF_KERNEL_AVX2;
+        } else if (__builtin_cpu_supports ("sse2")) {
+            kernels = OIF_KERNEL_SSE2;
+        } else {
+            kernels = OIF_KERNEL_PORTABLE;
+        }
+    }
+    if ((kernels == OIF_KERNEL_AVX2) && !__builtin_cpu_supports ("avx2")) {
+        kernels = OIF_KERNEL_SSE2;
+    }
+    if ((kernels == OIF_KERNEL_SSE2) && !__builtin_cpu_supports ("sse2")) {
+        kernels = OIF_KERNEL_PORTABLE;
+    }
+#else
+    if ((kernels == OIF_KERNEL_AUTO) || (kernels == OIF_KERNEL_SSE2) ||
+            (kernels == OIF_KERNEL_AVX2)) {
+        kernels = OIF_KERNEL_PORTABLE;
+    }
+#endif
+
+    switch (kernels) {
+#ifdef OIF_X86
+    case OIF_KERNEL_AVX2:
+        oif_run_end = oif_run_end_avx2;
+        oif_run_start = oif_run_start_avx2;
+        oif_fill = oif_fill_avx2;
+        oif_fill_nt = oif_fill_nt_avx2;
+        oif_copy = oif_copy_portable;
+        oif_copy_nt = oif_copy_nt_avx2;
+        break;
+    case OIF_KERNEL_SSE2:
+        oif_run_end = oif_run_end_sse2;
+        oif_run_start = oif_run_start_sse2;
+        oif_fill = oif_fill_sse2;
+        oif_fill_nt = oif_fill_nt_sse2;
+        oif_copy = oif_copy_portable;
+        oif_copy_nt = oif_copy_nt_sse2;
+        break;
+#endif
+    case OIF_KERNEL_SCALAR:
+        oif_run_end = oif_run_end_scalar;
+        oif_run_start = oif_run_start_scalar;
+        oif_fill = oif_fill_scalar;
+        oif_fill_nt = oif_fill_scalar;
+        oif_copy = oif_copy_scalar;
+        oif_copy_nt = oif_copy_scalar;
+        break;
+    default:
+        kernels = OIF_KERNEL_PORTABLE;
+        oif_run_end = oif_run_end_portable;
+        oif_run_start = oif_run_start_portable;
+        oif_fill = oif_fill_portable;
+        oif_fill_nt = oif_fill_portable;
+        oif_copy = oif_copy_portable;
+        oif_copy_nt = oif_copy_portable;
+        break;
+    }
+    return kernels;
+}
+
+
+static pthread_once_t oif_kernels_once = PTHREAD_ONCE_INIT;
+
+
+static void
+oif_set_auto_kernels (void)
+{
+    oif_set_kernels (OIF_KERNEL_AUTO);
+}
+
+
+/*
+ * Selects the fastest kernels on the first call. The entry points
+ * call this, so the kernels are selected once even if several
+ * threads start encoding or decoding at the same time.
+ */
+static inline void
+oif_init_kernels (void)
+{
+    pthread_once (&oif_kernels_once, oif_set_auto_kernels);
+}
+
+
+/*
+ * Selects the kernels used by the encoder and decoder.
+ * The automatic selection is done first, so it cannot replace
+ * the kernels selected here later.
+ */
+int
+oif_select_kernels (
+    int kernels)
+{
+    oif_init_kernels ();
+    return oif_set_kernels (kernels);
+}
+
+
+/*
+ * Maps colors to palette indices with a hash table.
+ */
+#define OIF_COLOR_MAP_SIZE 1024
+
+struct oif_color_map {
+    unsigned int colors[OIF_COLOR_MAP_SIZE];
+    /* Palette index + 1, 0 for an empty slot */
+    unsigned short indices[OIF_COLOR_MAP_SIZE];
+    /* Number of pixels of each color while the palette is built */
+    unsigned int counts[OIF_COLOR_MAP_SIZE];
+    unsigned int num_colors;
+};
+
+
+static inline unsigned int
+oif_color_slot (
+    const struct oif_color_map *map,
+    unsigned int color)
+{
+    unsigned int slot = (color * 2654435761U) >> 22;
+
+    while (map->indices[slot] && (map->colors[slot] != color)) {
+        slot = (slot + 1) & (OIF_COLOR_MAP_SIZE - 1);
+    }
+    return slot;
+}
+
+
+static inline unsigned int
+oif_color_index (
+    const struct oif_color_map *map,
+    unsigned int color)
+{
+    return map->indices[oif_color_slot (map, color)] - 1;
+}
+
+
+/*
+ * Adds count pixels of a color to the map.
+ * Returns 0 if the map already contains OIF_PALETTE_SIZE colors.
+ */
+static int
+oif_color_add (
+    struct oif_color_map *map,
+    unsigned int color,
+    unsigned int count)
+{
+    unsigned int slot = oif_color_slot (map, color);
+
+    if (map->indices[slot] == 0) {
+        if (map->num_colors == OIF_PALETTE_SIZE) {
+            return 0;
+        }
+        map->colors[slot] = color;
+        map->indices[slot] = (unsigned short) ++map->num_colors;
+    }
+    map->counts[slot] += count;
+    return 1;
+}
+
+
+static int
+oif_compare_counts (
+    const void *a,
+    const void *b)
+{
+    const unsigned int *ca = (const unsigned int *) a;
+    const unsigned int *cb = (const unsigned int *) b;
+
+    /* Descending by count, then ascending by color */
+    if (ca[0] != cb[0]) {
+        return (ca[0] < cb[0]) ? 1 : -1;
+    }
+    return (ca[1] > cb[1]) - (ca[1] < cb[1]);
+}
+
+
+/*
+ * Collects the colors of an image in map.
+ * Returns 0 if the image has more than OIF_PALETTE_SIZE colors.
+ */
+static int
+oif_collect_colors (
+    const unsigned int *pixel_data,
+    unsigned int size,
+    struct oif_color_map *map)
+{
+    unsigned int i = 0;
+    unsigned int j;
+
+    memset (map, 0, sizeof (*map));
+    while (i < size) {
+        j = oif_run_end (pixel_data, i, size);
+        if (!oif_color_add (map, pixel_data[i], j - i)) {
+            return 0;
+        }
+        i = j;
+    }
+    return 1;
+}
+
+
+/*
+ * Creates a palette from the colors in map, the most frequent colors
+ * get the lowest indices. The indices in map are updated.
+ */
+static void
+oif_create_palette (
+    struct oif_color_map *map,
+    struct oif_palette *palette)
+{
+    unsigned int entries[OIF_PALETTE_SIZE][2];
+    unsigned int n = 0;
+    unsigned int slot;
+    unsigned int i;
+
+    for (slot = 0; slot < OIF_COLOR_MAP_SIZE; slot++) {
+        if (map->indices[slot]) {
+            entries[n][0] = map->counts[slot];
+            entries[n][1] = map->colors[slot];
+            n++;
+        }
+    }
+    qsort (entries, n, sizeof (entries[0]), oif_compare_counts);
+    memset (palette, 0, sizeof (*palette));
+    palette->num_colors = n;
+    for (i = 0; i < n; i++) {
+        palette->colors[i] = entries[i][1];
+        map->indices[oif_color_slot (map, entries[i][1])] = (unsigned short) (i + 1);
+    }
+}
+
+
+/*
+ * Sets the indices in map to the ones of palette.
+ * Returns 0 if a color of the map is not in the palette.
+ */
+static int
+oif_use_palette (
+    struct oif_color_map *map,
+    const struct oif_palette *palette)
+{
+    struct oif_color_map palette_map;
+    unsigned int slot;
+    unsigned int i;
+
+    memset (&palette_map, 0, sizeof (palette_map));
+    for (i = 0; i < palette->num_colors; i++) {
+        oif_color_add (&palette_map, palette->colors[i], 1);
+    }
+    for (slot = 0; slot < OIF_COLOR_MAP_SIZE; slot++) {
+        if (map->indices[slot]) {
+            i = palette_map.indices[oif_color_slot (&palette_map, map->colors[slot])];
+            if (i == 0) {
+                return 0;
+            }
+            map->indices[slot] = (unsigned short) i;
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Writes a code of the given type. The WSL types and POS get the line.
+ * If the count or the line do not fit into the code, an EXT code
+ * (version 2) is written.
+ */
+static unsigned int *
+oif_encode_code (
+    unsigned int *curr_code,
+    unsigned int type,
+    unsigned int count,
+    int line)
+{
+    if ((count <= 0xFFFF) && (line <= 0x0FFF)) {
+        *curr_code++ = type | ((line >= 0) ? ((unsigned int) line << 16) : 0) | count;
+    } else {
+        *curr_code++ = OIF_EXT_TYPE | (type >> 4) | count;
+        if (line >= 0) {
+            *curr_code++ = (unsigned int) line;
+        }
+    }
+    return curr_code;
+}
+
+
+/*
+ * Returns the version needed to decode the codes from curr_code up
+ * to the EOI code: OIF_VERSION_COMPAT if there are only the code types
+ * of version 1 (UNCOMPR, UNCOMPR_WSL, RLE and RLE_WSL), so version 1
+ * decoders can still read the image, otherwise OIF_VERSION.
+ */
+static unsigned short
+oif_code_version (
+    const unsigned int *curr_code)
+{
+    unsigned int code;
+
+    for (;;) {
+        code = *curr_code++;
+        switch (code & 0xF0000000) {
+        case OIF_EOI_TYPE:
+            return OIF_VERSION_COMPAT;
+        case OIF_UNCOMPR_TYPE:
+        case OIF_UNCOMPR_WSL_TYPE:
+            curr_code += code & 0x0000FFFF;
+            break;
+        case OIF_RLE_TYPE:
+        case OIF_RLE_WSL_TYPE:
+            curr_code++;
+            break;
+        default:
+            return OIF_VERSION;
+        }
+    }
+}
+
+
+/*
+ * Writes a sequence of uncompressed pixels. With a color map, the pixels
+ * are written as palette indices with the smallest possible index size.
+ */
+static unsigned int *
+oif_encode_literal (
+    unsigned int *curr_code,
+    const unsigned int *pixel_data,
+    unsigned int count,
+    int line,
+    const struct oif_color_map *map)
+{
+    unsigned int max_index = 0;
+    unsigned int index;
+    unsigned int bits;
+    unsigned int shift;
+    unsigned int word;
+    unsigned int i;
+
+    /* Uncompressed pixels are split into codes with a 16 bit count,
+     * this costs one word per 65535 pixels and keeps version 1 */
+    while (count > 0xFFFF) {
+        curr_code = oif_encode_literal (curr_code, pixel_data, 0xFFFF, line, map);
+        pixel_data += 0xFFFF;
+        count -= 0xFFFF;
+        line = -1;
+    }
+
+    if (map == 0) {
+        curr_code = oif_encode_code (curr_code, (line >= 0) ? OIF_UNCOMPR_WSL_TYPE : OIF_UNCOMPR_TYPE,
+                                     count, line);
+        memcpy (curr_code, pixel_data, count * sizeof (unsigned int));
+        return curr_code + count;
+    }
+
+    if (line >= 0) {
+        /* There is no WSL type for indices, so an empty WSL code
+         * sets the start position */
+        curr_code = oif_encode_code (curr_code, OIF_UNCOMPR_WSL_TYPE, 0, line);
+    }
+    for (i = 0; i < count; i++) {
+        index = oif_color_index (map, pixel_data[i]);
+        if (index > max_index) {
+            max_index = index;
+        }
+    }
+    bits = (max_index < 2) ? 1 : (max_index < 4) ? 2 : (max_index < 16) ? 4 : 8;
+    *curr_code++ = OIF_INDEXED_TYPE | (bits << 24) | count;
+
+    /* The indices are packed starting with the least significant bits */
+    word = 0;
+    shift = 0;
+    for (i = 0; i < count; i++) {
+        word |= oif_color_index (map, pixel_data[i]) << shift;
+        shift += bits;
+        if (shift == 32) {
+            *curr_code++ = word;
+            word = 0;
+            shift = 0;
+        }
+    }
+    if (shift > 0) {
+        *curr_code++ = word;
+    }
+    return curr_code;
+}
+
+
+/*
+ * Writes a sequence of count equal pixels.
+ */
+static unsigned int *
+oif_encode_run (
+    unsigned int *curr_code,
+    unsigned int value,
+    unsigned int count,
+    int line,
+    const struct oif_options *opts,
+    const struct oif_color_map *map)
+{
+    if (opts && (opts->flags & OIF_OPT_SKIP) && (value == opts->skip_value)) {
+        /* Don't care pixels are skipped, there is no WSL type for
+         * that, so an empty WSL code sets the start position */
+        if (line >= 0) {
+            curr_code = oif_encode_code (curr_code, OIF_UNCOMPR_WSL_TYPE, 0, line);
+        }
+        curr_code = oif_encode_code (curr_code, OIF_SKIP_TYPE, count, -1);
+    } else if (map) {
+        if (line >= 0) {
+            curr_code = oif_encode_code (curr_code, OIF_UNCOMPR_WSL_TYPE, 0, line);
+        }
+        *curr_code++ = OIF_INDEXED_RLE_TYPE | (oif_color_index (map, value) << 16) | count;
+    } else {
+        /* RLE for more than 3 repeated pixels */
+        curr_code = oif_encode_code (curr_code, (line >= 0) ? OIF_RLE_WSL_TYPE : OIF_RLE_TYPE,
+                                     count, line);
+        *curr_code++ = value;
+    }
+    return curr_code;
+}
+
+
+/*
+ * Costs of the codes for oif_encode_optimal, in 1/64 bit. A code costs
+ * one unit more than its size, so the smallest output with the fewest
+ * codes is selected.
+ */
+#define OIF_COST_BITS 64
+#define OIF_COST_CODE 1
+
+/*
+ * Encodes the pixels like oif_encode_pixels, but selects the runs and
+ * uncompressed pixels with the smallest output (OIF_EFFORT_MAX).
+ * The pixels are split into sequences of equal pixels, each one is
+ * either a run or part of uncompressed pixels. The best choice is found
+ * by dynamic programming with two states before each sequence: the
+ * previous code is a run, or uncompressed pixels can be appended.
+ * For palette indices, the index size of the palette is used for the
+ * costs, the actual codes may use smaller indices.
+ * Returns 0 if there is not enough memory.
+ */
+static unsigned int *
+oif_encode_optimal (
+    const unsigned int *pixel_data,
+    unsigned int size,
+    unsigned int *curr_code,
+    int line,
+    const struct oif_options *opts,
+    const struct oif_color_map *map)
+{
+    unsigned int *lengths;
+    unsigned char *choices;
+    unsigned long long run_cost;
+    unsigned long long lit_cost;
+    unsigned long long closed;
+    unsigned long long open;
+    unsigned long long next_closed;
+    unsigned long long next_open;
+    unsigned long long pixel_cost = 32 * OIF_COST_BITS;
+    unsigned long long lit_code_cost = 32 * OIF_COST_BITS + OIF_COST_CODE;
+    unsigned int max_index = 0;
+    unsigned int num_seqs = 0;
+    unsigned int max_run;
+    unsigned int limit;
+    unsigned int state;
+    unsigned int i;
+    unsigned int j;
+    unsigned int k;
+    int skip = opts && (opts->flags & OIF_OPT_SKIP);
+
+    lengths = (unsigned int *) malloc (size * sizeof (unsigned int));
+    choices = (unsigned char *) malloc (size);
+    if ((lengths == 0) || (choices == 0)) {
+        free (lengths);
+        free (choices);
+        return 0;
+    }
+
+    if (map) {
+        for (i = 0; i < OIF_COLOR_MAP_SIZE; i++) {
+            if (map->indices[i] > max_index) {
+                max_index = map->indices[i];
+            }
+        }
+        /* indices[] contains the index + 1 */
+        pixel_cost = ((max_index <= 2) ? 1 : (max_index <= 4) ? 2 : (max_index <= 16) ? 4 : 8) *
+            OIF_COST_BITS;
+        /* On average, half of the last word is unused */
+        lit_code_cost = 48 * OIF_COST_BITS + OIF_COST_CODE;
+    }
+
+    /* Split into sequences of equal pixels */
+    for (i = 0; i < size; i = j) {
+        max_run = map ? 0xFFFF : OIF_EXT_MAX_COUNT;
+        if (skip && (pixel_data[i] == opts->skip_value)) {
+            max_run = OIF_EXT_MAX_COUNT;
+        }
+        limit = (size - i > max_run) ? i + max_run : size;
+        j = oif_run_end (pixel_data, i, limit);
+        lengths[num_seqs++] = j - i;
+    }
+
+    /* The costs up to the current sequence, when the last code is a run
+     * (closed) or uncompressed pixels (open). choices contains the
+     * previous state of both choices: bit 0 for the run, bit 1 for the
+     * uncompressed pixels, 1 = open. */
+    closed = 0;
+    open = ~0ULL >> 1;
+    for (i = 0, k = 0; k < num_seqs; i += lengths[k], k++) {
+        if (skip && (pixel_data[i] == opts->skip_value)) {
+            run_cost = 32 * OIF_COST_BITS + OIF_COST_CODE;
+        } else {
+            run_cost = (map ? 32 : 64) * OIF_COST_BITS + OIF_COST_CODE;
+        }
+        lit_cost = lengths[k] * pixel_cost;
+        choices[k] = 0;
+        if (lengths[k] >= 2) {
+            next_closed = run_cost + ((open < closed) ? open : closed);
+            choices[k] |= (open < closed) ? 1 : 0;
+        } else {
+            next_closed = ~0ULL >> 1;
+        }
+        if (open <= closed + lit_code_cost) {
+            next_open = open + lit_cost;
+            choices[k] |= 2;
+        } else {
+            next_open = closed + lit_code_cost + lit_cost;
+        }
+        closed = next_closed;
+        open = next_open;
+    }
+
+    /* Go back to find the choice for each sequence, bit 2 is set
+     * for uncompressed pixels */
+    state = (open < closed) ? 1 : 0;
+    for (k = num_seqs; k-- > 0;) {
+        if (state) {
+            state = (choices[k] >> 1) & 1;
+            choices[k] = 4;
+        } else {
+            state = choices[k] & 1;
+            choices[k] = 0;
+        }
+    }
+
+    for (i = 0, j = 0, k = 0; k < num_seqs; i += lengths[k], k++) {
+        /* j is the start of the uncompressed pixels */
+        if (choices[k] == 0) {
+            if (j < i) {
+                curr_code = oif_encode_literal (curr_code, pixel_data + j, i - j, line, map);
+                line = -1;
+            }
+            curr_code = oif_encode_run (curr_code, pixel_data[i], lengths[k], line, opts, map);
+            line = -1;
+            j = i + lengths[k];
+        }
+    }
+    if (j < size) {
+        curr_code = oif_encode_literal (curr_code, pixel_data + j, size - j, line, map);
+    }
+
+    free (lengths);
+    free (choices);
+    return curr_code;
+}
+
+
+/*
+ * Encodes size pixels and returns the position after the last code.
+ * If line is >= 0, the first code is a WSL code for that line, so the
+ * pixels are placed at the start of the line by the decoder.
+ * opts may be 0 for the default options. With a color map, the pixels
+ * are encoded as palette indices.
+ * No EOI code is added.
+ */
+static unsigned int *
+oif_encode_pixels (
+    const unsigned int *pixel_data,
+    unsigned int size,
+    unsigned int *curr_code,
+    int line,
+    const struct oif_options *opts,
+    const struct oif_color_map *map)
+{
+    unsigned int i;
+    unsigned int j;
+    unsigned int k;
+    unsigned int limit;
+    unsigned int max_run;
+    int skip = 0;
+    unsigned int skip_value = 0;
+    unsigned int *end_code;
+
+    if (opts && (opts->flags & OIF_OPT_SKIP)) {
+        skip = 1;
+        skip_value = opts->skip_value;
+    }
+    if (opts && (opts->effort == OIF_EFFORT_MAX)) {
+        end_code = oif_encode_optimal (pixel_data, size, curr_code, line, opts, map);
+        if (end_code) {
+            return end_code;
+        }
+        /* Not enough memory, use the greedy encoding */
+    }
+
+    i = 0;
+    k = 0;
+    while (i < size) {
+        /* Skip the pixels that cannot start a sequence of equal pixels */
+        i = oif_run_start (pixel_data, i, size);
+        if (i >= size) {
+            i = size;
+            break;
+        }
+        /* Longer sequences need an EXT code, there is none for indices */
+        max_run = map ? 0xFFFF : OIF_EXT_MAX_COUNT;
+        if (skip && (pixel_data[i] == skip_value)) {
+            max_run = OIF_EXT_MAX_COUNT;
+        }
+        limit = (size - i > max_run) ? i + max_run : size;
+        j = oif_run_end (pixel_data, i, limit);
+        /* Exceeds minimum number of equal pixels */
+        if (k < i) {
+            /* There was uncompressed data before the sequence of equal pixels */
+            curr_code = oif_encode_literal (curr_code, pixel_data + k, i - k, line, map);
+            line = -1;
+        }
+        curr_code = oif_encode_run (curr_code, pixel_data[i], j - i, line, opts, map);
+        line = -1;
+        i = j;
+        k = i;
+    }
+    if (k < i) {
+        /* There was uncompressed data after the last sequence of equal pixels */
+        curr_code = oif_encode_literal (curr_code, pixel_data + k, i - k, line, map);
+    }
+    return curr_code;
+}
+
+
+/*
+ * Encodes rows of pixels like oif_encode_pixels, but with OIF_OPT_UP
+ * rows that repeat the row above are encoded with an UP code.
+ * Consecutive repeated rows share one UP code of up to OIF_EXT_MAX_COUNT
+ * pixels, longer runs of rows are split into several UP codes of whole rows.
+ * The first row is never encoded as UP, so the rows do not depend on
+ * pixels before them.
+ * Rows of one color are left to the RLE codes, which are decoded faster.
+ */
+static unsigned int *
+oif_encode_rows (
+    const unsigned int *pixel_data,
+    unsigned int width,
+    unsigned int rows,
+    unsigned int *curr_code,
+    int line,
+    const struct oif_options *opts,
+    const struct oif_color_map *map)
+{
+    unsigned int line_size = width * sizeof (unsigned int);
+    unsigned int max_rows = (width > 0) ? OIF_EXT_MAX_COUNT / width : 0;
+    unsigned int start = 0;
+    unsigned int up_rows;
+    unsigned int y;
+    unsigned int y1;
+
+    if (!opts || !(opts->flags & OIF_OPT_UP) || (max_rows == 0)) {
+        return oif_encode_pixels (pixel_data, width * rows, curr_code, line, opts, map);
+    }
+    for (y = 1; y < rows; y++) {
+        if ((memcmp (pixel_data + y * width, pixel_data + (y - 1) * width, line_size) != 0) ||
+                (oif_run_end (pixel_data + y * width, 0, width) == width)) {
+            continue;
+        }
+        for (y1 = y + 1; (y1 < rows) &&
+                 (memcmp (pixel_data + y1 * width, pixel_data + (y1 - 1) * width, line_size) == 0);
+             y1++) {
+        }
+        curr_code = oif_encode_pixels (pixel_data + start * width, (y - start) * width,
+                                       curr_code, line, opts, map);
+        line = -1;
+        for (; y < y1; y += up_rows) {
+            up_rows = (y1 - y < max_rows) ? y1 - y : max_rows;
+            curr_code = oif_encode_code (curr_code, OIF_UP_TYPE, up_rows * width, -1);
+        }
+        start = y1;
+        y = y1;
+    }
+    if (start < rows) {
+        curr_code = oif_encode_pixels (pixel_data + start * width, (rows - start) * width,
+                                       curr_code, line, opts, map);
+    }
+    return curr_code;
+}
+
+
+/*
+ * Initializes the encoder options with the defaults.
+ */
+void
+oif_init_options (
+    struct oif_options *opts)
+{
+    memset (opts, 0, sizeof (*opts));
+}
+
+
+/*
+ * Compresses an image data buffer.
+ * The header must contain magic, width and height, and id.
+ * The size is set after the compression,
+ * compr_data must be a buffer of OIF_COMPRESS_BOUND (width, height) bytes.
+ */
+void
+oif_compress (
+    struct oif_header *header,
+    unsigned char *img_data,
+    unsigned char *compr_data)
+{
+    oif_compress_ex (header, img_data, compr_data, 0);
+}
+
+
+/*
+ * Compresses an image data buffer like oif_compress with the
+ * given encoder options.
+ */
+void
+oif_compress_ex (
+    struct oif_header *header,
+    unsigned char *img_data,
+    unsigned char *compr_data,
+    const struct oif_options *opts)
+{
+    unsigned int *curr_code = (unsigned int *) compr_data;
+    unsigned int *pixel_data = (unsigned int *) img_data;
+    unsigned int size = header->width * header->height;
+    struct oif_color_map map;
+    struct oif_palette palette;
+    struct oif_color_map *palette_map = 0;
+    /* The image depends on a previous image that sent the palette,
+     * or on the pixels left by SKIP codes */
+    int uses_prev = opts && (opts->flags & OIF_OPT_SKIP);
+
+    oif_init_kernels ();
+
+    if (opts && (opts->flags & OIF_OPT_PALETTE) && oif_collect_colors (pixel_data, size, &map)) {
+        /* The image has few colors, so it is encoded with palette indices.
+         * The palette is only sent if the persistent palette does not
+         * contain all colors. */
+        if (!opts->palette || (opts->palette->num_colors == 0) ||
+                !oif_use_palette (&map, opts->palette)) {
+            oif_create_palette (&map, &palette);
+            *curr_code++ = OIF_PALETTE_TYPE | palette.num_colors;
+            memcpy (curr_code, palette.colors, palette.num_colors * sizeof (unsigned int));
+            curr_code += palette.num_colors;
+            if (opts->palette) {
+                memcpy (opts->palette, &palette, sizeof (palette));
+            }
+        } else {
+            uses_prev = 1;
+        }
+        palette_map = &map;
+    }
+
+    curr_code = oif_encode_rows (pixel_data, header->width, header->height, curr_code, -1,
+                                 opts, palette_map);
+    *curr_code++ = OIF_EOI_TYPE;
+    header->version = oif_code_version ((unsigned int *) compr_data);
+    header->reserved[OIF_RES_FLAGS] &= ~(OIF_RES_FLAG_INDEX | OIF_RES_FLAG_KEY);
+    if (!uses_prev) {
+        header->reserved[OIF_RES_FLAGS] |= OIF_RES_FLAG_KEY;
+    }
+    header->img_size = (unsigned int) ((unsigned char *) curr_code - compr_data);
+}
+
+
+/*
+ * Encodes the rectangle with the upper left corner x, y of an image
+ * with the given width. Each row starts with a POS code.
+ */
+static unsigned int *
+oif_encode_rect (
+    const unsigned int *pixel_data,
+    unsigned int width,
+    unsigned int x,
+    unsigned int y,
+    unsigned int rect_width,
+    unsigned int rect_height,
+    unsigned int *curr_code)
+{
+    unsigned int row;
+
+    for (row = y; row < y + rect_height; row++) {
+        curr_code = oif_encode_code (curr_code, OIF_POS_TYPE, x, (int) row);
+        curr_code = oif_encode_pixels (pixel_data + row * width + x, rect_width,
+                                       curr_code, -1, 0, 0);
+    }
+    return curr_code;
+}
+
+
+/*
+ * Compresses only the rectangle x, y, rect_width, rect_height.
+ * Full lines are encoded with a WSL code, otherwise each row
+ * starts with a POS code.
+ */
+int
+oif_compress_rect (
+    struct oif_header *header,
+    unsigned char *img_data,
+    unsigned char *compr_data,
+    unsigned int x,
+    unsigned int y,
+    unsigned int rect_width,
+    unsigned int rect_height)
+{
+    unsigned int *curr_code = (unsigned int *) compr_data;
+    unsigned int *pixel_data = (unsigned int *) img_data;
+    unsigned int width = header->width;
+
+    if ((x > width) || (rect_width > width - x) ||
+            (y > header->height) || (rect_height > header->height - y)) {
+        return OIF_ERR_RANGE;
+    }
+    oif_init_kernels ();
+    if ((rect_width > 0) && (rect_height > 0)) {
+        if ((x == 0) && (rect_width == width)) {
+            curr_code = oif_encode_rows (pixel_data + y * width, width, rect_height,
+                                         curr_code, (int) y, 0, 0);
+        } else {
+            curr_code = oif_encode_rect (pixel_data, width, x, y, rect_width, rect_height,
+                                         curr_code);
+        }
+    }
+    *curr_code++ = OIF_EOI_TYPE;
+    header->version = oif_code_version ((unsigned int *) compr_data);
+    header->reserved[OIF_RES_FLAGS] &= ~(OIF_RES_FLAG_INDEX | OIF_RES_FLAG_KEY);
+    header->img_size = (unsigned int) ((unsigned char *) curr_code - compr_data);
+    return 0;
+}
+
+
+/*
+ * Encodes the lines of pixel_data that differ from prev_pixel_data.
+ * Each range of changed lines starts with a WSL code, unchanged
+ * lines are not encoded at all. If only some columns of the lines have
+ * changed, only these columns are encoded, each row with a POS code.
+ * If prev_rows is not 0, it contains the pointers to the rows of the
+ * previous image, which are used instead of prev_pixel_data.
+ * The number of encoded lines is added to lines.
+ */
+static unsigned int *
+oif_encode_delta (
+    struct oif_header *header,
+    const unsigned int *prev_pixel_data,
+    unsigned int *const *prev_rows,
+    const unsigned int *pixel_data,
+    unsigned int *curr_code,
+    int *lines)
+{
+    unsigned int width = header->width;
+    unsigned int line_size = width * sizeof (unsigned int);
+    const unsigned int *prev_row;
+    const unsigned int *row;
+    unsigned int y;
+    unsigned int y0;
+    unsigned int x0;
+    unsigned int x1;
+    unsigned int i;
+
+    y = 0;
+    while (y < header->height) {
+        prev_row = prev_rows ? prev_rows[y] : prev_pixel_data + y * width;
+        if (memcmp (pixel_data + y * width, prev_row, line_size) == 0) {
+            y++;
+            continue;
+        }
+        y0 = y;
+        x0 = width;
+        x1 = 0;
+        while ((y < header->height) &&
+                memcmp (pixel_data + y * width, prev_row, line_size)) {
+            /* Columns that have changed */
+            row = pixel_data + y * width;
+            for (i = 0; i < x0 && row[i] == prev_row[i]; i++) {
+            }
+            x0 = i;
+            for (i = width; i > x1 && row[i - 1] == prev_row[i - 1]; i--) {
+            }
+            x1 = i;
+            y++;
+            if (y < header->height) {
+                prev_row = prev_rows ? prev_rows[y] : prev_pixel_data + y * width;
+            }
+        }
+        if (x1 - x0 + 2 <= width) {
+            /* Only a part of the lines, the POS codes cost
+             * less than the unchanged pixels */
+            curr_code = oif_encode_rect (pixel_data, width, x0, y0, x1 - x0, y - y0, curr_code);
+        } else {
+            curr_code = oif_encode_rows (pixel_data + y0 * width, width, y - y0,
+                                         curr_code, (int) y0, 0, 0);
+        }
+        *lines += y - y0;
+    }
+    return curr_code;
+}
+
+
+/*
+ * Compresses only the lines of img_data that differ from prev_data,
+ * see oif_encode_delta.
+ * Returns the number of encoded lines, 0 if the images are identical.
+ */
+int
+oif_compress_delta (
+    struct oif_header *header,
+    unsigned char *prev_data,
+    unsigned char *img_data,
+    unsigned char *compr_data)
+{
+    unsigned int *curr_code = (unsigned int *) compr_data;
+    int lines = 0;
+
+    oif_init_kernels ();
+
+    curr_code = oif_encode_delta (header, (unsigned int *) prev_data, 0, (unsigned int *) img_data,
+                                  curr_code, &lines);
+    *curr_code++ = OIF_EOI_TYPE;
+    header->version = oif_code_version ((unsigned int *) compr_data);
+    header->reserved[OIF_RES_FLAGS] &= ~(OIF_RES_FLAG_INDEX | OIF_RES_FLAG_KEY);
+    header->img_size = (unsigned int) ((unsigned char *) curr_code - compr_data);
+    return lines;
+}
+
+
+/*
+ * Copies the rectangle with the upper left corner src_x, src_y to
+ * dst_x, dst_y in the same image, for the COPY code. The rectangles
+ * may overlap, the rows are copied in the right order and with memmove.
+ */
+static void
+oif_copy_rect (
+    unsigned int *pixel_data,
+    unsigned int width,
+    unsigned int dst_x,
+    unsigned int dst_y,
+    unsigned int src_x,
+    unsigned int src_y,
+    unsigned int rect_width,
+    unsigned int rect_height)
+{
+    unsigned int row;
+
+    if (dst_y <= src_y) {
+        for (row = 0; row < rect_height; row++) {
+            memmove (pixel_data + (dst_y + row) * width + dst_x,
+                     pixel_data + (src_y + row) * width + src_x,
+                     rect_width * sizeof (unsigned int));
+        }
+    } else {
+        for (row = rect_height; row-- > 0;) {
+            memmove (pixel_data + (dst_y + row) * width + dst_x,
+                     pixel_data + (src_y + row) * width + src_x,
+                     rect_width * sizeof (unsigned int));
+        }
+    }
+}
+
+
+/*
+ * Compresses img_data as a delta to prev_data, like oif_compress_delta,
+ * but first the moved rectangles are copied with COPY codes.
+ * The image the decoder has after the copies only differs from prev_data
+ * in the rows the moves write to. Only these rows are copied and moved,
+ * the other rows are compared with prev_data directly.
+ * Returns the number of lines encoded after the copies.
+ */
+int
+oif_compress_motion (
+    struct oif_header *header,
+    unsigned char *prev_data,
+    unsigned char *img_data,
+    unsigned char *compr_data,
+    const struct oif_motion *moves,
+    unsigned int num_moves)
+{
+    unsigned int *curr_code = (unsigned int *) compr_data;
+    unsigned int *prev_pixel_data = (unsigned int *) prev_data;
+    unsigned int width = header->width;
+    unsigned int **rows = 0;
+    unsigned int *pool = 0;
+    unsigned int num_rows = 0;
+    unsigned int dst_x;
+    unsigned int dst_y;
+    unsigned int row;
+    unsigned int i;
+    int lines = 0;
+
+    oif_init_kernels ();
+
+    for (i = 0; i < num_moves; i++) {
+        dst_x = moves[i].x + moves[i].dx;
+        dst_y = moves[i].y + moves[i].dy;
+        if ((moves[i].x > width) || (moves[i].width > width - moves[i].x) ||
+                (moves[i].y > header->height) || (moves[i].height > header->height - moves[i].y) ||
+                (dst_x > width) || (moves[i].width > width - dst_x) ||
+                (dst_y > header->height) || (moves[i].height > header->height - dst_y) ||
+                (moves[i].width > 0xFFFF)) {
+            return OIF_ERR_RANGE;
+        }
+        if (moves[i].width > 0) {
+            num_rows += moves[i].height;
+        }
+    }
+
+    if (num_rows > 0) {
+        /* The row pointers, followed by the rows written by the moves */
+        if (num_rows > header->height) {
+            num_rows = header->height;
+        }
+        rows = (unsigned int **) malloc (header->height * sizeof (unsigned int *) +
+                                         (size_t) num_rows * width * sizeof (unsigned int));
+        if (rows == 0) {
+            return -1;
+        }
+        pool = (unsigned int *) (rows + header->height);
+        for (row = 0; row < header->height; row++) {
+            rows[row] = prev_pixel_data + row * width;
+        }
+    }
+
+    for (i = 0; i < num_moves; i++) {
+        if ((moves[i].width == 0) || (moves[i].height == 0)) {
+            continue;
+        }
+        dst_x = moves[i].x + moves[i].dx;
+        dst_y = moves[i].y + moves[i].dy;
+        curr_code = oif_encode_code (curr_code, OIF_POS_TYPE, dst_x, (int) dst_y);
+        *curr_code++ = OIF_COPY_TYPE | moves[i].width;
+        *curr_code++ = moves[i].height;
+        *curr_code++ = moves[i].y;
+        *curr_code++ = moves[i].x;
+
+        for (row = dst_y; row < dst_y + moves[i].height; row++) {
+            if (rows[row] == prev_pixel_data + row * width) {
+                memcpy (pool, rows[row], width * sizeof (unsigned int));
+                rows[row] = pool;
+                pool += width;
+            }
+        }
+        /* Overlapping rectangles are copied in the order of oif_copy_rect */
+        if (dst_y <= moves[i].y) {
+            for (row = 0; row < moves[i].height; row++) {
+                memmove (rows[dst_y + row] + dst_x, rows[moves[i].y + row] + moves[i].x,
+                         moves[i].width * sizeof (unsigned int));
+            }
+        } else {
+            for (row = moves[i].height; row-- > 0;) {
+                memmove (rows[dst_y + row] + dst_x, rows[moves[i].y + row] + moves[i].x,
+                         moves[i].width * sizeof (unsigned int));
+            }
+        }
+    }
+
+    /* The remaining differences */
+    curr_code = oif_encode_delta (header, prev_pixel_data, rows, (unsigned int *) img_data,
+                                  curr_code, &lines);
+    free (rows);
+
+    *curr_code++ = OIF_EOI_TYPE;
+    header->version = oif_code_version ((unsigned int *) compr_data);
+    header->reserved[OIF_RES_FLAGS] &= ~(OIF_RES_FLAG_INDEX | OIF_RES_FLAG_KEY);
+    header->img_size = (unsigned int) ((unsigned char *) curr_code - compr_data);
+    return lines;
+}
+
+
+/*
+ * Searches the displacement of the changed part of img_data within
+ * range pixels. Only every fourth pixel of every fourth row is compared.
+ * Returns 1 and the move if a displacement was found, otherwise 0.
+ */
+int
+oif_find_motion (
+    struct oif_header *header,
+    unsigned char *prev_data,
+    unsigned char *img_data,
+    int range,
+    struct oif_motion *motion)
+{
+    const unsigned int *pixel_data = (unsigned int *) img_data;
+    const unsigned int *prev_pixel_data = (unsigned int *) prev_data;
+    unsigned int width = header->width;
+    unsigned int height = header->height;
+    unsigned int line_size = width * sizeof (unsigned int);
+    unsigned int x0 = width;
+    unsigned int x1 = 0;
+    unsigned int y0 = height;
+    unsigned int y1 = 0;
+    unsigned int matches;
+    unsigned int best_matches;
+    unsigned int x;
+    unsigned int y;
+    int best_dx = 0;
+    int best_dy = 0;
+    int dx;
+    int dy;
+    int sx;
+    int sy;
+    int left;
+    int top;
+    int right;
+    int bottom;
+
+    /* The changed rectangle */
+    for (y = 0; y < height; y++) {
+        if (memcmp (pixel_data + y * width, prev_pixel_data + y * width, line_size) == 0) {
+            continue;
+        }
+        if (y0 == height) {
+            y0 = y;
+        }
+        y1 = y + 1;
+        for (x = 0; x < x0 && pixel_data[y * width + x] == prev_pixel_data[y * width + x]; x++) {
+        }
+        x0 = x;
+        for (x = width; x > x1 && pixel_data[y * width + x - 1] == prev_pixel_data[y * width + x - 1]; x--) {
+        }
+        x1 = x;
+    }
+    if (y0 == height) {
+        return 0;
+    }
+
+    /* Compare the samples with the previous image at all displacements,
+     * the displacement 0 is the reference */
+    best_matches = 0;
+    for (dy = -range; dy <= range; dy++) {
+        for (dx = -range; dx <= range; dx++) {
+            matches = 0;
+            for (y = y0; y < y1; y += 4) {
+                sy = (int) y - dy;
+                if ((sy < 0) || (sy >= (int) height)) {
+                    continue;
+                }
+                for (x = x0; x < x1; x += 4) {
+                    sx = (int) x - dx;
+                    if ((sx >= 0) && (sx < (int) width)) {
+                        matches += (pixel_data[y * width + x] == prev_pixel_data[sy * width + sx]);
+                    }
+                }
+            }
+            if ((matches > best_matches) || ((dx == 0) && (dy == 0) && (matches == best_matches))) {
+                best_matches = matches;
+                best_dx = dx;
+                best_dy = dy;
+            }
+        }
+    }
+    if ((best_dx == 0) && (best_dy == 0)) {
+        return 0;
+    }
+
+    /* The changed rectangle is the destination, clipped so that the
+     * source is inside the image as well */
+    left = ((int) x0 - best_dx < 0) ? best_dx : (int) x0;
+    top = ((int) y0 - best_dy < 0) ? best_dy : (int) y0;
+    right = ((int) x1 - best_dx > (int) width) ? (int) width + best_dx : (int) x1;
+    bottom = ((int) y1 - best_dy > (int) height) ? (int) height + best_dy : (int) y1;
+    if ((left >= right) || (top >= bottom)) {
+        return 0;
+    }
+    motion->x = left - best_dx;
+    motion->y = top - best_dy;
+    motion->width = right - left;
+    motion->height = bottom - top;
+    motion->dx = best_dx;
+    motion->dy = best_dy;
+    return 1;
+}
+
+
+/*
+ * A range of stripes of an image, compressed by one thread.
+ */
+struct oif_compress_worker {
+    struct oif_header *header;
+    const unsigned int *pixel_data;
+    unsigned int stripe_lines;
+    unsigned int first_stripe;
+    unsigned int last_stripe;
+    /* Offset of each stripe in compr_data in words */
+    unsigned int *offsets;
+    unsigned int *compr_data;
+    unsigned int compr_words;
+    pthread_t thread;
+    int started;
+};
+
+
+static void *
+oif_compress_worker (
+    void *arg)
+{
+    struct oif_compress_worker *worker = (struct oif_compress_worker *) arg;
+    struct oif_header *header = worker->header;
+    unsigned int *curr_code = worker->compr_data;
+    unsigned int y0;
+    unsigned int y1;
+    unsigned int i;
+
+    for (i = worker->first_stripe; i <= worker->last_stripe; i++) {
+        y0 = i * worker->stripe_lines;
+        y1 = (y0 + worker->stripe_lines < header->height) ?
+            y0 + worker->stripe_lines : header->height;
+        worker->offsets[i] = (unsigned int) (curr_code - worker->compr_data);
+        curr_code = oif_encode_rows (worker->pixel_data + y0 * header->width,
+                                     header->width, y1 - y0, curr_code,
+                                     (int) y0, 0, 0);
+    }
+    worker->compr_words = (unsigned int) (curr_code - worker->compr_data);
+    return 0;
+}
+
+
+/*
+ * Compresses an image data buffer like oif_compress, but splits the image
+ * into horizontal stripes that are compressed by num_threads threads.
+ * Each stripe starts with a WSL code. An index with the offsets of the
+ * stripes is appended.
+ * If num_threads is <= 0, one thread per CPU is used.
+ * Returns 0, or -1 if the memory for the stripes cannot be allocated.
+ */
+int
+oif_compress_parallel (
+    struct oif_header *header,
+    unsigned char *img_data,
+    unsigned char *compr_data,
+    int num_threads)
+{
+    struct oif_compress_worker *workers;
+    unsigned int *offsets;
+    unsigned int *curr_code = (unsigned int *) compr_data;
+    unsigned int *index;
+    unsigned int num_stripes;
+    unsigned int num_workers;
+    unsigned int stripe_lines = OIF_INDEX_STRIPE_LINES;
+    unsigned int size;
+    unsigned int i;
+    unsigned int j;
+    int ret = 0;
+
+    oif_init_kernels ();
+
+    if (num_threads <= 0) {
+        num_threads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+    }
+    num_stripes = (header->height + stripe_lines - 1) / stripe_lines;
+    if (num_stripes == 0) {
+        oif_compress (header, img_data, compr_data);
+        return 0;
+    }
+    num_workers = (num_threads > 1) ? (unsigned int) num_threads : 1;
+    if (num_workers > num_stripes) {
+        num_workers = num_stripes;
+    }
+
+    workers = (struct oif_compress_worker *) calloc (num_workers, sizeof (struct oif_compress_worker));
+    offsets = (unsigned int *) calloc (num_stripes, sizeof (unsigned int));
+    if ((workers == 0) || (offsets == 0)) {
+        free (workers);
+        free (offsets);
+        return -1;
+    }
+
+    for (i = 0; i < num_workers; i++) {
+        workers[i].header = header;
+        workers[i].pixel_data = (unsigned int *) img_data;
+        workers[i].stripe_lines = stripe_lines;
+        workers[i].first_stripe = num_stripes * i / num_workers;
+        workers[i].last_stripe = num_stripes * (i + 1) / num_workers - 1;
+        workers[i].offsets = offsets;
+        /* The first worker compresses directly into the output buffer,
+         * the others need their own buffer since their size is not known.
+         * The stripes never need more than one word per pixel plus a few codes. */
+        if (i == 0) {
+            workers[i].compr_data = curr_code;
+        } else {
+            j = workers[i].last_stripe - workers[i].first_stripe + 1;
+            size = j * stripe_lines * header->width;
+            workers[i].compr_data = (unsigned int *) malloc (
+                (size + size / 32768 + 4 * j + 16) * sizeof (unsigned int));
+            if (workers[i].compr_data == 0) {
+                ret = -1;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        for (i = 1; i < num_workers; i++) {
+            /* If no thread can be created, the stripes are
+             * compressed by this thread later */
+            workers[i].started = (pthread_create (&workers[i].thread, 0,
+                                                  oif_compress_worker, &workers[i]) == 0);
+        }
+        oif_compress_worker (&workers[0]);
+        curr_code += workers[0].compr_words;
+        for (i = 1; i < num_workers; i++) {
+            if (workers[i].started) {
+                pthread_join (workers[i].thread, 0);
+            } else {
+                oif_compress_worker (&workers[i]);
+            }
+            for (j = workers[i].first_stripe; j <= workers[i].last_stripe; j++) {
+                offsets[j] += (unsigned int) (curr_code - (unsigned int *) compr_data);
+            }
+            memcpy (curr_code, workers[i].compr_data, workers[i].compr_words * sizeof (unsigned int));
+            curr_code += workers[i].compr_words;
+        }
+        *curr_code++ = OIF_EOI_TYPE;
+        header->version = oif_code_version ((unsigned int *) compr_data);
+
+        /* Append the index */
+        index = curr_code;
+        *curr_code++ = num_stripes;
+        *curr_code++ = stripe_lines;
+        for (i = 0; i < num_stripes; i++) {
+            *curr_code++ = offsets[i] * sizeof (unsigned int);
+        }
+        header->reserved[OIF_RES_FLAGS] |= OIF_RES_FLAG_INDEX | OIF_RES_FLAG_KEY;
+        header->reserved[OIF_RES_INDEX_OFFSET] = (unsigned int) ((unsigned char *) index - compr_data);
+        header->img_size = (unsigned int) ((unsigned char *) curr_code - compr_data);
+    }
+
+    for (i = 1; i < num_workers; i++) {
+        free (workers[i].compr_data);
+    }
+    free (workers);
+    free (offsets);
+    return ret;
+}
+
+
+/*
+ * Finds the next code of the incremental encoder. The code is stored
+ * in the encoder and written by oif_encoder_drain.
+ * Returns 0 if more input is needed or the image is complete.
+ */
+static int
+oif_encoder_next_code (
+    struct oif_encoder *enc)
+{
+    const unsigned int *pixel_data = enc->in;
+    unsigned int pos = enc->in_pos;
+    unsigned int prefix_value = 0;
+    unsigned int size = enc->in_size;
+    unsigned int prefix = 0;
+    unsigned int limit;
+    unsigned int r;
+    unsigned int t;
+    unsigned int count;
+
+    if (enc->tail_count > 0) {
+        /* Extend the sequence of equal pixels at the end of the last input */
+        if ((pos < size) && (pixel_data[pos] == enc->tail_value)) {
+            limit = (size - pos > 32768 - enc->tail_count) ?
+                pos + 32768 - enc->tail_count : size;
+            r = oif_run_end (pixel_data, pos, limit);
+            enc->tail_count += r - pos;
+            pos = r;
+            enc->in_pos = pos;
+        }
+        if ((pos == size) && !enc->finishing && (enc->tail_count < 32768)) {
+            /* The sequence may continue with the next rows */
+            return 0;
+        }
+        if (enc->tail_count > 2) {
+            enc->code[0] = OIF_RLE_TYPE | enc->tail_count;
+            enc->code[1] = enc->tail_value;
+            enc->code_words = 2;
+            enc->code_pos = 0;
+            enc->lit_prefix = 0;
+            enc->tail_count = 0;
+            return 1;
+        }
+        /* Too short for RLE, the pixels start an uncompressed sequence */
+        prefix = enc->tail_count;
+        prefix_value = enc->tail_value;
+        enc->tail_count = 0;
+    }
+
+    if (pos < size) {
+        r = oif_run_start (pixel_data, pos, size);
+        if (r < size) {
+            t = 0;
+        } else if (enc->finishing) {
+            t = 0;
+        } else {
+            /* The last one or two pixels may start a sequence
+             * together with the next rows */
+            t = 1;
+            if ((size - pos > 1) && (pixel_data[size - 2] == pixel_data[size - 1])) {
+                t = 2;
+            }
+            r = size - t;
+        }
+        count = prefix + (r - pos);
+        if (count > 0xFFFF) {
+            r = pos + 0xFFFF - prefix;
+            count = 0xFFFF;
+            t = 0;
+        }
+        if (t > 0) {
+            enc->tail_value = pixel_data[size - 1];
+            enc->tail_count = t;
+            enc->in_pos = size;
+        } else if ((r < size) && (count < 0xFFFF)) {
+            /* A sequence of equal pixels starts at r */
+            enc->tail_value = pixel_data[r];
+            enc->tail_count = 1;
+            enc->in_pos = r + 1;
+        } else {
+            enc->in_pos = r;
+        }
+        if (count == 0) {
+            return oif_encoder_next_code (enc);
+        }
+        enc->code[0] = OIF_UNCOMPR_TYPE | count;
+        enc->code[1] = prefix_value;
+        enc->lit_prefix = prefix;
+        enc->lit_src = pixel_data + pos;
+        enc->code_words = 1 + count;
+        enc->code_pos = 0;
+        return 1;
+    }
+
+    if (prefix > 0) {
+        /* Only the short sequence from the last input is left */
+        enc->code[0] = OIF_UNCOMPR_TYPE | prefix;
+        enc->code[1] = prefix_value;
+        enc->lit_prefix = prefix;
+        enc->lit_src = 0;
+        enc->code_words = 1 + prefix;
+        enc->code_pos = 0;
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Starts the incremental encoding of an image.
+ * The header must contain magic, width and height, and id.
+ * img_size is set to OIF_IMG_SIZE_UNKNOWN, so the header can be sent
+ * before the image is complete. The actual size is set when the last
+ * code was drained.
+ */
+void
+oif_encoder_begin (
+    struct oif_encoder *enc,
+    struct oif_header *header)
+{
+    oif_init_kernels ();
+
+    memset (enc, 0, sizeof (*enc));
+    enc->header = header;
+    /* The incremental encoder only writes UNCOMPR and RLE codes */
+    header->version = OIF_VERSION_COMPAT;
+    header->img_size = OIF_IMG_SIZE_UNKNOWN;
+    header->reserved[OIF_RES_FLAGS] &= ~OIF_RES_FLAG_INDEX;
+    header->reserved[OIF_RES_FLAGS] |= OIF_RES_FLAG_KEY;
+}
+
+
+/*
+ * Passes the next rows of the image to the encoder. The rows must stay
+ * valid until oif_encoder_drain returned 0.
+ */
+int
+oif_encoder_push_rows (
+    struct oif_encoder *enc,
+    const unsigned char *rows,
+    unsigned int num_rows)
+{
+    if ((enc->in_pos < enc->in_size) || (enc->code_pos < enc->code_words) ||
+            enc->finishing) {
+        return OIF_ERR_BUSY;
+    }
+    if (enc->rows + num_rows > enc->header->height) {
+        return OIF_ERR_SRC_OVERRUN;
+    }
+    enc->in = (const unsigned int *) rows;
+    enc->in_size = num_rows * enc->header->width;
+    enc->in_pos = 0;
+    enc->rows += num_rows;
+    return 0;
+}
+
+
+/*
+ * Writes the next compressed data to out, at most out_size bytes.
+ * Only complete 32 bit words are written.
+ * Returns the number of bytes written, 0 if all rows pushed so far
+ * are encoded, or, after oif_encoder_finish, if the image is complete.
+ */
+unsigned int
+oif_encoder_drain (
+    struct oif_encoder *enc,
+    unsigned char *out,
+    unsigned int out_size)
+{
+    unsigned int *curr_code = (unsigned int *) out;
+    unsigned int words = out_size / sizeof (unsigned int);
+    unsigned int pos;
+    unsigned int count;
+    unsigned int size;
+
+    while (words > 0) {
+        if (enc->code_pos == enc->code_words) {
+            if (!oif_encoder_next_code (enc)) {
+                if (enc->finishing && !enc->done) {
+                    *curr_code++ = OIF_EOI_TYPE;
+                    enc->done = 1;
+                }
+                break;
+            }
+        }
+        if (enc->code_pos == 0) {
+            *curr_code++ = enc->code[0];
+            words--;
+            enc->code_pos++;
+        } else if ((enc->code[0] & 0xF0000000) == OIF_RLE_TYPE) {
+            *curr_code++ = enc->code[1];
+            words--;
+            enc->code_pos++;
+        } else {
+            pos = enc->code_pos - 1;
+            if (pos < enc->lit_prefix) {
+                *curr_code++ = enc->code[1];
+                words--;
+                enc->code_pos++;
+            } else {
+                count = enc->code_words - enc->code_pos;
+                if (count > words) {
+                    count = words;
+                }
+                memcpy (curr_code, enc->lit_src + (pos - enc->lit_prefix),
+                        count * sizeof (unsigned int));
+                curr_code += count;
+                words -= count;
+                enc->code_pos += count;
+            }
+        }
+    }
+
+    size = (unsigned int) ((unsigned char *) curr_code - out);
+    enc->size += size;
+    if (enc->done) {
+        enc->header->img_size = enc->size;
+    }
+    return size;
+}
+
+
+/*
+ * Signals that all rows were pushed. The remaining codes and the EOI
+ * code are written by the following calls of oif_encoder_drain.
+ */
+void
+oif_encoder_finish (
+    struct oif_encoder *enc)
+{
+    enc->finishing = 1;
+}
+
+
+/*
+ * Writes count pixels from the palette indices in src,
+ * which have the given number of bits.
+ */
+static void
+oif_expand_indices (
+    unsigned int *dst,
+    const unsigned int *src,
+    unsigned int count,
+    unsigned int bits,
+    const unsigned int *colors,
+    oif_copy_fn copy)
+{
+    unsigned int buffer[256];
+    unsigned int mask = (1U << bits) - 1;
+    unsigned int word = 0;
+    unsigned int shift = 32;
+    unsigned int n;
+    unsigned int i;
+
+    /* The pixels are collected in a buffer, so the copy kernel can be used */
+    while (count > 0) {
+        n = (count < 256) ? count : 256;
+        for (i = 0; i < n; i++) {
+            if (shift == 32) {
+                word = *src++;
+                shift = 0;
+            }
+            buffer[i] = colors[(word >> shift) & mask];
+            shift += bits;
+        }
+        copy (dst, buffer, n);
+        dst += n;
+        count -= n;
+    }
+}
+
+
+/*
+ * Loads a palette from a PALETTE code with count colors.
+ */
+static void
+oif_load_palette (
+    struct oif_palette *palette,
+    const unsigned int *colors,
+    unsigned int count)
+{
+    palette->num_colors = count;
+    memcpy (palette->colors, colors, count * sizeof (unsigned int));
+    memset (palette->colors + count, 0, (OIF_PALETTE_SIZE - count) * sizeof (unsigned int));
+}
+
+
+/*
+ * Copies count pixels from one row above for the UP code. More pixels
+ * than a row repeat the previous rows, they are copied row by row,
+ * so the source and the destination never overlap.
+ */
+static __attribute__((noinline)) void
+oif_copy_up (
+    unsigned int *curr_pixel,
+    unsigned int width,
+    unsigned int count,
+    oif_copy_fn copy)
+{
+    unsigned int n;
+
+    while (count > 0) {
+        n = (count < width) ? count : width;
+        copy (curr_pixel, curr_pixel - width, n);
+        curr_pixel += n;
+        count -= n;
+    }
+}
+
+
+/*
+ * Returns != 0 if the destination rectangle of a COPY code at pixel
+ * offset and the source rectangle with line src[0] and column src[1]
+ * are inside the image.
+ */
+static int
+oif_copy_valid (
+    const struct oif_header *header,
+    unsigned int offset,
+    unsigned int rect_width,
+    unsigned int rect_height,
+    const unsigned int *src)
+{
+    if ((header->width == 0) || (offset >= header->width * header->height)) {
+        return 0;
+    }
+    return (rect_width <= header->width - offset % header->width) &&
+        (rect_height <= header->height - offset / header->width) &&
+        (src[1] <= header->width) && (rect_width <= header->width - src[1]) &&
+        (src[0] <= header->height) && (rect_height <= header->height - src[0]);
+}
+
+
+/*
+ * Copies the rectangle of a COPY code to curr_pixel, the source line
+ * and column are src[0] and src[1]. Both rectangles must be inside
+ * the image. Returns the pixel after the last row of the rectangle,
+ * or 0 if a rectangle is outside the image.
+ */
+static __attribute__((noinline)) unsigned int *
+oif_decode_copy (
+    const struct oif_header *header,
+    unsigned char *img_data,
+    unsigned int *curr_pixel,
+    unsigned int rect_width,
+    unsigned int rect_height,
+    const unsigned int *src)
+{
+    unsigned int offset = (unsigned int) (curr_pixel - (unsigned int *) img_data);
+
+    if (!oif_copy_valid (header, offset, rect_width, rect_height, src)) {
+        return 0;
+    }
+    if (rect_height == 0) {
+        return curr_pixel;
+    }
+    oif_copy_rect ((unsigned int *) img_data, header->width, offset % header->width,
+                   offset / header->width, src[1], src[0], rect_width, rect_height);
+    return curr_pixel + (rect_height - 1) * header->width + rect_width;
+}
+
+
+/*
+ * Returns != 0 if the EXT code is followed by a line.
+ */
+static inline int
+oif_ext_has_line (
+    unsigned int code)
+{
+    unsigned int type = (code << 4) & 0xF0000000;
+
+    return (type == OIF_UNCOMPR_WSL_TYPE) || (type == OIF_RLE_WSL_TYPE) || (type == OIF_POS_TYPE);
+}
+
+
+/*
+ * Decodes an EXT code of oif_decode. It is kept out of the loop of
+ * oif_decode, which is as fast as before for images without EXT codes.
+ * The type is in bit 27-24, the count in bit 23-0, the WSL types
+ * and POS are followed by the line.
+ */
+static __attribute__((noinline)) int
+oif_decode_ext (
+    const struct oif_header *header,
+    unsigned int code,
+    const unsigned int **code_ptr,
+    const unsigned int *max_code,
+    unsigned char *img_data,
+    unsigned int **pixel_ptr,
+    oif_fill_fn fill,
+    oif_copy_fn copy)
+{
+    const unsigned int *curr_code = *code_ptr;
+    unsigned int *curr_pixel = *pixel_ptr;
+    unsigned int *max_pixel = (unsigned int *) img_data + header->width * header->height;
+    unsigned int type = (code << 4) & 0xF0000000;
+    unsigned int count = code & OIF_EXT_MAX_COUNT;
+    unsigned int line;
+
+    if (oif_ext_has_line (code)) {
+        if (curr_code >= max_code) {
+            return OIF_ERR_SRC_OVERRUN;
+        }
+        line = *curr_code++;
+        if (line >= header->height) {
+            return OIF_ERR_DST_OVERRUN;
+        }
+        curr_pixel = (unsigned int *) img_data + (line * header->width);
+        if (type == OIF_POS_TYPE) {
+            if (count >= header->width) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            curr_pixel += count;
+            count = 0;
+        }
+    }
+    if (curr_pixel + count > max_pixel) {
+        return OIF_ERR_DST_OVERRUN;
+    }
+    if ((type == OIF_UNCOMPR_TYPE) || (type == OIF_UNCOMPR_WSL_TYPE)) {
+        if (curr_code + count > max_code) {
+            return OIF_ERR_SRC_OVERRUN;
+        }
+        copy (curr_pixel, curr_code, count);
+        curr_code += count;
+    } else if ((type == OIF_RLE_TYPE) || (type == OIF_RLE_WSL_TYPE)) {
+        if (curr_code >= max_code) {
+            return OIF_ERR_SRC_OVERRUN;
+        }
+        fill (curr_pixel, *curr_code++, count);
+    } else if (type == OIF_UP_TYPE) {
+        if (curr_pixel < (unsigned int *) img_data + header->width) {
+            return OIF_ERR_DST_OVERRUN;
+        }
+        oif_copy_up (curr_pixel, header->width, count, copy);
+    } else if ((type != OIF_SKIP_TYPE) && (type != OIF_POS_TYPE)) {
+        return OIF_ERR_UNKNWON_CODE;
+    }
+    *code_ptr = curr_code;
+    *pixel_ptr = curr_pixel + count;
+    return 0;
+}
+
+
+/*
+ * Decodes the codes from curr_code up to max_code with the given fill
+ * and copy kernels. The first pixel is written to curr_pixel.
+ * Returns 0 if the EOI code was found, OIF_DECODE_END if max_code was
+ * reached at the end of a code, or a negative error code.
+ * If checked is 0, the codes are not checked against the bounds of the
+ * image and the compressed data, see oif_validate. It is a constant,
+ * so the checks are removed by the compiler. The rare EXT and COPY
+ * codes are checked anyway.
+ */
+#define OIF_DECODE_END 1
+
+static inline __attribute__((always_inline)) int
+oif_decode_codes (
+    const struct oif_header *header,
+    const unsigned int *curr_code,
+    const unsigned int *max_code,
+    unsigned char *img_data,
+    unsigned int *curr_pixel,
+    struct oif_palette *palette,
+    oif_fill_fn fill,
+    oif_copy_fn copy,
+    int checked)
+{
+    unsigned int code;
+    const unsigned int *ext_code;
+    unsigned int *ext_pixel;
+    unsigned int pixel_value = 0;
+    unsigned int count;
+    unsigned int line;
+    unsigned int bits;
+    unsigned int words;
+    int ret;
+    unsigned int *max_pixel = (unsigned int *) img_data + header->width * header->height;
+
+    while (!checked || (curr_code < max_code)) {
+        code = *curr_code++;
+        count = code & 0x0000FFFF;
+        switch ((code & 0xF0000000)) {
+        case OIF_EOI_TYPE:
+            return 0;
+        case OIF_UNCOMPR_TYPE:
+            // printf ("OIF_UNCOMPR_TYPE, count = %d\n", count);
+            if (checked && (curr_pixel + count > max_pixel)) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            if (checked && (curr_code + count > max_code)) {
+                return OIF_ERR_SRC_OVERRUN;
+            }
+            copy (curr_pixel, curr_code, count);
+            curr_pixel += count;
+            curr_code += count;
+            break;
+        case OIF_UNCOMPR_WSL_TYPE:
+            line = (code >> 16) & 0x00000FFF;
+            curr_pixel = (unsigned int *) img_data +
+                (line * header->width);
+            if (checked && (curr_pixel + count > max_pixel)) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            if (checked && (curr_code + count > max_code)) {
+                return OIF_ERR_SRC_OVERRUN;
+            }
+            copy (curr_pixel, curr_code, count);
+            curr_pixel += count;
+            curr_code += count;
+            break;
+        case OIF_RLE_TYPE:
+            // printf ("OIF_RLE_TYPE, count = %d\n", count);
+            if (checked && (curr_pixel + count > max_pixel)) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            if (checked && (curr_code >= max_code)) {
+                return OIF_ERR_SRC_OVERRUN;
+            }
+            pixel_value = *curr_code++;
+            fill (curr_pixel, pixel_value, count);
+            curr_pixel += count;
+            break;
+        case OIF_RLE_WSL_TYPE:
+            line = (code >> 16) & 0x00000FFF;
+            curr_pixel = (unsigned int *) img_data +
+                (line * header->width);
+            if (checked && (curr_pixel + count > max_pixel)) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            if (checked && (curr_code >= max_code)) {
+                return OIF_ERR_SRC_OVERRUN;
+            }
+            pixel_value = *curr_code++;
+            fill (curr_pixel, pixel_value, count);
+            curr_pixel += count;
+            break;
+        case OIF_SKIP_TYPE:
+            if (checked && (curr_pixel + count > max_pixel)) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            curr_pixel += count;
+            break;
+        case OIF_POS_TYPE:
+            line = (code >> 16) & 0x00000FFF;
+            if (checked && ((count >= header->width) || (line >= header->height))) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            curr_pixel = (unsigned int *) img_data + (line * header->width) + count;
+            break;
+        case OIF_UP_TYPE:
+            if (checked && ((curr_pixel < (unsigned int *) img_data + header->width) ||
+                            (curr_pixel + count > max_pixel))) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            oif_copy_up (curr_pixel, header->width, count, copy);
+            curr_pixel += count;
+            break;
+        case OIF_COPY_TYPE:
+            if (checked && (curr_code + 3 > max_code)) {
+                return OIF_ERR_SRC_OVERRUN;
+            }
+            curr_pixel = oif_decode_copy (header, img_data, curr_pixel, count, curr_code[0], curr_code + 1);
+            if (curr_pixel == 0) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            curr_code += 3;
+            break;
+        case OIF_EXT_TYPE:
+            ext_code = curr_code;
+            ext_pixel = curr_pixel;
+            ret = oif_decode_ext (header, code, &ext_code, max_code, img_data, &ext_pixel, fill, copy);
+            if (ret < 0) {
+                return ret;
+            }
+            curr_code = ext_code;
+            curr_pixel = ext_pixel;
+            break;
+        case OIF_PALETTE_TYPE:
+            if (checked && (count > OIF_PALETTE_SIZE)) {
+                return OIF_ERR_UNKNWON_CODE;
+            }
+            if (checked && (curr_code + count > max_code)) {
+                return OIF_ERR_SRC_OVERRUN;
+            }
+            oif_load_palette (palette, curr_code, count);
+            curr_code += count;
+            break;
+        case OIF_INDEXED_TYPE:
+            bits = (code >> 24) & 0x0000000F;
+            if (checked && (bits != 1) && (bits != 2) && (bits != 4) && (bits != 8)) {
+                return OIF_ERR_UNKNWON_CODE;
+            }
+            words = (count * bits + 31) / 32;
+            if (checked && (curr_pixel + count > max_pixel)) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            if (checked && (curr_code + words > max_code)) {
+                return OIF_ERR_SRC_OVERRUN;
+            }
+            oif_expand_indices (curr_pixel, curr_code, count, bits, palette->colors, copy);
+            curr_pixel += count;
+            curr_code += words;
+            break;
+        case OIF_INDEXED_RLE_TYPE:
+            if (checked && (curr_pixel + count > max_pixel)) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            fill (curr_pixel, palette->colors[(code >> 16) & 0x000000FF], count);
+            curr_pixel += count;
+            break;
+        default:
+            return OIF_ERR_UNKNWON_CODE;
+        }
+    }
+    return OIF_DECODE_END;
+}
+
+
+/*
+ * Decodes the codes with all checks, see oif_decode_codes.
+ */
+static int
+oif_decode (
+    const struct oif_header *header,
+    const unsigned int *curr_code,
+    const unsigned int *max_code,
+    unsigned char *img_data,
+    unsigned int *curr_pixel,
+    struct oif_palette *palette,
+    oif_fill_fn fill,
+    oif_copy_fn copy)
+{
+    return oif_decode_codes (header, curr_code, max_code, img_data, curr_pixel, palette,
+                             fill, copy, 1);
+}
+
+
+/*
+ * Decodes the codes of a validated image without checks,
+ * see oif_decode_codes.
+ */
+static int
+oif_decode_trusted (
+    struct oif_header *header,
+    unsigned int *curr_code,
+    unsigned int *max_code,
+    unsigned char *img_data,
+    struct oif_palette *palette,
+    oif_fill_fn fill,
+    oif_copy_fn copy)
+{
+    return oif_decode_codes (header, curr_code, max_code, img_data, (unsigned int *) img_data,
+                             palette, fill, copy, 0);
+}
+
+
+/*
+ * Uncompresses the compressed image data. img_data must be large enough
+ * for the uncompresses image.
+ */
+int
+oif_uncompress (
+    struct oif_header *header,
+    unsigned char *compr_data,
+    unsigned char *img_data)
+{
+    return oif_uncompress_ex (header, compr_data, img_data, 0);
+}
+
+
+/*
+ * Uncompresses the compressed image data like oif_uncompress.
+ * With OIF_FLAG_NONTEMPORAL in flags the pixels are written with streaming
+ * stores that bypass the cache, which should be used if img_data is
+ * a mapped framebuffer.
+ */
+int
+oif_uncompress_ex (
+    struct oif_header *header,
+    unsigned char *compr_data,
+    unsigned char *img_data,
+    int flags)
+{
+    struct oif_palette palette;
+
+    memset (&palette, 0, sizeof (palette));
+    return oif_uncompress_palette (header, compr_data, img_data, flags, &palette);
+}
+
+
+/*
+ * Uncompresses the compressed image data like oif_uncompress_ex.
+ * palette is used for images with palette indices but without their
+ * own palette. A palette of the image is stored in palette.
+ */
+int
+oif_uncompress_palette (
+    const struct oif_header *header,
+    const unsigned char *compr_data,
+    unsigned char *img_data,
+    int flags,
+    struct oif_palette *palette)
+{
+    const unsigned int *curr_code = (const unsigned int *) compr_data;
+    const unsigned int *max_code = (const unsigned int *) (compr_data + (header->img_size & ~3U));
+    int ret;
+
+    oif_init_kernels ();
+
+    if (flags & OIF_FLAG_NONTEMPORAL) {
+        ret = oif_decode (header, curr_code, max_code, img_data,
+                          (unsigned int *) img_data, palette, oif_fill_nt, oif_copy_nt);
+        oif_store_fence ();
+    } else {
+        ret = oif_decode (header, curr_code, max_code, img_data,
+                          (unsigned int *) img_data, palette, oif_fill, oif_copy);
+    }
+    if (ret == OIF_DECODE_END) {
+        ret = OIF_ERR_SRC_OVERRUN;
+    }
+    return ret;
+}
+
+
+/*
+ * Checks the compressed image data in one pass over the codes, without
+ * writing pixels. The checks are the same as those of oif_decode.
+ */
+int
+oif_validate (
+    struct oif_header *header,
+    const unsigned char *compr_data,
+    struct oif_stats *stats)
+{
+    const unsigned int *curr_code = (const unsigned int *) compr_data;
+    const unsigned int *max_code = (const unsigned int *) (compr_data + (header->img_size & ~3U));
+    unsigned int num_pixels = header->width * header->height;
+    unsigned long long pixel = 0;
+    struct oif_stats st;
+    unsigned int code;
+    unsigned int type;
+    unsigned int count;
+    unsigned int words;
+    unsigned int bits;
+    unsigned int line;
+
+    memset (&st, 0, sizeof (st));
+    st.version = OIF_VERSION_COMPAT;
+
+    while (curr_code < max_code) {
+        code = *curr_code++;
+        type = code & 0xF0000000;
+        count = code & 0x0000FFFF;
+        line = (code >> 16) & 0x00000FFF;
+        st.num_codes++;
+        st.codes[type >> 28]++;
+        if ((type > OIF_RLE_WSL_TYPE) && (type != OIF_EOI_TYPE)) {
+            st.version = OIF_VERSION;
+        }
+
+        if (type == OIF_EXT_TYPE) {
+            type = (code << 4) & 0xF0000000;
+            count = code & OIF_EXT_MAX_COUNT;
+            if (oif_ext_has_line (code)) {
+                if (curr_code >= max_code) {
+                    return OIF_ERR_SRC_OVERRUN;
+                }
+                line = *curr_code++;
+                if (line >= header->height) {
+                    return OIF_ERR_DST_OVERRUN;
+                }
+                pixel = (unsigned long long) line * header->width;
+                if (type == OIF_POS_TYPE) {
+                    if (count >= header->width) {
+                        return OIF_ERR_DST_OVERRUN;
+                    }
+                    pixel += count;
+                    count = 0;
+                }
+            }
+            if (pixel + count > num_pixels) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            if ((type == OIF_UNCOMPR_TYPE) || (type == OIF_UNCOMPR_WSL_TYPE)) {
+                if (curr_code + count > max_code) {
+                    return OIF_ERR_SRC_OVERRUN;
+                }
+                curr_code += count;
+            } else if ((type == OIF_RLE_TYPE) || (type == OIF_RLE_WSL_TYPE)) {
+                if (curr_code >= max_code) {
+                    return OIF_ERR_SRC_OVERRUN;
+                }
+                curr_code++;
+            } else if (type == OIF_UP_TYPE) {
+                if (pixel < header->width) {
+                    return OIF_ERR_DST_OVERRUN;
+                }
+            } else if ((type != OIF_SKIP_TYPE) && (type != OIF_POS_TYPE)) {
+                return OIF_ERR_UNKNWON_CODE;
+            }
+            if ((type != OIF_SKIP_TYPE) && (type != OIF_POS_TYPE)) {
+                st.pixels += count;
+            }
+            pixel += count;
+            continue;
+        }
+
+        switch (type) {
+        case OIF_EOI_TYPE:
+            st.data_size = (unsigned int) ((const unsigned char *) curr_code - compr_data);
+            if (stats) {
+                *stats = st;
+            }
+            return 0;
+        case OIF_UNCOMPR_WSL_TYPE:
+        case OIF_RLE_WSL_TYPE:
+            pixel = (unsigned long long) line * header->width;
+            /* fall through */
+        case OIF_UNCOMPR_TYPE:
+        case OIF_RLE_TYPE:
+            if (pixel + count > num_pixels) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            words = ((type == OIF_UNCOMPR_TYPE) || (type == OIF_UNCOMPR_WSL_TYPE)) ? count : 1;
+            if ((unsigned int) (max_code - curr_code) < words) {
+                return OIF_ERR_SRC_OVERRUN;
+            }
+            curr_code += words;
+            pixel += count;
+            st.pixels += count;
+            break;
+        case OIF_SKIP_TYPE:
+            if (pixel + count > num_pixels) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            pixel += count;
+            break;
+        case OIF_POS_TYPE:
+            if ((count >= header->width) || (line >= header->height)) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            pixel = (unsigned long long) line * header->width + count;
+            break;
+        case OIF_UP_TYPE:
+            if ((pixel < header->width) || (pixel + count > num_pixels)) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            pixel += count;
+            st.pixels += count;
+            break;
+        case OIF_COPY_TYPE:
+            if ((unsigned int) (max_code - curr_code) < 3) {
+                return OIF_ERR_SRC_OVERRUN;
+            }
+            if (!oif_copy_valid (header, (unsigned int) pixel, count, curr_code[0], curr_code + 1)) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            if (curr_code[0] > 0) {
+                pixel += (unsigned long long) (curr_code[0] - 1) * header->width + count;
+                st.pixels += count * curr_code[0];
+            }
+            curr_code += 3;
+            break;
+        case OIF_PALETTE_TYPE:
+            if (count > OIF_PALETTE_SIZE) {
+                return OIF_ERR_UNKNWON_CODE;
+            }
+            if ((unsigned int) (max_code - curr_code) < count) {
+                return OIF_ERR_SRC_OVERRUN;
+            }
+            curr_code += count;
+            break;
+        case OIF_INDEXED_TYPE:
+            bits = (code >> 24) & 0x0000000F;
+            if ((bits != 1) && (bits != 2) && (bits != 4) && (bits != 8)) {
+                return OIF_ERR_UNKNWON_CODE;
+            }
+            words = (count * bits + 31) / 32;
+            if (pixel + count > num_pixels) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            if ((unsigned int) (max_code - curr_code) < words) {
+                return OIF_ERR_SRC_OVERRUN;
+            }
+            curr_code += words;
+            pixel += count;
+            st.pixels += count;
+            break;
+        case OIF_INDEXED_RLE_TYPE:
+            if (pixel + count > num_pixels) {
+                return OIF_ERR_DST_OVERRUN;
+            }
+            pixel += count;
+            st.pixels += count;
+            break;
+        default:
+            return OIF_ERR_UNKNWON_CODE;
+        }
+    }
+    return OIF_ERR_SRC_OVERRUN;
+}
+
+
+/*
+ * Uncompresses image data that has been checked by oif_validate,
+ * without checks.
+ */
+int
+oif_uncompress_trusted (
+    struct oif_header *header,
+    unsigned char *compr_data,
+    unsigned char *img_data,
+    int flags)
+{
+    unsigned int *max_code = (unsigned int *) (compr_data + (header->img_size & ~3U));
+    struct oif_palette palette;
+    int ret;
+
+    oif_init_kernels ();
+
+    memset (&palette, 0, sizeof (palette));
+    if (flags & OIF_FLAG_NONTEMPORAL) {
+        ret = oif_decode_trusted (header, (unsigned int *) compr_data, max_code, img_data,
+                                  &palette, oif_fill_nt, oif_copy_nt);
+        oif_store_fence ();
+    } else {
+        ret = oif_decode_trusted (header, (unsigned int *) compr_data, max_code, img_data,
+                                  &palette, oif_fill, oif_copy);
+    }
+    return ret;
+}
+
+
+/*
+ * Uncompresses the compressed image data into the pixel format format
+ * with stride bytes per line. The native format is decoded by
+ * oif_uncompress_ex, the other formats by the incremental decoder,
+ * which converts the pixels while they are written.
+ */
+int
+oif_uncompress_format (
+    struct oif_header *header,
+    unsigned char *compr_data,
+    unsigned char *img_data,
+    int format,
+    unsigned int stride)
+{
+    struct oif_decoder dec;
+    unsigned int consumed;
+    int ret;
+
+    oif_decoder_begin (&dec, header, img_data, 0);
+    ret = oif_decoder_set_format (&dec, format, stride);
+    if (ret < 0) {
+        return ret;
+    }
+    if (dec.bpp == 0) {
+        return oif_uncompress_ex (header, compr_data, img_data, 0);
+    }
+    ret = oif_decoder_feed (&dec, compr_data, header->img_size, &consumed);
+    if (ret == 0) {
+        ret = OIF_ERR_SRC_OVERRUN;
+    }
+    return (ret < 0) ? ret : 0;
+}
+
+
+/*
+ * Returns the index of an image, or 0 if the image has no valid index.
+ * The number of stripes and the lines per stripe are returned in
+ * num_stripes and stripe_lines.
+ */
+static unsigned int *
+oif_get_index (
+    struct oif_header *header,
+    unsigned char *compr_data,
+    unsigned int *num_stripes,
+    unsigned int *stripe_lines)
+{
+    unsigned int offset = header->reserved[OIF_RES_INDEX_OFFSET];
+    unsigned int *index;
+    unsigned int i;
+
+    if (!(header->reserved[OIF_RES_FLAGS] & OIF_RES_FLAG_INDEX) ||
+            (header->img_size == OIF_IMG_SIZE_UNKNOWN) || (offset & 3) ||
+            (offset > header->img_size) || (header->img_size - offset < 8)) {
+        return 0;
+    }
+    index = (unsigned int *) (compr_data + offset);
+    *num_stripes = index[0];
+    *stripe_lines = index[1];
+    if ((*num_stripes == 0) || (*stripe_lines == 0) ||
+            (*num_stripes > (header->img_size - offset - 8) / sizeof (unsigned int)) ||
+            ((unsigned long long) *num_stripes * *stripe_lines < header->height) ||
+            ((unsigned long long) (*num_stripes - 1) * *stripe_lines >= header->height)) {
+        return 0;
+    }
+    index += 2;
+    for (i = 0; i < *num_stripes; i++) {
+        if ((index[i] & 3) || (index[i] > offset) || ((i > 0) && (index[i] < index[i - 1]))) {
+            return 0;
+        }
+    }
+    return index;
+}
+
+
+/*
+ * Loads the palette at the start of an image, which is skipped
+ * when stripes are decoded.
+ */
+static void
+oif_read_palette (
+    struct oif_header *header,
+    unsigned char *compr_data,
+    struct oif_palette *palette)
+{
+    unsigned int *curr_code = (unsigned int *) compr_data;
+    unsigned int count = curr_code[0] & 0x0000FFFF;
+
+    memset (palette, 0, sizeof (*palette));
+    if (((curr_code[0] & 0xF0000000) == OIF_PALETTE_TYPE) && (count <= OIF_PALETTE_SIZE) &&
+            ((count + 1) * sizeof (unsigned int) <= header->img_size)) {
+        oif_load_palette (palette, curr_code + 1, count);
+    }
+}
+
+
+/*
+ * Decodes the stripes first_stripe up to last_stripe of an indexed image.
+ */
+static int
+oif_decode_stripes (
+    struct oif_header *header,
+    unsigned char *compr_data,
+    unsigned char *img_data,
+    unsigned int *index,
+    unsigned int num_stripes,
+    unsigned int stripe_lines,
+    unsigned int first_stripe,
+    unsigned int last_stripe,
+    struct oif_palette *palette,
+    int flags)
+{
+    unsigned int *curr_code;
+    unsigned int *max_code;
+    unsigned int *curr_pixel;
+    int ret;
+
+    curr_code = (unsigned int *) (compr_data + index[first_stripe]);
+    if (last_stripe + 1 < num_stripes) {
+        max_code = (unsigned int *) (compr_data + index[last_stripe + 1]);
+    } else {
+        max_code = (unsigned int *) (compr_data + header->reserved[OIF_RES_INDEX_OFFSET]);
+    }
+    curr_pixel = (unsigned int *) img_data + first_stripe * stripe_lines * header->width;
+
+    if (flags & OIF_FLAG_NONTEMPORAL) {
+        ret = oif_decode (header, curr_code, max_code, img_data, curr_pixel,
+                          palette, oif_fill_nt, oif_copy_nt);
+        oif_store_fence ();
+    } else {
+        ret = oif_decode (header, curr_code, max_code, img_data, curr_pixel,
+                          palette, oif_fill, oif_copy);
+    }
+    if (ret == OIF_DECODE_END) {
+        ret = 0;
+    }
+    return ret;
+}
+
+
+/*
+ * A range of stripes, decoded by one thread.
+ */
+struct oif_decode_worker {
+    struct oif_header *header;
+    unsigned char *compr_data;
+    unsigned char *img_data;
+    unsigned int *index;
+    unsigned int num_stripes;
+    unsigned int stripe_lines;
+    unsigned int first_stripe;
+    unsigned int last_stripe;
+    struct oif_palette *palette;
+    int flags;
+    int ret;
+    pthread_t thread;
+    int started;
+};
+
+
+static void *
+oif_decode_worker (
+    void *arg)
+{
+    struct oif_decode_worker *worker = (struct oif_decode_worker *) arg;
+
+    worker->ret = oif_decode_stripes (worker->header, worker->compr_data, worker->img_data,
+                                      worker->index, worker->num_stripes, worker->stripe_lines,
+                                      worker->first_stripe, worker->last_stripe,
+                                      worker->palette, worker->flags);
+    return 0;
+}
+
+
+/*
+ * Uncompresses the compressed image data like oif_uncompress_ex, using
+ * num_threads threads. This needs an index, as created by
+ * oif_compress_parallel. Images without an index are decoded by one thread.
+ * If num_threads is <= 0, one thread per CPU is used.
+ */
+int
+oif_uncompress_parallel (
+    struct oif_header *header,
+    unsigned char *compr_data,
+    unsigned char *img_data,
+    int num_threads,
+    int flags)
+{
+    struct oif_decode_worker *workers;
+    struct oif_palette palette;
+    unsigned int *index;
+    unsigned int num_stripes;
+    unsigned int stripe_lines;
+    unsigned int num_workers;
+    unsigned int i;
+    int ret = 0;
+
+    oif_init_kernels ();
+
+    index = oif_get_index (header, compr_data, &num_stripes, &stripe_lines);
+    if (num_threads <= 0) {
+        num_threads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+    }
+    if ((index == 0) || (num_threads <= 1)) {
+        return oif_uncompress_ex (header, compr_data, img_data, flags);
+    }
+    num_workers = ((unsigned int) num_threads < num_stripes) ? (unsigned int) num_threads : num_stripes;
+    oif_read_palette (header, compr_data, &palette);
+
+    workers = (struct oif_decode_worker *) calloc (num_workers, sizeof (struct oif_decode_worker));
+    if (workers == 0) {
+        return oif_uncompress_ex (header, compr_data, img_data, flags);
+    }
+
+    for (i = 0; i < num_workers; i++) {
+        workers[i].header = header;
+        workers[i].compr_data = compr_data;
+        workers[i].img_data = img_data;
+        workers[i].index = index;
+        workers[i].num_stripes = num_stripes;
+        workers[i].stripe_lines = stripe_lines;
+        workers[i].first_stripe = num_stripes * i / num_workers;
+        workers[i].last_stripe = num_stripes * (i + 1) / num_workers - 1;
+        workers[i].palette = &palette;
+        workers[i].flags = flags;
+        if (i > 0) {
+            /* If no thread can be created, the stripes are
+             * decoded by this thread later */
+            workers[i].started = (pthread_create (&workers[i].thread, 0,
+                                                  oif_decode_worker, &workers[i]) == 0);
+        }
+    }
+    oif_decode_worker (&workers[0]);
+    for (i = 0; i < num_workers; i++) {
+        if (workers[i].started) {
+            pthread_join (workers[i].thread, 0);
+        } else if (i > 0) {
+            oif_decode_worker (&workers[i]);
+        }
+        if ((ret == 0) && (workers[i].ret < 0)) {
+            ret = workers[i].ret;
+        }
+    }
+    free (workers);
+    return ret;
+}
+
 
 /*
- * Initializes an OIF header. The header can then be
- * directly used.
+ * Uncompresses only the lines first_line up to first_line + num_lines - 1.
+ * With an index, only the stripes containing these lines are decoded.
  */
-void
-oif_init_header (
+int
+oif_uncompress_lines (
     struct oif_header *header,
-    unsigned int width,
-    unsigned int height)
+    unsigned char *compr_data,
+    unsigned char *img_data,
+    unsigned int first_line,
+    unsigned int num_lines,
+    int flags)
 {
-    int i;
+    struct oif_palette palette;
+    unsigned int *index;
+    unsigned int num_stripes;
+    unsigned int stripe_lines;
+    unsigned int last_line;
 
-    header->magic = OIF_MAGIC;
-    header->version = OIF_VERSION;
-    header->sub_version = OIF_SUBVERSION;
-    header->width = width;
-    header->height = height;
-    header->id = 0;
-    for (i = 0; i < 8; i++) {
-        header->reserved[i] = 0;
+    oif_init_kernels ();
+
+    if ((num_lines == 0) || (first_line >= header->height)) {
+        return 0;
+    }
+    last_line = (num_lines > header->height - first_line) ?
+        header->height - 1 : first_line + num_lines - 1;
+
+    index = oif_get_index (header, compr_data, &num_stripes, &stripe_lines);
+    if (index == 0) {
+        return oif_uncompress_ex (header, compr_data, img_data, flags);
     }
+    oif_read_palette (header, compr_data, &palette);
+    return oif_decode_stripes (header, compr_data, img_data, index, num_stripes, stripe_lines,
+                               first_line / stripe_lines, last_line / stripe_lines,
+                               &palette, flags);
 }
 
 
+
+/* States of the incremental decoder */
+#define OIF_DEC_CODE 0
+#define OIF_DEC_RLE_VALUE 1
+#define OIF_DEC_UNCOMPR 2
+#define OIF_DEC_DONE 3
+#define OIF_DEC_PALETTE 4
+#define OIF_DEC_INDEXED 5
+#define OIF_DEC_LINE 6
+#define OIF_DEC_COPY 7
+
+
 /*
- * Compresses an image data buffer.
- * The header must contain magic, width and height, and id.
- * The size is set after the compression,
- * compr_data must be a buffer with the same size as the input buffer.
+ * Starts the incremental decoding of an image into img_data.
+ * flags are the same as for oif_uncompress_ex.
  */
 void
-oif_compress (
+oif_decoder_begin (
+    struct oif_decoder *dec,
     struct oif_header *header,
     unsigned char *img_data,
-    unsigned char *compr_data)
+    int flags)
 {
-    unsigned int i;
-    unsigned int j;
-    unsigned int k;
-    unsigned int l;
-    unsigned int code;
-    unsigned int *curr_code = (unsigned int *) compr_data;
-    unsigned int size;
-    unsigned int *pixel_data = (unsigned int *) img_data;
+    oif_init_kernels ();
 
-    size = header->width * header->height;
+    memset (dec, 0, sizeof (*dec));
+    dec->header = header;
+    dec->img_data = img_data;
+    dec->num_pixels = header->width * header->height;
+    dec->flags = flags;
+    dec->state = OIF_DEC_CODE;
+    dec->palette = &dec->own_palette;
+}
 
-    i = 0;
-    j = 0;
-    k = 0;
-    while (i < size) {
-        j = i + 1;
-        while ((j < size) && (j - i < 32768) && (pixel_data[j] == pixel_data[i])) {
-                j++;
-            }
-            if (j > i + 2) {
-                /* Exceeds minimum number of equal pixels */
-                if (k < i) {
-                    /* There was uncompressed data before the sequence of equal pixels */
-                    code = OIF_UNCOMPR_TYPE | (i - k);
-                    *curr_code++ = code;
-                    for (l = k; l < i; l++) {
-                        *curr_code++ = pixel_data[l];
-                    }
-                }
-                /* RLE for more than 3 repeated pixels */
-                code = OIF_RLE_TYPE | (j - i);
-                *curr_code++ = code;
-                *curr_code++ = pixel_data[i];
-                i = j;
-                k = i;
-            } else {
-                i++;
+
+/*
+ * Uses a persistent palette for the incremental decoder.
+ */
+void
+oif_decoder_set_palette (
+    struct oif_decoder *dec,
+    struct oif_palette *palette)
+{
+    dec->palette = palette;
+}
+
+
+/*
+ * Returns the bytes per pixel of a pixel format, 0 if it is unknown.
+ */
+static unsigned int
+oif_format_bpp (
+    int format)
+{
+    switch (format) {
+    case OIF_FORMAT_BGRA:
+    case OIF_FORMAT_ARGB:
+        return 4;
+    case OIF_FORMAT_RGB888:
+        return 3;
+    case OIF_FORMAT_RGB565:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+
+/*
+ * Decodes into another pixel format, see oif_uncompress_format.
+ */
+int
+oif_decoder_set_format (
+    struct oif_decoder *dec,
+    int format,
+    unsigned int stride)
+{
+    unsigned int bpp = oif_format_bpp (format);
+
+    if (bpp == 0) {
+        return OIF_ERR_RANGE;
+    }
+    if (stride == 0) {
+        stride = dec->header->width * bpp;
+    }
+    if (stride < dec->header->width * bpp) {
+        return OIF_ERR_RANGE;
+    }
+    if ((format == OIF_FORMAT_BGRA) && (stride == dec->header->width * bpp)) {
+        /* The native format */
+        dec->bpp = 0;
+        return 0;
+    }
+    dec->format = format;
+    dec->bpp = bpp;
+    dec->stride = stride;
+    return 0;
+}
+
+
+/*
+ * Converts a pixel to a pixel format.
+ */
+static inline unsigned int
+oif_convert_pixel (
+    unsigned int pixel,
+    int format)
+{
+    switch (format) {
+    case OIF_FORMAT_ARGB:
+        return __builtin_bswap32 (pixel);
+    case OIF_FORMAT_RGB565:
+        return ((pixel >> 8) & 0xF800) | ((pixel >> 5) & 0x07E0) | ((pixel >> 3) & 0x001F);
+    default:
+        return pixel;
+    }
+}
+
+
+/*
+ * Fills n pixels of one row with a converted pixel.
+ */
+static void
+oif_format_fill_row (
+    unsigned char *dst,
+    unsigned int value,
+    unsigned int n,
+    unsigned int bpp,
+    oif_fill_fn fill)
+{
+    unsigned short value16 = (unsigned short) value;
+    unsigned int i;
+
+    if (bpp == 4) {
+        if (((uintptr_t) dst & 3) == 0) {
+            fill ((unsigned int *) dst, value, n);
+        } else {
+            for (i = 0; i < n; i++) {
+                memcpy (dst + i * 4, &value, 4);
             }
+        }
+    } else if (bpp == 2) {
+        for (i = 0; i < n; i++) {
+            memcpy (dst + i * 2, &value16, 2);
+        }
+    } else {
+        for (i = 0; i < n; i++) {
+            dst[0] = (unsigned char) value;
+            dst[1] = (unsigned char) (value >> 8);
+            dst[2] = (unsigned char) (value >> 16);
+            dst += 3;
+        }
     }
-    if (k < i) {
-        /* There was uncompressed data before the sequence of equal pixels */
-        code = OIF_UNCOMPR_TYPE | (i - k);
-        *curr_code++ = code;
-        for (l = k; l < i; l++) {
-            *curr_code++ = pixel_data[i];
+}
+
+
+/*
+ * Converts n pixels of one row.
+ */
+static void
+oif_format_copy_row (
+    unsigned char *dst,
+    const unsigned int *src,
+    unsigned int n,
+    int format)
+{
+    unsigned short value16;
+    unsigned int value;
+    unsigned int i;
+
+    switch (format) {
+    case OIF_FORMAT_BGRA:
+        memcpy (dst, src, n * sizeof (unsigned int));
+        break;
+    case OIF_FORMAT_ARGB:
+        for (i = 0; i < n; i++) {
+            value = __builtin_bswap32 (src[i]);
+            memcpy (dst + i * 4, &value, 4);
+        }
+        break;
+    case OIF_FORMAT_RGB888:
+        for (i = 0; i < n; i++) {
+            value = src[i];
+            dst[0] = (unsigned char) value;
+            dst[1] = (unsigned char) (value >> 8);
+            dst[2] = (unsigned char) (value >> 16);
+            dst += 3;
         }
+        break;
+    default:
+        for (i = 0; i < n; i++) {
+            value16 = (unsigned short) oif_convert_pixel (src[i], OIF_FORMAT_RGB565);
+            memcpy (dst + i * 2, &value16, 2);
+        }
+        break;
     }
-    code = OIF_EOI_TYPE;
-    *curr_code++ = code;
-    header->img_size = (unsigned int) ((unsigned char *) curr_code - compr_data);
 }
 
 
 /*
- * Uncompresses the compressed image data. img_data must be large enough
- * for the uncompresses image.
+ * Writes count pixels at the current position of the decoder in its
+ * pixel format, split into rows. If src is 0, the pixels have the
+ * value pixel, which is converted only once.
+ */
+static void
+oif_format_write (
+    struct oif_decoder *dec,
+    const unsigned int *src,
+    unsigned int pixel,
+    unsigned int count,
+    oif_fill_fn fill)
+{
+    unsigned int width = dec->header->width;
+    unsigned int x = dec->pos % width;
+    unsigned int y = dec->pos / width;
+    unsigned int value = oif_convert_pixel (pixel, dec->format);
+    unsigned char *dst;
+    unsigned int n;
+
+    while (count > 0) {
+        n = (count < width - x) ? count : width - x;
+        dst = dec->img_data + y * dec->stride + x * dec->bpp;
+        if (src != 0) {
+            oif_format_copy_row (dst, src, n, dec->format);
+            src += n;
+        } else {
+            oif_format_fill_row (dst, value, n, dec->bpp, fill);
+        }
+        count -= n;
+        x = 0;
+        y++;
+    }
+}
+
+
+/*
+ * Copies a rectangle of the decoded image in its pixel format, for
+ * UP (src_y = dst_y - 1) and COPY. The rows are copied in the order
+ * that allows overlapping rectangles.
+ */
+static void
+oif_format_copy_rect (
+    struct oif_decoder *dec,
+    unsigned int dst_x,
+    unsigned int dst_y,
+    unsigned int src_x,
+    unsigned int src_y,
+    unsigned int rect_width,
+    unsigned int rect_height)
+{
+    unsigned char *dst = dec->img_data + dst_y * dec->stride + dst_x * dec->bpp;
+    const unsigned char *src = dec->img_data + src_y * dec->stride + src_x * dec->bpp;
+    unsigned int row;
+
+    if (dst_y <= src_y) {
+        for (row = 0; row < rect_height; row++) {
+            memmove (dst + row * dec->stride, src + row * dec->stride, rect_width * dec->bpp);
+        }
+    } else {
+        for (row = rect_height; row-- > 0;) {
+            memmove (dst + row * dec->stride, src + row * dec->stride, rect_width * dec->bpp);
+        }
+    }
+}
+
+
+/*
+ * Writes count pixels with the value pixel at the current position.
+ */
+static inline void
+oif_decoder_fill (
+    struct oif_decoder *dec,
+    unsigned int pixel,
+    unsigned int count,
+    oif_fill_fn fill)
+{
+    if (dec->bpp == 0) {
+        fill ((unsigned int *) dec->img_data + dec->pos, pixel, count);
+    } else {
+        oif_format_write (dec, 0, pixel, count, fill);
+    }
+    dec->pos += count;
+}
+
+
+/*
+ * Writes count pixels from src at the current position.
+ */
+static inline void
+oif_decoder_copy (
+    struct oif_decoder *dec,
+    const unsigned int *src,
+    unsigned int count,
+    oif_fill_fn fill,
+    oif_copy_fn copy)
+{
+    if (dec->bpp == 0) {
+        copy ((unsigned int *) dec->img_data + dec->pos, src, count);
+    } else {
+        oif_format_write (dec, src, 0, count, fill);
+    }
+    dec->pos += count;
+}
+
+
+/*
+ * Copies count pixels from the row above for the UP code.
+ */
+static void
+oif_decoder_up (
+    struct oif_decoder *dec,
+    unsigned int count,
+    oif_copy_fn copy)
+{
+    unsigned int width = dec->header->width;
+    unsigned int n;
+
+    if (dec->bpp == 0) {
+        oif_copy_up ((unsigned int *) dec->img_data + dec->pos, width, count, copy);
+        dec->pos += count;
+        return;
+    }
+    while (count > 0) {
+        n = (count < width - dec->pos % width) ? count : width - dec->pos % width;
+        oif_format_copy_rect (dec, dec->pos % width, dec->pos / width,
+                              dec->pos % width, dec->pos / width - 1, n, 1);
+        dec->pos += n;
+        count -= n;
+    }
+}
+
+
+/*
+ * Adds count pixels from first to the damage of the incremental
+ * decoder. Pixels in more than one row extend it to the full width.
+ */
+static void
+oif_decoder_damage (
+    struct oif_decoder *dec,
+    unsigned int start,
+    unsigned int count)
+{
+    unsigned int width = dec->header->width;
+    unsigned int end;
+    struct oif_rect rect;
+
+    if (!(dec->flags & OIF_FLAG_DAMAGE) || (count == 0)) {
+        return;
+    }
+    end = start + count - 1;
+    rect.y = start / width;
+    rect.height = end / width - rect.y + 1;
+    if (rect.height == 1) {
+        rect.x = start % width;
+        rect.width = count;
+    } else {
+        rect.x = 0;
+        rect.width = width;
+    }
+    oif_rect_union (&dec->damage, &rect);
+}
+
+
+/*
+ * Processes the arguments of a COPY code of the incremental decoder.
+ */
+static int
+oif_decoder_copy_rect (
+    struct oif_decoder *dec)
+{
+    struct oif_header *header = dec->header;
+    unsigned int rect_width = dec->code & 0x0000FFFF;
+    unsigned int rect_height = dec->copy_args[0];
+
+    if (!oif_copy_valid (header, dec->pos, rect_width, rect_height, dec->copy_args + 1)) {
+        return OIF_ERR_DST_OVERRUN;
+    }
+    if (rect_height == 0) {
+        return 0;
+    }
+    if (dec->bpp == 0) {
+        oif_copy_rect ((unsigned int *) dec->img_data, header->width, dec->pos % header->width,
+                       dec->pos / header->width, dec->copy_args[2], dec->copy_args[1],
+                       rect_width, rect_height);
+    } else {
+        oif_format_copy_rect (dec, dec->pos % header->width, dec->pos / header->width,
+                              dec->copy_args[2], dec->copy_args[1], rect_width, rect_height);
+    }
+    /* First and last row of the rectangle */
+    oif_decoder_damage (dec, dec->pos, rect_width);
+    dec->pos += (rect_height - 1) * header->width;
+    oif_decoder_damage (dec, dec->pos, rect_width);
+    dec->pos += rect_width;
+    return 0;
+}
+
+
+/*
+ * Processes one complete code word of the incremental decoder.
+ */
+static int
+oif_decoder_code (
+    struct oif_decoder *dec,
+    unsigned int code,
+    unsigned int line,
+    oif_fill_fn fill,
+    oif_copy_fn copy)
+{
+    unsigned int type = code & 0xF0000000;
+    unsigned int count = code & 0x0000FFFF;
+    unsigned int bits;
+
+    if (type == OIF_EXT_TYPE) {
+        /* The line of an EXT code is passed by the caller */
+        type = (code << 4) & 0xF0000000;
+        count = code & OIF_EXT_MAX_COUNT;
+        if ((type != OIF_UNCOMPR_TYPE) && (type != OIF_RLE_TYPE) && (type != OIF_SKIP_TYPE) &&
+                (type != OIF_UP_TYPE) && !oif_ext_has_line (code)) {
+            return OIF_ERR_UNKNWON_CODE;
+        }
+    } else {
+        line = (code >> 16) & 0x00000FFF;
+    }
+
+    switch (type) {
+    case OIF_EOI_TYPE:
+        dec->state = OIF_DEC_DONE;
+        return 0;
+    case OIF_UNCOMPR_WSL_TYPE:
+    case OIF_RLE_WSL_TYPE:
+        if (line >= dec->header->height) {
+            return OIF_ERR_DST_OVERRUN;
+        }
+        dec->pos = line * dec->header->width;
+        break;
+    case OIF_UNCOMPR_TYPE:
+    case OIF_RLE_TYPE:
+        break;
+    case OIF_SKIP_TYPE:
+        if (count > dec->num_pixels - dec->pos) {
+            return OIF_ERR_DST_OVERRUN;
+        }
+        dec->pos += count;
+        return 0;
+    case OIF_POS_TYPE:
+        if ((count >= dec->header->width) || (line >= dec->header->height)) {
+            return OIF_ERR_DST_OVERRUN;
+        }
+        dec->pos = line * dec->header->width + count;
+        return 0;
+    case OIF_UP_TYPE:
+        if ((dec->pos < dec->header->width) || (count > dec->num_pixels - dec->pos)) {
+            return OIF_ERR_DST_OVERRUN;
+        }
+        oif_decoder_damage (dec, dec->pos, count);
+        oif_decoder_up (dec, count, copy);
+        return 0;
+    case OIF_COPY_TYPE:
+        /* Height, source line and column follow */
+        dec->code = code;
+        dec->count = 0;
+        dec->state = OIF_DEC_COPY;
+        return 0;
+    case OIF_PALETTE_TYPE:
+        if (count > OIF_PALETTE_SIZE) {
+            return OIF_ERR_UNKNWON_CODE;
+        }
+        memset (dec->palette, 0, sizeof (*dec->palette));
+        dec->palette->num_colors = count;
+        dec->count = count;
+        if (count > 0) {
+            dec->state = OIF_DEC_PALETTE;
+        }
+        return 0;
+    case OIF_INDEXED_TYPE:
+        bits = (code >> 24) & 0x0000000F;
+        if ((bits != 1) && (bits != 2) && (bits != 4) && (bits != 8)) {
+            return OIF_ERR_UNKNWON_CODE;
+        }
+        if (count > dec->num_pixels - dec->pos) {
+            return OIF_ERR_DST_OVERRUN;
+        }
+        oif_decoder_damage (dec, dec->pos, count);
+        dec->bits = bits;
+        dec->count = count;
+        if (count > 0) {
+            dec->state = OIF_DEC_INDEXED;
+        }
+        return 0;
+    case OIF_INDEXED_RLE_TYPE:
+        if (count > dec->num_pixels - dec->pos) {
+            return OIF_ERR_DST_OVERRUN;
+        }
+        oif_decoder_damage (dec, dec->pos, count);
+        oif_decoder_fill (dec, dec->palette->colors[(code >> 16) & 0x000000FF], count, fill);
+        return 0;
+    default:
+        return OIF_ERR_UNKNWON_CODE;
+    }
+    if (count > dec->num_pixels - dec->pos) {
+        return OIF_ERR_DST_OVERRUN;
+    }
+    oif_decoder_damage (dec, dec->pos, count);
+    dec->count = count;
+    if ((type == OIF_RLE_TYPE) || (type == OIF_RLE_WSL_TYPE)) {
+        dec->state = OIF_DEC_RLE_VALUE;
+    } else if (count > 0) {
+        dec->state = OIF_DEC_UNCOMPR;
+    }
+    return 0;
+}
+
+
+/*
+ * Passes the next bytes of compressed data to the decoder.
+ * The pixels are written to the image as soon as they are received.
+ * The number of bytes used is returned in consumed, it is less than size
+ * only if the image is complete.
+ * Returns 1 if the image is complete, 0 if more data is needed,
+ * or a negative error code.
  */
 int
-oif_uncompress (
-    struct oif_header *header,
-    unsigned char *compr_data,
-    unsigned char *img_data)
+oif_decoder_feed (
+    struct oif_decoder *dec,
+    const unsigned char *data,
+    unsigned int size,
+    unsigned int *consumed)
 {
-    unsigned int i;
-    unsigned int code;
-    unsigned int pixel_value = 0;
+    const unsigned char *start = data;
+    oif_fill_fn fill = oif_fill;
+    oif_copy_fn copy = oif_copy;
+    unsigned int buffer[256];
+    unsigned int word;
     unsigned int count;
-    unsigned int line;
-    unsigned int *curr_code = (unsigned int *) compr_data;
-    unsigned int *curr_pixel = (unsigned int *) img_data;
-    unsigned int *max_pixel = (unsigned int *) img_data + header->width * header->height;
-    unsigned int *max_code = (unsigned int *) compr_data + header->img_size;
+    int ret = 0;
 
-    code = *curr_code++;
-    while ((code & 0xF0000000) != OIF_EOI_TYPE) {
-        count = code & 0x0000FFFF;
-        switch ((code & 0xF0000000)) {
-        case OIF_UNCOMPR_TYPE:
-            // printf ("OIF_UNCOMPR_TYPE, count = %d\n", count);
-            if (curr_pixel + count > max_pixel) {
-                return OIF_ERR_DST_OVERRUN;
+    if (dec->flags & OIF_FLAG_NONTEMPORAL) {
+        fill = oif_fill_nt;
+        copy = oif_copy_nt;
+    }
+
+    if ((dec->header->img_size != OIF_IMG_SIZE_UNKNOWN) &&
+            (size > dec->header->img_size - dec->received)) {
+        size = dec->header->img_size - dec->received;
+    }
+
+    while ((size > 0) && (dec->state != OIF_DEC_DONE)) {
+        if ((dec->state == OIF_DEC_UNCOMPR) && (dec->word_bytes == 0) && (size >= 4)) {
+            /* Copy as many complete pixels as possible */
+            count = size / sizeof (unsigned int);
+            if (count > dec->count) {
+                count = dec->count;
             }
-            if (curr_code + count > max_code) {
-                return OIF_ERR_SRC_OVERRUN;
+            if (((uintptr_t) data & 3) == 0) {
+                oif_decoder_copy (dec, (const unsigned int *) data, count, fill, copy);
+            } else {
+                /* The pixels cannot be read in place from unaligned data */
+                if (count > sizeof (buffer) / sizeof (buffer[0])) {
+                    count = sizeof (buffer) / sizeof (buffer[0]);
+                }
+                memcpy (buffer, data, count * sizeof (unsigned int));
+                oif_decoder_copy (dec, buffer, count, fill, copy);
             }
-            for (i = 0; i < count; i++) {
-                *curr_pixel++ = *curr_code++;
+            dec->count -= count;
+            data += count * sizeof (unsigned int);
+            size -= count * sizeof (unsigned int);
+            if (dec->count == 0) {
+                dec->state = OIF_DEC_CODE;
             }
+            continue;
+        }
+
+        /* Assemble the next word, it may be split between two calls */
+        while ((size > 0) && (dec->word_bytes < 4)) {
+            dec->word[dec->word_bytes++] = *data++;
+            size--;
+        }
+        if (dec->word_bytes < 4) {
             break;
-        case OIF_UNCOMPR_WSL_TYPE:
-            line = (code >> 16) & 0x00000FFF;
-            curr_pixel = (unsigned int *) (img_data +
-                                            (line * header->width));
-            if (curr_pixel + count > max_pixel) {
-                return OIF_ERR_DST_OVERRUN;
-            }
-            if (curr_code + count > max_code) {
-                return OIF_ERR_SRC_OVERRUN;
-            }
-            for (i = 0; i < count; i++) {
-                *curr_pixel++ = *curr_code++;
+        }
+        dec->word_bytes = 0;
+        memcpy (&word, dec->word, sizeof (word));
+
+        switch (dec->state) {
+        case OIF_DEC_CODE:
+            if (((word & 0xF0000000) == OIF_EXT_TYPE) && oif_ext_has_line (word)) {
+                /* The line follows in the next word */
+                dec->code = word;
+                dec->state = OIF_DEC_LINE;
+            } else {
+                ret = oif_decoder_code (dec, word, 0, fill, copy);
             }
             break;
-        case OIF_RLE_TYPE:
-            // printf ("OIF_RLE_TYPE, count = %d\n", count);
-            if (curr_pixel + count > max_pixel) {
-                return OIF_ERR_DST_OVERRUN;
+        case OIF_DEC_LINE:
+            dec->state = OIF_DEC_CODE;
+            ret = oif_decoder_code (dec, dec->code, word, fill, copy);
+            break;
+        case OIF_DEC_COPY:
+            dec->copy_args[dec->count++] = word;
+            if (dec->count == 3) {
+                dec->state = OIF_DEC_CODE;
+                ret = oif_decoder_copy_rect (dec);
             }
-            pixel_value = *curr_code++;
-            if (curr_code > max_code) {
-                return OIF_ERR_SRC_OVERRUN;
+            break;
+        case OIF_DEC_RLE_VALUE:
+            oif_decoder_fill (dec, word, dec->count, fill);
+            dec->state = OIF_DEC_CODE;
+            break;
+        case OIF_DEC_UNCOMPR:
+            oif_decoder_copy (dec, &word, 1, fill, copy);
+            if (--dec->count == 0) {
+                dec->state = OIF_DEC_CODE;
             }
-            for (i = 0; i < count; i++) {
-                *curr_pixel++ = pixel_value;
+            break;
+        case OIF_DEC_PALETTE:
+            dec->palette->colors[dec->palette->num_colors - dec->count] = word;
+            if (--dec->count == 0) {
+                dec->state = OIF_DEC_CODE;
             }
             break;
-        case OIF_RLE_WSL_TYPE:
-            line = (code >> 16) & 0x00000FFF;
-            curr_pixel = (unsigned int *) img_data +
-                (line * header->width);
-            if (curr_pixel + count > max_pixel) {
-                return OIF_ERR_DST_OVERRUN;
+        case OIF_DEC_INDEXED:
+            count = 32 / dec->bits;
+            if (count > dec->count) {
+                count = dec->count;
             }
-            pixel_value = *curr_code++;
-            if (curr_code > max_code) {
-                return OIF_ERR_SRC_OVERRUN;
+            if (dec->bpp == 0) {
+                oif_expand_indices ((unsigned int *) dec->img_data + dec->pos, &word, count,
+                                    dec->bits, dec->palette->colors, copy);
+                dec->pos += count;
+            } else {
+                oif_expand_indices (buffer, &word, count, dec->bits, dec->palette->colors,
+                                    oif_copy);
+                oif_decoder_copy (dec, buffer, count, fill, copy);
             }
-            for (i = 0; i < count; i++) {
-                *curr_pixel++ = pixel_value;
+            dec->count -= count;
+            if (dec->count == 0) {
+                dec->state = OIF_DEC_CODE;
             }
             break;
-        default:
-            return OIF_ERR_UNKNWON_CODE;
         }
-        code = *curr_code++;
-        if (curr_code > max_code) {
-            return OIF_ERR_SRC_OVERRUN;
+        if (ret < 0) {
+            break;
         }
     }
-    return 0;
-}
 
+    if ((dec->state == OIF_DEC_DONE) && (dec->header->img_size != OIF_IMG_SIZE_UNKNOWN)) {
+        /* Skip the data following the EOI code, like an index */
+        data += size;
+        size = 0;
+    }
 
+    dec->received += (unsigned int) (data - start);
+    *consumed = (unsigned int) (data - start);
 
+    if ((ret == 0) && (dec->state != OIF_DEC_DONE) &&
+            (dec->received == dec->header->img_size)) {
+        /* All data received, but no EOI code */
+        ret = OIF_ERR_SRC_OVERRUN;
+    }
+    if (dec->flags & OIF_FLAG_NONTEMPORAL) {
+        oif_store_fence ();
+    }
+    if (ret < 0) {
+        return ret;
+    }
+    if ((dec->state == OIF_DEC_DONE) && ((dec->header->img_size == OIF_IMG_SIZE_UNKNOWN) ||
+                                         (dec->received == dec->header->img_size))) {
+        return 1;
+    }
+    return 0;
+}
@@ -34,8 +34,71 @@
  * The WSL types (WSL = With Start Line) start at the specified line.
  * With the WSL types it is possible to send only partital stripes
  * of an overlay image.
+ * If the compression type is SKIP, the number of pixels are skipped,
+ * the decoder leaves them unchanged.
+ *
+ * Images with few colors can use a palette of up to 256 colors:
+ * The PALETTE type defines a palette, the number of pixels is the number
+ * of colors following the control code. The palette is valid for the
+ * following codes and, if the decoder keeps it, for the following images.
+ * The INDEXED type is followed by palette indices instead of pixels,
+ * bit 27-24 contain the number of bits of an index (1, 2, 4 or 8).
+ * The indices are packed into 32 bit words, starting with the least
+ * significant bits.
+ * The INDEXED_RLE type repeats the color with the palette index in
+ * bit 23-16 the number of pixels times, it has no following pixel value.
+ *
+ * The POS type sets the position of the next pixel without writing
+ * anything: bit 27-16 contain the line, bit 15-0 the column.
+ * A sub-rectangle of an image, e.g. a small widget, is encoded as one
+ * POS code per row followed by the codes of the row.
+ *
+ * The UP type copies the number of pixels from one row above in the
+ * decoded image. If the number of pixels is larger than a row, the
+ * previous rows are repeated, e.g. 3 * width pixels repeat the line
+ * above three times. It is only written by oif_compress_ex with
+ * OIF_OPT_UP.
+ *
+ * The COPY type copies a rectangle within the decoded image, e.g. for
+ * moved or scrolled content. Bit 15-0 contain the width of the rectangle,
+ * the next three words the height, the line and the column of the source
+ * rectangle. The destination is the current position, which is usually
+ * set by a POS code before. The rectangles may overlap. The position
+ * afterwards is the pixel after the last row of the rectangle.
+ *
+ *
+ * Version 2 adds the EXT type for images with more than 4096 lines and
+ * for sequences of more than 65535 pixels:
+ *
+ * Bit 31-28: EXT
+ * Bit 27-24: Compression type (UNCOMPR, UNCOMPR_WSL, RLE, RLE_WSL,
+ *            SKIP, POS or UP)
+ * Bit 23-0:  Number of pixels, or the column for POS
+ *
+ * For the WSL types and POS, the next word contains the line.
+ * The data follows as for the compression type. The encoder only uses EXT
+ * codes if needed.
+ *
+ * Version 1 decoders only know the types UNCOMPR, UNCOMPR_WSL, RLE,
+ * RLE_WSL and EOI. The encoders set the version in the header to
+ * OIF_VERSION_COMPAT if an image only contains these types, otherwise
+ * (SKIP, PALETTE, INDEXED, INDEXED_RLE, POS, UP, COPY or EXT) to
+ * OIF_VERSION.
+ *
  * The last code nust have the type EOI.
  *
+ * An image may have an index, which allows to decode stripes of the
+ * image independently. If bit OIF_RES_FLAG_INDEX is set in
+ * reserved[OIF_RES_FLAGS], the index starts at byte offset
+ * reserved[OIF_RES_INDEX_OFFSET] of the image data, after the EOI code:
+ *
+ * Word 0:     Number of stripes n
+ * Word 1:     Lines per stripe
+ * Word 2-n+1: Byte offset of the first code of each stripe
+ *
+ * The index is part of img_size, decoders that do not know it stop
+ * at the EOI code.
+ *
  */
 
 #ifndef OIF_H
@@ -44,19 +107,108 @@
 #define OIF_MAGIC 0x4F494620  /* "OIF " */
 
 /* The current version */
-#define OIF_VERSION 1
+#define OIF_VERSION 2
 #define OIF_SUBVERSION 0
 
+/* Version of images with only the code types of version 1, which can
+ * also be decoded by version 1 decoders */
+#define OIF_VERSION_COMPAT 1
+
 #define OIF_UNCOMPR_TYPE 0x10000000
 #define OIF_UNCOMPR_WSL_TYPE 0x20000000
 #define OIF_RLE_TYPE 0x30000000
 #define OIF_RLE_WSL_TYPE 0x40000000
+#define OIF_SKIP_TYPE 0x50000000
+#define OIF_PALETTE_TYPE 0x60000000
+#define OIF_INDEXED_TYPE 0x70000000
+#define OIF_INDEXED_RLE_TYPE 0x80000000
+#define OIF_POS_TYPE 0x90000000
+#define OIF_UP_TYPE 0xA0000000
+#define OIF_COPY_TYPE 0xB0000000
+#define OIF_EXT_TYPE 0xE0000000
 #define OIF_EOI_TYPE 0xF0000000
 
 
 #define OIF_ERR_UNKNWON_CODE -1
 #define OIF_ERR_SRC_OVERRUN -2
 #define OIF_ERR_DST_OVERRUN -3
+#define OIF_ERR_BUSY -4
+#define OIF_ERR_RANGE -5
+/* Error of a system call, errno is set */
+#define OIF_ERR_IO -6
+
+/* img_size of an image that is sent while it is encoded,
+ * the image data ends with the EOI code */
+#define OIF_IMG_SIZE_UNKNOWN 0xFFFFFFFF
+
+/* Maximum number of pixels of an EXT code */
+#define OIF_EXT_MAX_COUNT 0x00FFFFFF
+
+
+/* Use of the reserved fields of the header */
+#define OIF_RES_FLAGS 0
+#define OIF_RES_INDEX_OFFSET 1
+#define OIF_RES_Z 2
+
+/* Flags in reserved[OIF_RES_FLAGS] */
+#define OIF_RES_FLAG_INDEX 0x00000001
+/* reserved[OIF_RES_Z] is the z-order of the overlay, if it is
+ * composited with others. Without it, the id is the z-order. */
+#define OIF_RES_FLAG_Z 0x00000002
+/* The image sets all pixels, it does not depend on the previous image.
+ * Set by oif_compress, oif_compress_ex (unless it uses OIF_OPT_SKIP or
+ * the persistent palette of a previous image), oif_compress_parallel
+ * and the incremental encoder, but not by the delta encoders. A receiver that
+ * is behind may drop all images of the id before such an image. */
+#define OIF_RES_FLAG_KEY 0x00000004
+
+/* Lines per stripe of the index created by oif_compress_parallel */
+#define OIF_INDEX_STRIPE_LINES 32
+
+/* Maximum number of colors of a palette */
+#define OIF_PALETTE_SIZE 256
+
+/* Size in bytes of the largest compressed image data of a width x height
+ * image, for all encoders. Incompressible images need one word per pixel
+ * plus the codes: one per 65535 pixels, up to four per row for the
+ * WSL and POS codes of stripes, delta lines and rectangles, the index
+ * of oif_compress_parallel, the palette and the EOI code.
+ * oif_compress_motion needs 6 more words per move. */
+#define OIF_COMPRESS_BOUND(width, height) \
+    (((width) * (height) + (width) * (height) / 0xFFFF + 4 * (height) + \
+      OIF_PALETTE_SIZE + 8) * 4)
+
+/* Flags of the encoder options */
+#define OIF_OPT_SKIP 0x0001
+#define OIF_OPT_PALETTE 0x0002
+#define OIF_OPT_UP 0x0004
+
+/* Effort levels of the encoder */
+#define OIF_EFFORT_GREEDY 0
+#define OIF_EFFORT_MAX 1
+
+/* Kernels used by the encoder to detect runs of equal pixels */
+#define OIF_KERNEL_AUTO 0
+#define OIF_KERNEL_SCALAR 1
+#define OIF_KERNEL_PORTABLE 2
+#define OIF_KERNEL_SSE2 3
+#define OIF_KERNEL_AVX2 4
+
+/* Flags for oif_uncompress_ex */
+#define OIF_FLAG_NONTEMPORAL 0x0001
+/* Only for the incremental decoder: the rectangle of all written
+ * pixels is recorded in damage */
+#define OIF_FLAG_DAMAGE 0x0002
+
+/* Pixel formats of the decoded image, see oif_uncompress_format.
+ * BGRA is the format of OIF, the unsigned int 0xAARRGGBB. */
+#define OIF_FORMAT_BGRA 0
+/* 0xAARRGGBB with the bytes in reverse order */
+#define OIF_FORMAT_ARGB 1
+/* 3 bytes B, G, R per pixel */
+#define OIF_FORMAT_RGB888 2
+/* 16 bit 0bRRRRRGGGGGGBBBBB */
+#define OIF_FORMAT_RGB565 3
 
 
 struct oif_header {
@@ -81,6 +233,124 @@ struct oif_header {
 };
 
 
+/*
+ * A rectangle, empty if width or height is 0.
+ */
+struct oif_rect {
+    unsigned int x;
+    unsigned int y;
+    unsigned int width;
+    unsigned int height;
+};
+
+
+/*
+ * A palette for images with few colors.
+ */
+struct oif_palette {
+    unsigned int num_colors;
+    unsigned int colors[OIF_PALETTE_SIZE];
+};
+
+
+/*
+ * Encoder options for oif_compress_ex, initialized by oif_init_options.
+ */
+struct oif_options {
+    /* OIF_OPT_... flags. With OIF_OPT_UP, rows that repeat the row above
+     * are encoded with UP codes, the image then needs a version 2 decoder. */
+    int flags;
+    /* With OIF_OPT_SKIP, sequences of this "don't care" value are encoded
+     * as SKIP codes, so the decoder does not write them at all. This is
+     * only useful if the destination already contains this value or
+     * if these pixels do not matter, e.g. transparent pixels (0x00000000)
+     * on a cleared overlay. */
+    unsigned int skip_value;
+    /* With OIF_OPT_PALETTE, images with at most OIF_PALETTE_SIZE colors
+     * are encoded with palette indices. The palette is created
+     * automatically and sent with the image.
+     * If palette is not 0, it is the persistent palette of the decoder:
+     * the palette is only sent if it changes, and the new palette is
+     * stored here. The decoder must then keep the palette as well,
+     * see oif_uncompress_palette. */
+    struct oif_palette *palette;
+    /* Encoder effort:
+     * OIF_EFFORT_GREEDY (default) encodes each sequence of at least three
+     * equal pixels as a run.
+     * OIF_EFFORT_MAX chooses between runs and uncompressed pixels
+     * by dynamic programming, for the smallest output. It needs 5 bytes
+     * of temporary memory per pixel and is meant for images that are
+     * converted once, like with png2oif. */
+    int effort;
+};
+
+
+/*
+ * State of the incremental encoder, see oif_encoder_begin.
+ * The members are private to the encoder.
+ */
+struct oif_encoder {
+    struct oif_header *header;
+    /* Number of rows pushed so far */
+    unsigned int rows;
+    /* The rows of the last push */
+    const unsigned int *in;
+    unsigned int in_size;
+    unsigned int in_pos;
+    /* Equal pixels at the end of the last push */
+    unsigned int tail_value;
+    unsigned int tail_count;
+    /* The code currently written, with the number of its words
+     * and the words already written */
+    unsigned int code[2];
+    unsigned int code_words;
+    unsigned int code_pos;
+    /* Uncompressed pixels: number of pixels from the last push (all
+     * equal to code[1]) followed by the pixels from lit_src */
+    unsigned int lit_prefix;
+    const unsigned int *lit_src;
+    /* Bytes written so far */
+    unsigned int size;
+    int finishing;
+    int done;
+};
+
+
+/*
+ * State of the incremental decoder, see oif_decoder_begin.
+ * The members are private to the decoder.
+ */
+struct oif_decoder {
+    struct oif_header *header;
+    unsigned char *img_data;
+    /* Index of the next pixel */
+    unsigned int pos;
+    unsigned int num_pixels;
+    int flags;
+    /* Pixel format, if bpp != 0, see oif_decoder_set_format */
+    int format;
+    unsigned int bpp;
+    unsigned int stride;
+    int state;
+    /* Pixels left for the current code */
+    unsigned int count;
+    /* A word split between two calls */
+    unsigned char word[4];
+    unsigned int word_bytes;
+    /* Bytes of image data received so far */
+    unsigned int received;
+    /* Palette, and index size of the current code */
+    struct oif_palette *palette;
+    struct oif_palette own_palette;
+    unsigned int bits;
+    /* EXT code waiting for its line, or COPY code for its arguments */
+    unsigned int code;
+    unsigned int copy_args[3];
+    /* Pixels written so far with OIF_FLAG_DAMAGE, may be read */
+    struct oif_rect damage;
+};
+
+
 /*
  * Initializes an OIF header. The header can then be
  * directly used.
@@ -91,11 +361,42 @@ oif_init_header (
     unsigned int width,
     unsigned int height);
 
+/*
+ * Extends rect to the bounding rectangle of rect and add.
+ */
+extern void
+oif_rect_union (
+    struct oif_rect *rect,
+    const struct oif_rect *add);
+
+/*
+ * Initializes the encoder options with the defaults,
+ * which give the same result as oif_compress.
+ */
+extern void
+oif_init_options (
+    struct oif_options *opts);
+
+/*
+ * Selects the kernels used by oif_compress. With OIF_KERNEL_AUTO
+ * the fastest kernels supported by the CPU are used, this is also
+ * the default if the function is never called. The default is selected
+ * once, thread-safe, by the first encoder or decoder call. Selecting
+ * other kernels while images are encoded or decoded is not safe.
+ * If the requested kernels are not supported, the next slower ones
+ * are used.
+ * All kernels produce identical output.
+ * Returns the kernels actually selected.
+ */
+extern int
+oif_select_kernels (
+    int kernels);
+
 /*
  * Compresses an image data buffer.
  * The header must contain magic, width and height, and id.
  * The size is set after the compression,
- * compr_data must be a buffer with the same size as the input buffer.
+ * compr_data must be a buffer of OIF_COMPRESS_BOUND (width, height) bytes.
  */
 extern void
 oif_compress (
@@ -103,6 +404,170 @@ oif_compress (
     unsigned char *img_data,
     unsigned char *compr_data);
 
+/*
+ * Compresses an image data buffer like oif_compress, using the
+ * encoder options opts.
+ */
+extern void
+oif_compress_ex (
+    struct oif_header *header,
+    unsigned char *img_data,
+    unsigned char *compr_data,
+    const struct oif_options *opts);
+
+/*
+ * Compresses an image data buffer like oif_compress, using num_threads
+ * threads. The image is split into stripes of OIF_INDEX_STRIPE_LINES lines,
+ * each starting with a WSL code, which are compressed in parallel and then
+ * joined. An index of the stripes is appended, see above.
+ * The result can be decoded by oif_uncompress, and in parallel by
+ * oif_uncompress_parallel.
+ * compr_data must be a buffer of OIF_COMPRESS_BOUND (width, height) bytes,
+ * the index makes it larger than the result of oif_compress.
+ * If num_threads is <= 0, one thread per CPU is used.
+ * Returns 0, or -1 if the memory for the stripes cannot be allocated.
+ */
+extern int
+oif_compress_parallel (
+    struct oif_header *header,
+    unsigned char *img_data,
+    unsigned char *compr_data,
+    int num_threads);
+
+/*
+ * Compresses only the lines of img_data that differ from prev_data,
+ * the previous image with the same size. Each range of changed lines
+ * is encoded with a leading WSL code, so the decoder leaves all other
+ * lines untouched. If only some columns have changed, only the changed
+ * columns are encoded, with POS codes.
+ * The header must contain magic, width and height, and id.
+ * The size is set after the compression,
+ * compr_data must be a buffer of OIF_COMPRESS_BOUND (width, height) bytes.
+ * Returns the number of encoded lines, 0 if both images are identical.
+ */
+extern int
+oif_compress_delta (
+    struct oif_header *header,
+    unsigned char *prev_data,
+    unsigned char *img_data,
+    unsigned char *compr_data);
+
+/*
+ * Rectangle x, y, width x height of the previous image that has moved
+ * by dx, dy in the current image.
+ */
+struct oif_motion {
+    unsigned int x;
+    unsigned int y;
+    unsigned int width;
+    unsigned int height;
+    int dx;
+    int dy;
+};
+
+/*
+ * Compresses img_data like oif_compress_delta, but the moved rectangles
+ * are first copied within the decoded image with COPY codes. Only the
+ * remaining differences are encoded, so moved or scrolled content costs
+ * a few words instead of its pixels. The moves are applied in the given
+ * order, the source rectangle of a move is read after the previous moves.
+ * The header must contain magic, width and height, and id.
+ * The size is set after the compression,
+ * compr_data must be a buffer of OIF_COMPRESS_BOUND (width, height)
+ * bytes plus 6 words per move.
+ * Returns the number of lines encoded after the copies,
+ * OIF_ERR_RANGE if a rectangle is not inside the image,
+ * or -1 if there is not enough memory.
+ */
+extern int
+oif_compress_motion (
+    struct oif_header *header,
+    unsigned char *prev_data,
+    unsigned char *img_data,
+    unsigned char *compr_data,
+    const struct oif_motion *moves,
+    unsigned int num_moves);
+
+/*
+ * Searches one move for oif_compress_motion: the displacement up to
+ * range pixels of the changed part of img_data to prev_data. Suited
+ * for a single moving or scrolling object, only a sample of the
+ * pixels is compared, the time grows with the square of range.
+ * Returns 1 and sets motion if a move was found, otherwise 0.
+ */
+extern int
+oif_find_motion (
+    struct oif_header *header,
+    unsigned char *prev_data,
+    unsigned char *img_data,
+    int range,
+    struct oif_motion *motion);
+
+/*
+ * Compresses only the rectangle with the upper left corner x, y and the
+ * size rect_width x rect_height of img_data. Each row of the rectangle
+ * starts with a POS code, so the size of the compressed data depends
+ * only on the rectangle. The decoder leaves all other pixels untouched.
+ * The header must contain magic, width and height, and id.
+ * The size is set after the compression,
+ * compr_data must be a buffer of OIF_COMPRESS_BOUND (width, height) bytes.
+ * Returns 0, or OIF_ERR_RANGE if the rectangle is not inside the image.
+ */
+extern int
+oif_compress_rect (
+    struct oif_header *header,
+    unsigned char *img_data,
+    unsigned char *compr_data,
+    unsigned int x,
+    unsigned int y,
+    unsigned int rect_width,
+    unsigned int rect_height);
+
+/*
+ * Incremental encoder with bounded memory. The image is passed a few
+ * rows at a time, the compressed data is written into small output chunks:
+ *
+ *     oif_encoder_begin (&enc, &header);
+ *     for each block of rows:
+ *         oif_encoder_push_rows (&enc, rows, num_rows);
+ *         while ((size = oif_encoder_drain (&enc, chunk, sizeof (chunk))) > 0)
+ *             send chunk
+ *     oif_encoder_finish (&enc);
+ *     while ((size = oif_encoder_drain (&enc, chunk, sizeof (chunk))) > 0)
+ *         send chunk
+ *
+ * The encoder does not allocate memory, and no pixels are copied into it.
+ * The rows must be contiguous and stay valid until oif_encoder_drain
+ * returned 0. The chunk size must be at least 4 bytes, only complete 32 bit
+ * words are written.
+ * oif_encoder_begin sets img_size in the header to OIF_IMG_SIZE_UNKNOWN,
+ * the final size is set when the last chunk was drained. It is at most
+ * OIF_COMPRESS_BOUND (width, height) if at least one row is pushed at a time.
+ * oif_encoder_push_rows returns OIF_ERR_BUSY if the previous rows are
+ * not fully encoded yet, and OIF_ERR_SRC_OVERRUN if more rows than the
+ * image height are pushed.
+ */
+extern void
+oif_encoder_begin (
+    struct oif_encoder *enc,
+    struct oif_header *header);
+
+extern int
+oif_encoder_push_rows (
+    struct oif_encoder *enc,
+    const unsigned char *rows,
+    unsigned int num_rows);
+
+extern unsigned int
+oif_encoder_drain (
+    struct oif_encoder *enc,
+    unsigned char *out,
+    unsigned int out_size);
+
+extern void
+oif_encoder_finish (
+    struct oif_encoder *enc);
+
 /*
  * Uncompresses a compressed image.
  * The img_data must be a pointer to a memory area to contain the uncompressed
@@ -114,5 +579,191 @@ oif_uncompress (
     unsigned char *compr_data,
     unsigned char *img_data);
 
+/*
+ * Statistics of a compressed image, see oif_validate.
+ */
+struct oif_stats {
+    /* Number of codes of each type, indexed by type >> 28.
+     * EXT codes are counted as EXT. */
+    unsigned int codes[16];
+    unsigned int num_codes;
+    /* Pixels written by the codes, without SKIP and POS */
+    unsigned int pixels;
+    /* Bytes up to and including the EOI code */
+    unsigned int data_size;
+    /* OIF_VERSION if the image contains codes that version 1
+     * decoders do not know, otherwise OIF_VERSION_COMPAT */
+    unsigned short version;
+};
+
+/*
+ * Checks that a compressed image can be decoded without error, in one
+ * fast pass over the codes without writing pixels. The image is checked
+ * as oif_uncompress does: each code must lie within img_size bytes and
+ * must not write outside the image of width x height pixels.
+ * stats may be 0, otherwise it is set for a valid image.
+ * Returns 0 if the image is valid, or the error code oif_uncompress
+ * would return.
+ */
+extern int
+oif_validate (
+    struct oif_header *header,
+    const unsigned char *compr_data,
+    struct oif_stats *stats);
+
+/*
+ * Uncompresses a compressed image like oif_uncompress_ex, but without
+ * checks. The image must have been checked with oif_validate and must
+ * not have changed since, e.g. a static overlay that is decoded many
+ * times. An image that is not valid may write outside img_data.
+ */
+extern int
+oif_uncompress_trusted (
+    struct oif_header *header,
+    unsigned char *compr_data,
+    unsigned char *img_data,
+    int flags);
+
+/*
+ * Uncompresses a compressed image like oif_uncompress.
+ * With OIF_FLAG_NONTEMPORAL the pixels are written with streaming stores
+ * that bypass the cache. This is much faster if img_data points to
+ * write-combined or uncached memory like a mapped framebuffer, but slower
+ * for normal memory that is read again soon.
+ */
+extern int
+oif_uncompress_ex (
+    struct oif_header *header,
+    unsigned char *compr_data,
+    unsigned char *img_data,
+    int flags);
+
+/*
+ * Uncompresses a compressed image like oif_uncompress_ex.
+ * palette is the persistent palette: it is used for palette indices if
+ * the image does not contain its own palette, and a palette of the image
+ * is stored in it. Initialize it with zeros before the first image.
+ */
+extern int
+oif_uncompress_palette (
+    const struct oif_header *header,
+    const unsigned char *compr_data,
+    unsigned char *img_data,
+    int flags,
+    struct oif_palette *palette);
+
+/*
+ * Uncompresses a compressed image like oif_uncompress_ex, using
+ * num_threads threads. This needs an image with index, as created by
+ * oif_compress_parallel, images without index are decoded by one thread.
+ * If num_threads is <= 0, one thread per CPU is used.
+ */
+extern int
+oif_uncompress_parallel (
+    struct oif_header *header,
+    unsigned char *compr_data,
+    unsigned char *img_data,
+    int num_threads,
+    int flags);
+
+/*
+ * Uncompresses a compressed image directly into the pixel format
+ * format, one of the OIF_FORMAT_* formats, e.g. the format of a
+ * framebuffer. Each run is converted once and each literal pixel
+ * when it is written, there is no conversion pass over the image.
+ * img_data has stride bytes per line, 0 means the width of the image.
+ * Formats with fewer bits are truncated, the alpha channel is dropped
+ * by RGB888 and RGB565.
+ * Returns the same as oif_uncompress, or OIF_ERR_RANGE for an unknown
+ * format or a stride that is too small.
+ */
+extern int
+oif_uncompress_format (
+    struct oif_header *header,
+    unsigned char *compr_data,
+    unsigned char *img_data,
+    int format,
+    unsigned int stride);
+
+/*
+ * Uncompresses only the lines first_line up to first_line + num_lines - 1
+ * of a compressed image. img_data must hold the complete image.
+ * With an index, only the stripes containing these lines are decoded,
+ * so other lines of these stripes are written as well.
+ * Without an index, the complete image is decoded.
+ */
+extern int
+oif_uncompress_lines (
+    struct oif_header *header,
+    unsigned char *compr_data,
+    unsigned char *img_data,
+    unsigned int first_line,
+    unsigned int num_lines,
+    int flags);
+
+/*
+ * Incremental decoder that decodes the image while the compressed data
+ * arrives, e.g. from a socket:
+ *
+ *     oif_decoder_begin (&dec, &header, img_data, flags);
+ *     do {
+ *         size = read (fd, buffer, sizeof (buffer));
+ *         ret = oif_decoder_feed (&dec, buffer, size, &consumed);
+ *     } while (ret == 0);
+ *
+ * The data can be split at any byte position and need not be aligned,
+ * the pixels are written to img_data as soon as they are received. flags are the same as for
+ * oif_uncompress_ex.
+ * If img_size in the header is known, exactly img_size bytes are used,
+ * data following the EOI code (like an index) is skipped.
+ * If it is OIF_IMG_SIZE_UNKNOWN, the image ends with the EOI code.
+ * The bytes used are returned in consumed, any bytes following the EOI code
+ * are not used and belong to the next image.
+ * oif_decoder_feed returns 1 if the image is complete, 0 if more data is
+ * needed, or a negative error code.
+ * By default, a palette is only valid for the image it is sent with.
+ * With oif_decoder_set_palette, which must be called after
+ * oif_decoder_begin, a persistent palette is used instead, see
+ * oif_uncompress_palette.
+ * With the flag OIF_FLAG_DAMAGE, dec.damage is the bounding rectangle
+ * of the pixels written so far, e.g. to update only this part of the
+ * screen.
+ * With oif_decoder_set_format, which must also be called after
+ * oif_decoder_begin, the image is decoded into another pixel format.
+ */
+extern void
+oif_decoder_begin (
+    struct oif_decoder *dec,
+    struct oif_header *header,
+    unsigned char *img_data,
+    int flags);
+
+extern int
+oif_decoder_feed (
+    struct oif_decoder *dec,
+    const unsigned char *data,
+    unsigned int size,
+    unsigned int *consumed);
+
+extern void
+oif_decoder_set_palette (
+    struct oif_decoder *dec,
+    struct oif_palette *palette);
+
+/*
+ * Makes the incremental decoder write the pixels in the pixel format
+ * format, one of the OIF_FORMAT_* formats, with stride bytes per line
+ * of img_data, 0 means the width of the image. It must be called after
+ * oif_decoder_begin and before the first oif_decoder_feed, the
+ * conversion is the same as for oif_uncompress_format.
+ * Returns 0, or OIF_ERR_RANGE for an unknown format or a stride that
+ * is too small, the format of the decoder is then not changed.
+ */
+extern int
+oif_decoder_set_format (
+    struct oif_decoder *dec,
+    int format,
+    unsigned int stride);
+
 #endif
 
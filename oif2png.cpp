@@ -15,65 +15,51 @@
  */
 
 #include <iostream>
-#include <fstream>
+#include <cstdlib>
 
 #include <opencv2/opencv.hpp>
 
 #include "oif.h"
-
-
-int readOifFile (
-    std::string &fileName,
-    struct oif_header *header,
-    unsigned char **imgData)
-{
-    std::ifstream rf (fileName, std::ios::in | std::ios::binary);
-
-    rf.read((char *) header, sizeof (*header));
-    if (header->magic != OIF_MAGIC) {
-        std::cout << "Error: Not a valid OIF file" << std::endl;
-        rf.close();
-        return -1;
-    }
-
-    *imgData = new unsigned char[header->img_size];
-    if (! *imgData) {
-        std::cout << "Error: Cannot allocate memory" << std::endl;
-        rf.close();
-        return -1;
-    }
-
-    rf.read((char *) *imgData, header->img_size);
-    rf.close();
-    return 0;
-}
+#include "oif_file.h"
 
 
 int main (
     int argc,
     char* argv[])
 {
-    struct oif_header header;
-    unsigned char *data;
+    struct oif_file file;
+    const struct oif_header *header;
+    const unsigned char *data;
     std::string oifFileName;
     std::string pngFileName;
+    unsigned int frame = 0;
     int ret;
 
     if (argc < 2) {
-        std::cout << "oif2png <OIF file name>" << std::endl;
+        std::cout << "oif2png <OIF file name> [<frame>]" << std::endl;
         return 1;
     }
 
     oifFileName = argv[1];
     pngFileName = oifFileName.substr (0, oifFileName.find_last_of ('.')) + ".png";
+    if (argc > 2) {
+        frame = atoi (argv[2]);
+    }
 
-    if (readOifFile (oifFileName, &header, &data)) {
+    if (oif_file_open (&file, oifFileName.c_str ())) {
+        std::cout << "Error: Not a valid OIF file" << std::endl;
+        return 1;
+    }
+    if (oif_file_frame (&file, frame, &header, &data)) {
+        std::cout << "Error: The file has " << file.num_frames << " frames" << std::endl;
+        oif_file_close (&file);
         return 1;
     }
 
-    cv::Mat img (header.height, header.width, CV_8UC4);
+    cv::Mat img (header->height, header->width, CV_8UC4, cv::Scalar (0, 0, 0, 0));
 
-    ret = oif_uncompress (&header, data, (unsigned char *) img.ptr<char>(0));
+    ret = oif_file_decode (&file, frame, (unsigned char *) img.ptr<char>(0), 0);
+    oif_file_close (&file);
     if (ret) {
         std::cout << "Error: Error while uncompressing image" << std::endl;
         return 1;
@@ -81,7 +67,5 @@ int main (
 
     cv::imwrite (pngFileName, img);
 
-    delete[] data;
     return 0;
 }
-
@@ -0,0 +1,628 @@
+/*
+ * Benchmark for the OIF compression and decompression with synthetic
+ * overlay images. No display and no OpenCV are needed.
+ *
+ * Copyright (C) 2023 by Frank Storm <frank.storm@storm-se.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "oif.h"
+
+
+#define FORMAT_TEXT 0
+#define FORMAT_CSV 1
+#define FORMAT_JSON 2
+
+/* Number of frames of the animated workloads */
+#define SPRITE_FRAMES 8
+
+
+typedef void (*generate_fn) (
+    unsigned int *img,
+    unsigned int width,
+    unsigned int height,
+    unsigned int frame);
+
+struct workload {
+    const char *name;
+    generate_fn generate;
+    unsigned int num_frames;
+};
+
+struct resolution {
+    unsigned int width;
+    unsigned int height;
+};
+
+struct result {
+    const char *workload;
+    const char *effort;
+    unsigned int width;
+    unsigned int height;
+    unsigned int num_frames;
+    double compr_size;
+    double codes;
+    double compress_time;
+    double uncompress_time;
+};
+
+
+/*
+ * Simple random numbers, so the images are the same on all systems.
+ */
+static unsigned int randomState = 1;
+
+static unsigned int
+nextRandom ()
+{
+    randomState = randomState * 1103515245 + 12345;
+    return randomState >> 8;
+}
+
+
+static void
+fillRect (
+    unsigned int *img,
+    unsigned int width,
+    unsigned int height,
+    int x,
+    int y,
+    int w,
+    int h,
+    unsigned int color)
+{
+    int i;
+    int j;
+
+    for (j = (y < 0) ? 0 : y; (j < y + h) && (j < (int) height); j++) {
+        for (i = (x < 0) ? 0 : x; (i < x + w) && (i < (int) width); i++) {
+            img[j * width + i] = color;
+        }
+    }
+}
+
+
+/*
+ * Sparse head-up display: a few bars, frames and a semi-transparent
+ * panel on a transparent background.
+ */
+static void
+generateHud (
+    unsigned int *img,
+    unsigned int width,
+    unsigned int height,
+    unsigned int frame)
+{
+    unsigned int i;
+
+    (void) frame;
+    memset (img, 0, width * height * sizeof (unsigned int));
+    fillRect (img, width, height, 0, 0, width, height / 20, 0xC0202020);
+    fillRect (img, width, height, width / 40, height - height / 6,
+              width / 4, height / 8, 0x80102040);
+    for (i = 0; i < 5; i++) {
+        fillRect (img, width, height, width / 32, height / 4 + i * height / 16,
+                  (width / 6) * (i + 1) / 5, height / 40, 0xFF20C020 + i * 0x00100000);
+    }
+    /* Crosshair */
+    fillRect (img, width, height, width / 2 - width / 20, height / 2, width / 10, 2, 0xFFFFFFFF);
+    fillRect (img, width, height, width / 2, height / 2 - width / 20, 2, width / 10, 0xFFFFFFFF);
+}
+
+
+/*
+ * Lines of text: glyphs with one pixel strokes in a dark panel.
+ */
+static void
+generateText (
+    unsigned int *img,
+    unsigned int width,
+    unsigned int height,
+    unsigned int frame)
+{
+    unsigned int x;
+    unsigned int y;
+    unsigned int i;
+    unsigned int glyph;
+
+    (void) frame;
+    memset (img, 0, width * height * sizeof (unsigned int));
+    fillRect (img, width, height, width / 16, height / 16,
+              width - width / 8, height - height / 8, 0xE0000000);
+    randomState = 1;
+    for (y = height / 16 + 8; y + 16 < height - height / 16; y += 20) {
+        for (x = width / 16 + 8; x + 10 < width - width / 16; x += 10) {
+            if ((nextRandom () % 7) == 0) {
+                /* Space */
+                continue;
+            }
+            glyph = nextRandom ();
+            for (i = 0; i < 4; i++) {
+                /* Vertical and horizontal strokes */
+                if (glyph & (1 << i)) {
+                    fillRect (img, width, height, x + (i & 1) * 6, y + (i >> 1) * 6,
+                              1, 7, 0xFFF0F0F0);
+                }
+                if (glyph & (16 << i)) {
+                    fillRect (img, width, height, x, y + i * 4, 7, 1, 0xFFF0F0F0);
+                }
+            }
+        }
+    }
+}
+
+
+/*
+ * Full screen diagonal gradient with an alpha ramp.
+ */
+static void
+generateGradient (
+    unsigned int *img,
+    unsigned int width,
+    unsigned int height,
+    unsigned int frame)
+{
+    unsigned int x;
+    unsigned int y;
+    unsigned int v;
+
+    (void) frame;
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            v = ((x + y) * 255) / (width + height);
+            img[y * width + x] = (((y * 255) / height) << 24) | (v << 16) | ((255 - v) << 8) | 0x40;
+        }
+    }
+}
+
+
+/*
+ * User interface panels with borders, a horizontal gradient and
+ * vertical separators, most rows repeat the row above.
+ */
+static void
+generatePanels (
+    unsigned int *img,
+    unsigned int width,
+    unsigned int height,
+    unsigned int frame)
+{
+    unsigned int x;
+    unsigned int y;
+    unsigned int i;
+    unsigned int panel_width = width / 3;
+
+    (void) frame;
+    memset (img, 0, width * height * sizeof (unsigned int));
+    for (i = 0; i < 3; i++) {
+        x = i * panel_width;
+        /* Border and background */
+        fillRect (img, width, height, x + 8, height / 8, panel_width - 16, height / 2, 0xFF808080);
+        fillRect (img, width, height, x + 10, height / 8 + 2, panel_width - 20, height / 2 - 4,
+                  0xD0203040);
+        /* Separators */
+        fillRect (img, width, height, x + panel_width / 3, height / 8 + 2, 1, height / 2 - 4,
+                  0xFF606060);
+        fillRect (img, width, height, x + 2 * panel_width / 3, height / 8 + 2, 1, height / 2 - 4,
+                  0xFF606060);
+    }
+    /* Title bar with a horizontal gradient */
+    for (y = height / 16; y < height / 8 - 4; y++) {
+        for (x = 8; x < width - 8; x++) {
+            img[y * width + x] = 0xFF000000 | ((x * 255 / width) << 16) | (0x80 << 8) |
+                (255 - x * 255 / width);
+        }
+    }
+}
+
+
+/*
+ * Full screen noise, the worst case for the encoder.
+ */
+static void
+generateNoise (
+    unsigned int *img,
+    unsigned int width,
+    unsigned int height,
+    unsigned int frame)
+{
+    unsigned int i;
+
+    randomState = frame + 1;
+    for (i = 0; i < width * height; i++) {
+        img[i] = (nextRandom () << 8) ^ nextRandom ();
+    }
+}
+
+
+/*
+ * Sprites moving over a transparent background.
+ */
+static void
+generateSprites (
+    unsigned int *img,
+    unsigned int width,
+    unsigned int height,
+    unsigned int frame)
+{
+    unsigned int i;
+    int size = height / 10;
+    int j;
+    int x;
+    int y;
+
+    memset (img, 0, width * height * sizeof (unsigned int));
+    for (i = 0; i < 8; i++) {
+        x = (int) ((i * width / 8 + frame * (4 + i) * 3) % width) - size / 2;
+        y = (int) ((i * height / 9 + frame * (8 - i) * 2) % height) - size / 2;
+        /* A sprite with a border and stripes */
+        fillRect (img, width, height, x, y, size, size, 0xFF000000 | (i * 0x00203040));
+        for (j = 2; j + 2 < size; j += 6) {
+            fillRect (img, width, height, x + 2, y + j, size - 4, 3, 0xFFFFC000 - i * 0x100);
+        }
+    }
+}
+
+
+static const struct workload workloads[] = {
+    { "hud", generateHud, 1 },
+    { "text", generateText, 1 },
+    { "panels", generatePanels, 1 },
+    { "gradient", generateGradient, 1 },
+    { "noise", generateNoise, 1 },
+    { "sprites", generateSprites, SPRITE_FRAMES },
+};
+
+static const struct resolution resolutions[] = {
+    { 640, 480 },
+    { 1920, 1080 },
+    { 3840, 2160 },
+};
+
+
+static double
+now ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/*
+ * Runs one workload at one resolution. Each measurement is repeated
+ * until min_time seconds have passed.
+ */
+static int
+runBenchmark (
+    const struct workload *load,
+    const struct resolution *res,
+    const struct oif_options *opts,
+    double min_time,
+    struct result *result)
+{
+    unsigned int size = res->width * res->height;
+    /* Room for the codes of incompressible images */
+    unsigned int compr_size = OIF_COMPRESS_BOUND (res->width, res->height);
+    unsigned int **frames;
+    unsigned char **compr;
+    struct oif_header *headers;
+    struct oif_stats stats;
+    unsigned int *img;
+    unsigned int i;
+    unsigned int n;
+    double start;
+    int ret = 0;
+
+    frames = (unsigned int **) calloc (load->num_frames, sizeof (unsigned int *));
+    compr = (unsigned char **) calloc (load->num_frames, sizeof (unsigned char *));
+    headers = (struct oif_header *) calloc (load->num_frames, sizeof (struct oif_header));
+    img = (unsigned int *) malloc (size * sizeof (unsigned int));
+    if ((frames == 0) || (compr == 0) || (headers == 0) || (img == 0)) {
+        ret = -1;
+    }
+
+    memset (result, 0, sizeof (*result));
+    result->workload = load->name;
+    result->width = res->width;
+    result->height = res->height;
+    result->num_frames = load->num_frames;
+
+    for (i = 0; (ret == 0) && (i < load->num_frames); i++) {
+        frames[i] = (unsigned int *) malloc (size * sizeof (unsigned int));
+        compr[i] = (unsigned char *) malloc (compr_size);
+        if ((frames[i] == 0) || (compr[i] == 0)) {
+            ret = -1;
+            break;
+        }
+        load->generate (frames[i], res->width, res->height, i);
+        oif_init_header (&headers[i], res->width, res->height);
+        oif_compress_ex (&headers[i], (unsigned char *) frames[i], compr[i], opts);
+        result->compr_size += headers[i].img_size;
+        if (oif_validate (&headers[i], compr[i], &stats) != 0) {
+            fprintf (stderr, "Error: %s %ux%u frame %u is not valid\n",
+                     load->name, res->width, res->height, i);
+            ret = -1;
+            break;
+        }
+        result->codes += stats.num_codes;
+
+        /* Check that the image is decoded correctly */
+        if ((oif_uncompress (&headers[i], compr[i], (unsigned char *) img) != 0) ||
+                (memcmp (img, frames[i], size * sizeof (unsigned int)) != 0)) {
+            fprintf (stderr, "Error: %s %ux%u frame %u is not decoded correctly\n",
+                     load->name, res->width, res->height, i);
+            ret = -1;
+        }
+    }
+
+    if (ret == 0) {
+        result->compr_size /= load->num_frames;
+        result->codes /= load->num_frames;
+
+        n = 0;
+        start = now ();
+        do {
+            oif_compress_ex (&headers[n % load->num_frames],
+                             (unsigned char *) frames[n % load->num_frames],
+                             compr[n % load->num_frames], opts);
+            n++;
+        } while ((n < load->num_frames) || (now () - start < min_time));
+        result->compress_time = (now () - start) / n;
+
+        n = 0;
+        start = now ();
+        do {
+            oif_uncompress (&headers[n % load->num_frames], compr[n % load->num_frames],
+                            (unsigned char *) img);
+            n++;
+        } while ((n < load->num_frames) || (now () - start < min_time));
+        result->uncompress_time = (now () - start) / n;
+    }
+
+    for (i = 0; frames && compr && (i < load->num_frames); i++) {
+        free (frames[i]);
+        free (compr[i]);
+    }
+    free (frames);
+    free (compr);
+    free (headers);
+    free (img);
+    return ret;
+}
+
+
+static void
+printResult (
+    FILE *out,
+    int format,
+    const struct result *result,
+    int first)
+{
+    double bytes = (double) result->width * result->height * sizeof (unsigned int);
+
+    switch (format) {
+    case FORMAT_TEXT:
+        if (first) {
+            fprintf (out, "%-10s %10s %7s %8s %10s %12s %9s %12s %9s\n",
+                     "workload", "resolution", "ratio", "codes", "size",
+                     "compr MB/s", "fps", "uncompr MB/s", "fps");
+        }
+        fprintf (out, "%-10s %5ux%-4u %7.2f %8.0f %10.0f %12.1f %9.1f %12.1f %9.1f\n",
+                 result->workload, result->width, result->height,
+                 bytes / result->compr_size, result->codes, result->compr_size,
+                 bytes / result->compress_time / 1e6, 1.0 / result->compress_time,
+                 bytes / result->uncompress_time / 1e6, 1.0 / result->uncompress_time);
+        break;
+    case FORMAT_CSV:
+        if (first) {
+            fprintf (out, "workload,effort,width,height,frames,compressed_bytes,ratio,codes_per_frame,"
+                     "compress_mb_s,compress_fps,uncompress_mb_s,uncompress_fps\n");
+        }
+        fprintf (out, "%s,%s,%u,%u,%u,%.0f,%.4f,%.1f,%.1f,%.2f,%.1f,%.2f\n",
+                 result->workload, result->effort, result->width, result->height, result->num_frames,
+                 result->compr_size, bytes / result->compr_size, result->codes,
+                 bytes / result->compress_time / 1e6, 1.0 / result->compress_time,
+                 bytes / result->uncompress_time / 1e6, 1.0 / result->uncompress_time);
+        break;
+    case FORMAT_JSON:
+        fprintf (out, "%s  {\"workload\": \"%s\", \"effort\": \"%s\", \"width\": %u, \"height\": %u, "
+                 "\"frames\": %u, \"compressed_bytes\": %.0f, \"ratio\": %.4f, "
+                 "\"codes_per_frame\": %.1f, \"compress_mb_s\": %.1f, \"compress_fps\": %.2f, "
+                 "\"uncompress_mb_s\": %.1f, \"uncompress_fps\": %.2f}",
+                 first ? "[\n" : ",\n",
+                 result->workload, result->effort, result->width, result->height, result->num_frames,
+                 result->compr_size, bytes / result->compr_size, result->codes,
+                 bytes / result->compress_time / 1e6, 1.0 / result->compress_time,
+                 bytes / result->uncompress_time / 1e6, 1.0 / result->uncompress_time);
+        break;
+    }
+    fflush (out);
+}
+
+
+static void
+usage ()
+{
+    unsigned int i;
+
+    printf ("Usage: oif_bench [-h] [-f text|csv|json] [-o <file>] [-t <seconds>]\n");
+    printf ("                 [-w <workload>] [-r <width>x<height>]\n");
+    printf ("                 [-k auto|scalar|portable|sse2|avx2] [-e greedy|max] [-u]\n");
+    printf ("\n");
+    printf ("Arguments:\n");
+    printf ("    -h                    Display this text\n");
+    printf ("    -f text|csv|json      Output format, default is text\n");
+    printf ("    -o <file>             Write the results to a file instead of stdout\n");
+    printf ("    -t <seconds>          Minimum time of each measurement, default 0.5\n");
+    printf ("    -w <workload>         Run only this workload, may be repeated\n");
+    printf ("    -r <width>x<height>   Run only this resolution\n");
+    printf ("    -k <kernels>          Kernels used by the encoder and decoder\n");
+    printf ("    -e <effort>           Effort of the encoder, default is greedy\n");
+    printf ("    -u                    Encode repeated rows with UP codes\n");
+    printf ("\n");
+    printf ("Compresses and decompresses synthetic overlay images and reports the\n");
+    printf ("compression ratio, the codes per frame and the speed in MB/s and frames/s.\n");
+    printf ("The workloads are:");
+    for (i = 0; i < sizeof (workloads) / sizeof (workloads[0]); i++) {
+        printf (" %s", workloads[i].name);
+    }
+    printf ("\n");
+}
+
+
+int
+main (
+    int argc,
+    char *argv[])
+{
+    static const char *kernels[] = { "auto", "scalar", "portable", "sse2", "avx2" };
+    /* In the order of the OIF_EFFORT_... values */
+    static const char *efforts[] = { "greedy", "max" };
+    const unsigned int num_workloads = sizeof (workloads) / sizeof (workloads[0]);
+    const unsigned int num_resolutions = sizeof (resolutions) / sizeof (resolutions[0]);
+    int selected[sizeof (workloads) / sizeof (workloads[0])];
+    int any_selected = 0;
+    struct resolution res;
+    int res_selected = 0;
+    struct result result;
+    const char *out_name = 0;
+    FILE *out = stdout;
+    int format = FORMAT_TEXT;
+    double min_time = 0.5;
+    int kernel = OIF_KERNEL_AUTO;
+    struct oif_options opts;
+    int first = 1;
+    unsigned int i;
+    unsigned int j;
+    int k;
+
+    memset (selected, 0, sizeof (selected));
+    oif_init_options (&opts);
+    for (k = 1; k < argc; k++) {
+        if ((strcmp (argv[k], "-h") == 0) || (strcmp (argv[k], "--help") == 0)) {
+            usage ();
+            return 0;
+        } else if ((k + 1 < argc) && (strcmp (argv[k], "-f") == 0)) {
+            k++;
+            if (strcmp (argv[k], "text") == 0) {
+                format = FORMAT_TEXT;
+            } else if (strcmp (argv[k], "csv") == 0) {
+                format = FORMAT_CSV;
+            } else if (strcmp (argv[k], "json") == 0) {
+                format = FORMAT_JSON;
+            } else {
+                fprintf (stderr, "Error: Unknown format %s\n", argv[k]);
+                return 1;
+            }
+        } else if ((k + 1 < argc) && (strcmp (argv[k], "-o") == 0)) {
+            out_name = argv[++k];
+        } else if ((k + 1 < argc) && (strcmp (argv[k], "-t") == 0)) {
+            min_time = atof (argv[++k]);
+        } else if ((k + 1 < argc) && (strcmp (argv[k], "-w") == 0)) {
+            k++;
+            for (i = 0; i < num_workloads; i++) {
+                if (strcmp (argv[k], workloads[i].name) == 0) {
+                    selected[i] = 1;
+                    any_selected = 1;
+                    break;
+                }
+            }
+            if (i == num_workloads) {
+                fprintf (stderr, "Error: Unknown workload %s\n", argv[k]);
+                return 1;
+            }
+        } else if ((k + 1 < argc) && (strcmp (argv[k], "-r") == 0)) {
+            k++;
+            if ((sscanf (argv[k], "%ux%u", &res.width, &res.height) != 2) ||
+                    (res.width == 0) || (res.height == 0)) {
+                fprintf (stderr, "Error: Invalid resolution %s\n", argv[k]);
+                return 1;
+            }
+            res_selected = 1;
+        } else if ((k + 1 < argc) && (strcmp (argv[k], "-k") == 0)) {
+            k++;
+            for (kernel = 0; kernel < (int) (sizeof (kernels) / sizeof (kernels[0])); kernel++) {
+                if (strcmp (argv[k], kernels[kernel]) == 0) {
+                    break;
+                }
+            }
+            if (kernel == (int) (sizeof (kernels) / sizeof (kernels[0]))) {
+                fprintf (stderr, "Error: Unknown kernels %s\n", argv[k]);
+                return 1;
+            }
+        } else if ((k + 1 < argc) && (strcmp (argv[k], "-e") == 0)) {
+            k++;
+            for (opts.effort = 0; opts.effort < (int) (sizeof (efforts) / sizeof (efforts[0]));
+                    opts.effort++) {
+                if (strcmp (argv[k], efforts[opts.effort]) == 0) {
+                    break;
+                }
+            }
+            if (opts.effort == (int) (sizeof (efforts) / sizeof (efforts[0]))) {
+                fprintf (stderr, "Error: Unknown effort %s\n", argv[k]);
+                return 1;
+            }
+        } else if (strcmp (argv[k], "-u") == 0) {
+            opts.flags |= OIF_OPT_UP;
+        } else {
+            usage ();
+            return 1;
+        }
+    }
+
+    kernel = oif_select_kernels (kernel);
+    fprintf (stderr, "Using %s kernels, %s encoder\n", kernels[kernel], efforts[opts.effort]);
+
+    if (out_name) {
+        out = fopen (out_name, "w");
+        if (out == 0) {
+            perror ("Error: Cannot open output file");
+            return 1;
+        }
+    }
+
+    for (i = 0; i < num_workloads; i++) {
+        if (any_selected && !selected[i]) {
+            continue;
+        }
+        for (j = 0; j < (res_selected ? 1 : num_resolutions); j++) {
+            if (runBenchmark (&workloads[i], res_selected ? &res : &resolutions[j],
+                              &opts, min_time, &result) != 0) {
+                fprintf (stderr, "Error: %s failed\n", workloads[i].name);
+                return 1;
+            }
+            result.effort = efforts[opts.effort];
+            printResult (out, format, &result, first);
+            first = 0;
+        }
+    }
+    if ((format == FORMAT_JSON) && !first) {
+        fprintf (out, "\n]\n");
+    } else if (format == FORMAT_JSON) {
+        fprintf (out, "[]\n");
+    }
+
+    if (out != stdout) {
+        fclose (out);
+    }
+    return 0;
+}
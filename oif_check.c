@@ -0,0 +1,1126 @@
+/*
+ * Tests of the OIF library, run with "make check". Random images are
+ * compressed by every encoder and decoded by every decoder, and corrupted
+ * images must be rejected by oif_validate exactly like by oif_uncompress.
+ * No display and no OpenCV are needed.
+ *
+ * Copyright (C) 2023 by Frank Storm <frank.storm@storm-se.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "oif.h"
+#include "oif_compose.h"
+#include "oif_file.h"
+#include "oif_send.h"
+
+
+/* Encoders of compress_image */
+#define ENC_COMPRESS 0
+#define ENC_DELTA 1
+#define ENC_INCREMENTAL 2
+#define ENC_PARALLEL 3
+#define ENC_SKIP 4
+#define ENC_PALETTE 5
+#define ENC_RECT 6
+#define ENC_MAX 7
+#define ENC_UP 8
+#define ENC_MOTION 9
+#define NUM_ENCODERS 10
+
+/* Written after the decoded image to detect overruns */
+#define GUARD 0xDEADBEEF
+
+#define CHECK(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            printf ("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf (__VA_ARGS__); \
+            printf ("\n"); \
+            failures++; \
+            return; \
+        } \
+    } while (0)
+
+
+static int failures = 0;
+
+static unsigned int rand_state = 1;
+
+
+/*
+ * Random numbers that are the same on all systems, so a failure can
+ * be reproduced.
+ */
+static unsigned int
+next_rand (void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+
+/*
+ * An image like an overlay: runs of a few colors, repeated rows and
+ * some noise.
+ */
+static void
+random_image (
+    unsigned int *img,
+    unsigned int width,
+    unsigned int height,
+    unsigned int num_colors)
+{
+    unsigned int value = 0;
+    unsigned int x;
+    unsigned int y;
+    int noise;
+
+    for (y = 0; y < height; y++) {
+        if ((y > 0) && (next_rand () % 3 == 0)) {
+            memcpy (img + y * width, img + (y - 1) * width, width * sizeof (unsigned int));
+            continue;
+        }
+        noise = (next_rand () % 4 == 0);
+        for (x = 0; x < width; x++) {
+            if (noise || (next_rand () % 4 == 0)) {
+                value = (next_rand () % num_colors) * 0x3F5A7B11;
+            }
+            img[x + y * width] = value;
+        }
+    }
+}
+
+
+/*
+ * Applies a move to img like the COPY code of the decoder.
+ */
+static void
+apply_move (
+    unsigned int *img,
+    unsigned int width,
+    const struct oif_motion *move)
+{
+    unsigned int *src;
+    unsigned int row;
+
+    src = (unsigned int *) malloc (move->width * move->height * sizeof (unsigned int) + 4);
+    for (row = 0; row < move->height; row++) {
+        memcpy (src + row * move->width, img + (move->y + row) * width + move->x,
+                move->width * sizeof (unsigned int));
+    }
+    for (row = 0; row < move->height; row++) {
+        memcpy (img + (move->y + move->dy + row) * width + move->x + move->dx,
+                src + row * move->width, move->width * sizeof (unsigned int));
+    }
+    free (src);
+}
+
+
+/*
+ * Encodes img with the incremental encoder, pushing a random number of
+ * rows at a time and draining into small chunks of random size.
+ */
+static void
+encode_incremental (
+    struct oif_header *header,
+    const unsigned int *img,
+    unsigned char *compr_data)
+{
+    struct oif_encoder enc;
+    unsigned int size = 0;
+    unsigned int y = 0;
+    unsigned int rows;
+    int ret;
+
+    oif_encoder_begin (&enc, header);
+    while (y < header->height) {
+        rows = 1 + next_rand () % 8;
+        if (rows > header->height - y) {
+            rows = header->height - y;
+        }
+        oif_encoder_push_rows (&enc, (const unsigned char *) (img + y * header->width), rows);
+        while ((ret = oif_encoder_drain (&enc, compr_data + size, 4 + next_rand () % 61)) > 0) {
+            size += ret;
+        }
+        y += rows;
+    }
+    oif_encoder_finish (&enc);
+    while ((ret = oif_encoder_drain (&enc, compr_data + size, 4 + next_rand () % 61)) > 0) {
+        size += ret;
+    }
+}
+
+
+/*
+ * Compresses img with the given encoder. expected is set to the image
+ * the decoder has after decoding the result into prev.
+ * Returns the result of the encoder.
+ */
+static int
+compress_image (
+    int encoder,
+    struct oif_header *header,
+    const unsigned int *prev,
+    unsigned int *img,
+    unsigned int *expected,
+    unsigned char *compr_data)
+{
+    unsigned int width = header->width;
+    unsigned int height = header->height;
+    unsigned int size = width * height * sizeof (unsigned int);
+    struct oif_options opts;
+    struct oif_motion moves[3];
+    unsigned int num_moves;
+    unsigned int rect_width;
+    unsigned int rect_height;
+    unsigned int x;
+    unsigned int y;
+    unsigned int i;
+    int ret = 0;
+
+    oif_init_header (header, width, height);
+    oif_init_options (&opts);
+    memcpy (expected, img, size);
+
+    switch (encoder) {
+    case ENC_COMPRESS:
+        oif_compress (header, (unsigned char *) img, compr_data);
+        break;
+    case ENC_DELTA:
+        ret = oif_compress_delta (header, (unsigned char *) prev, (unsigned char *) img,
+                                  compr_data);
+        break;
+    case ENC_INCREMENTAL:
+        encode_incremental (header, img, compr_data);
+        break;
+    case ENC_PARALLEL:
+        ret = oif_compress_parallel (header, (unsigned char *) img, compr_data,
+                                     1 + next_rand () % 4);
+        break;
+    case ENC_SKIP:
+        /* The skipped pixels keep the value of the cleared destination */
+        opts.flags = OIF_OPT_SKIP;
+        opts.skip_value = 0;
+        oif_compress_ex (header, (unsigned char *) img, compr_data, &opts);
+        break;
+    case ENC_PALETTE:
+        opts.flags = OIF_OPT_PALETTE;
+        oif_compress_ex (header, (unsigned char *) img, compr_data, &opts);
+        break;
+    case ENC_RECT:
+        /* Full lines are encoded like oif_compress_delta, others with POS codes */
+        x = (next_rand () % 2) ? 0 : next_rand () % width;
+        y = next_rand () % height;
+        rect_width = (x == 0) ? width : 1 + next_rand () % (width - x);
+        rect_height = 1 + next_rand () % (height - y);
+        memcpy (expected, prev, size);
+        for (i = y; i < y + rect_height; i++) {
+            memcpy (expected + i * width + x, img + i * width + x,
+                    rect_width * sizeof (unsigned int));
+        }
+        ret = oif_compress_rect (header, (unsigned char *) img, compr_data, x, y,
+                                 rect_width, rect_height);
+        break;
+    case ENC_MAX:
+        opts.effort = OIF_EFFORT_MAX;
+        oif_compress_ex (header, (unsigned char *) img, compr_data, &opts);
+        break;
+    case ENC_UP:
+        opts.flags = OIF_OPT_UP | ((next_rand () % 2) ? OIF_OPT_PALETTE : 0);
+        opts.effort = (next_rand () % 2) ? OIF_EFFORT_MAX : OIF_EFFORT_GREEDY;
+        oif_compress_ex (header, (unsigned char *) img, compr_data, &opts);
+        break;
+    case ENC_MOTION:
+        /* img becomes prev with up to three moves and a few changes */
+        memcpy (img, prev, size);
+        num_moves = next_rand () % 4;
+        for (i = 0; i < num_moves; i++) {
+            moves[i].width = next_rand () % (width + 1);
+            moves[i].height = next_rand () % (height + 1);
+            moves[i].x = next_rand () % (width - moves[i].width + 1);
+            moves[i].y = next_rand () % (height - moves[i].height + 1);
+            moves[i].dx = (int) (next_rand () % (width - moves[i].width + 1)) - (int) moves[i].x;
+            moves[i].dy = (int) (next_rand () % (height - moves[i].height + 1)) - (int) moves[i].y;
+            apply_move (img, width, &moves[i]);
+        }
+        for (i = next_rand () % 4; i > 0; i--) {
+            img[next_rand () % (width * height)] = next_rand ();
+        }
+        memcpy (expected, img, size);
+        ret = oif_compress_motion (header, (unsigned char *) prev, (unsigned char *) img,
+                                   compr_data, moves, num_moves);
+        break;
+    }
+    return ret;
+}
+
+
+/*
+ * Decodes the compressed image with the incremental decoder, fed in
+ * pieces of random size from an address that need not be aligned.
+ */
+static int
+decode_incremental (
+    struct oif_header *header,
+    const unsigned char *compr_data,
+    unsigned char *img_data,
+    int format,
+    unsigned int stride)
+{
+    struct oif_decoder dec;
+    unsigned int offset = next_rand () % 4;
+    unsigned char *data = (unsigned char *) malloc (header->img_size + offset);
+    unsigned int pos = 0;
+    unsigned int consumed;
+    unsigned int size;
+    int ret = 0;
+
+    memcpy (data + offset, compr_data, header->img_size);
+    oif_decoder_begin (&dec, header, img_data, (next_rand () % 2) ? OIF_FLAG_NONTEMPORAL : 0);
+    if ((format != OIF_FORMAT_BGRA) || (stride != 0)) {
+        ret = oif_decoder_set_format (&dec, format, stride);
+    }
+    while ((pos < header->img_size) && (ret == 0)) {
+        size = 1 + next_rand () % 64;
+        if (size > header->img_size - pos) {
+            size = header->img_size - pos;
+        }
+        ret = oif_decoder_feed (&dec, data + offset + pos, size, &consumed);
+        pos += consumed;
+    }
+    free (data);
+    return ret;
+}
+
+
+/*
+ * All encoders and decoders must reproduce the image.
+ */
+static void
+check_roundtrip (
+    int encoder,
+    unsigned int width,
+    unsigned int height)
+{
+    unsigned int num_pixels = width * height;
+    unsigned int size = num_pixels * sizeof (unsigned int);
+    unsigned int *prev = (unsigned int *) malloc (size);
+    unsigned int *img = (unsigned int *) malloc (size);
+    unsigned int *expected = (unsigned int *) malloc (size);
+    unsigned int *decoded = (unsigned int *) malloc (size + sizeof (unsigned int));
+    unsigned char *compr_data = (unsigned char *) malloc (OIF_COMPRESS_BOUND (width, height) + 64);
+    struct oif_header header;
+    struct oif_stats stats;
+    unsigned int first_line;
+    unsigned int num_lines;
+    int ret;
+
+    random_image (prev, width, height, 1 + next_rand () % 8);
+    random_image (img, width, height, 1 + next_rand () % 8);
+    if (encoder == ENC_SKIP) {
+        memset (prev, 0, size);
+    }
+    header.width = width;
+    header.height = height;
+    ret = compress_image (encoder, &header, prev, img, expected, compr_data);
+    decoded[num_pixels] = GUARD;
+
+    do {
+        CHECK (ret >= 0, "encoder %d %ux%u returned %d", encoder, width, height, ret);
+        CHECK (header.img_size <= OIF_COMPRESS_BOUND (width, height),
+               "encoder %d %ux%u size %u above the bound", encoder, width, height,
+               header.img_size);
+        CHECK (oif_validate (&header, compr_data, &stats) == 0,
+               "encoder %d %ux%u not valid", encoder, width, height);
+        CHECK (stats.version == header.version, "encoder %d %ux%u version %u, header %u",
+               encoder, width, height, stats.version, header.version);
+        CHECK ((encoder == ENC_UP) || (stats.codes[OIF_UP_TYPE >> 28] == 0),
+               "encoder %d wrote UP codes without OIF_OPT_UP", encoder);
+        CHECK (!(header.reserved[OIF_RES_FLAGS] & OIF_RES_FLAG_KEY) ||
+               (stats.codes[OIF_SKIP_TYPE >> 28] == 0),
+               "encoder %d marked an image with SKIP codes as key image", encoder);
+
+        memcpy (decoded, prev, size);
+        ret = oif_uncompress (&header, compr_data, (unsigned char *) decoded);
+        CHECK ((ret == 0) && (memcmp (decoded, expected, size) == 0),
+               "encoder %d %ux%u: oif_uncompress %d", encoder, width, height, ret);
+
+        memcpy (decoded, prev, size);
+        oif_uncompress_trusted (&header, compr_data, (unsigned char *) decoded, 0);
+        CHECK (memcmp (decoded, expected, size) == 0,
+               "encoder %d %ux%u: oif_uncompress_trusted", encoder, width, height);
+
+        memcpy (decoded, prev, size);
+        ret = oif_uncompress_ex (&header, compr_data, (unsigned char *) decoded,
+                                 OIF_FLAG_NONTEMPORAL);
+        CHECK ((ret == 0) && (memcmp (decoded, expected, size) == 0),
+               "encoder %d %ux%u: oif_uncompress_ex non-temporal %d", encoder, width, height,
+               ret);
+
+        memcpy (decoded, prev, size);
+        ret = oif_uncompress_parallel (&header, compr_data, (unsigned char *) decoded,
+                                       1 + next_rand () % 4, 0);
+        CHECK ((ret == 0) && (memcmp (decoded, expected, size) == 0),
+               "encoder %d %ux%u: oif_uncompress_parallel %d", encoder, width, height, ret);
+
+        /* Only the requested lines are compared */
+        first_line = next_rand () % height;
+        num_lines = 1 + next_rand () % (height - first_line);
+        memcpy (decoded, prev, size);
+        ret = oif_uncompress_lines (&header, compr_data, (unsigned char *) decoded,
+                                    first_line, num_lines, 0);
+        CHECK ((ret == 0) && (memcmp (decoded + first_line * width, expected + first_line * width,
+                                      num_lines * width * sizeof (unsigned int)) == 0),
+               "encoder %d %ux%u: oif_uncompress_lines %u %u: %d", encoder, width, height,
+               first_line, num_lines, ret);
+
+        memcpy (decoded, prev, size);
+        ret = decode_incremental (&header, compr_data, (unsigned char *) decoded,
+                                  OIF_FORMAT_BGRA, 0);
+        CHECK ((ret == 1) && (memcmp (decoded, expected, size) == 0),
+               "encoder %d %ux%u: incremental decoder %d", encoder, width, height, ret);
+        CHECK (decoded[num_pixels] == GUARD, "encoder %d %ux%u: overrun", encoder,
+               width, height);
+    } while (0);
+
+    free (prev);
+    free (img);
+    free (expected);
+    free (decoded);
+    free (compr_data);
+}
+
+
+/*
+ * All kernels must give the same compressed image.
+ */
+static void
+check_kernels (
+    unsigned int width,
+    unsigned int height)
+{
+    static const int kernels[] = {
+        OIF_KERNEL_SCALAR, OIF_KERNEL_PORTABLE, OIF_KERNEL_SSE2, OIF_KERNEL_AVX2
+    };
+    unsigned int size = width * height * sizeof (unsigned int);
+    unsigned int *img = (unsigned int *) malloc (size);
+    unsigned char *reference = (unsigned char *) malloc (OIF_COMPRESS_BOUND (width, height));
+    unsigned char *compr_data = (unsigned char *) malloc (OIF_COMPRESS_BOUND (width, height));
+    struct oif_header reference_header;
+    struct oif_header header;
+    unsigned int i;
+    int selected = OIF_KERNEL_SCALAR;
+
+    random_image (img, width, height, 1 + next_rand () % 4);
+    oif_select_kernels (OIF_KERNEL_SCALAR);
+    oif_init_header (&reference_header, width, height);
+    oif_compress (&reference_header, (unsigned char *) img, reference);
+
+    for (i = 1; i < sizeof (kernels) / sizeof (kernels[0]); i++) {
+        selected = oif_select_kernels (kernels[i]);
+        oif_init_header (&header, width, height);
+        oif_compress (&header, (unsigned char *) img, compr_data);
+        if ((header.img_size != reference_header.img_size) ||
+                (memcmp (compr_data, reference, header.img_size) != 0)) {
+            break;
+        }
+    }
+    oif_select_kernels (OIF_KERNEL_AUTO);
+    free (img);
+    free (reference);
+    free (compr_data);
+
+    CHECK (i == sizeof (kernels) / sizeof (kernels[0]),
+           "kernels %d %ux%u differ from the scalar kernels", selected, width, height);
+}
+
+
+/*
+ * More than OIF_EXT_MAX_COUNT pixels of repeated rows must be split
+ * into several UP codes.
+ */
+static void
+check_up_tall (
+    unsigned int width,
+    unsigned int height)
+{
+    unsigned int num_pixels = width * height;
+    unsigned int size = num_pixels * sizeof (unsigned int);
+    unsigned int *img = (unsigned int *) malloc (size);
+    unsigned int *decoded = (unsigned int *) malloc (size);
+    unsigned char *compr_data = (unsigned char *) malloc (OIF_COMPRESS_BOUND (width, height));
+    struct oif_header header;
+    struct oif_options opts;
+    struct oif_stats stats;
+    unsigned int y;
+    int ret;
+
+    random_image (img, width, 1, 8);
+    img[0] = ~img[1];
+    for (y = 1; y < height; y++) {
+        memcpy (img + y * width, img, width * sizeof (unsigned int));
+    }
+    oif_init_header (&header, width, height);
+    oif_init_options (&opts);
+    opts.flags = OIF_OPT_UP;
+    oif_compress_ex (&header, (unsigned char *) img, compr_data, &opts);
+
+    do {
+        CHECK (oif_validate (&header, compr_data, &stats) == 0, "UP %ux%u not valid",
+               width, height);
+        CHECK (stats.codes[OIF_EXT_TYPE >> 28] > 1, "UP %ux%u not split into EXT codes",
+               width, height);
+        memset (decoded, 0, size);
+        ret = oif_uncompress (&header, compr_data, (unsigned char *) decoded);
+        CHECK ((ret == 0) && (memcmp (decoded, img, size) == 0), "UP %ux%u: oif_uncompress %d",
+               width, height, ret);
+    } while (0);
+
+    free (img);
+    free (decoded);
+    free (compr_data);
+}
+
+
+/*
+ * oif_validate must return the same result as oif_uncompress for
+ * corrupted images, and neither may write outside the image.
+ */
+static void
+check_validate (
+    int encoder,
+    unsigned int width,
+    unsigned int height)
+{
+    unsigned int num_pixels = width * height;
+    unsigned int size = num_pixels * sizeof (unsigned int);
+    unsigned int *prev = (unsigned int *) malloc (size);
+    unsigned int *img = (unsigned int *) malloc (size);
+    unsigned int *expected = (unsigned int *) malloc (size);
+    unsigned int *decoded = (unsigned int *) malloc (size + sizeof (unsigned int));
+    unsigned int *trusted = (unsigned int *) malloc (size + sizeof (unsigned int));
+    unsigned char *compr_data = (unsigned char *) malloc (OIF_COMPRESS_BOUND (width, height) + 64);
+    struct oif_header header;
+    unsigned int num_words;
+    unsigned int *word;
+    unsigned int n;
+    int valid;
+    int ret;
+
+    random_image (prev, width, height, 4);
+    random_image (img, width, height, 4);
+    header.width = width;
+    header.height = height;
+    compress_image (encoder, &header, prev, img, expected, compr_data);
+
+    do {
+        num_words = header.img_size / sizeof (unsigned int);
+        for (n = 1 + next_rand () % 4; n > 0; n--) {
+            word = (unsigned int *) compr_data + next_rand () % num_words;
+            switch (next_rand () % 4) {
+            case 0:
+                *word ^= 1U << (next_rand () % 32);
+                break;
+            case 1:
+                /* Another code type */
+                *word = (*word & 0x0FFFFFFF) | ((next_rand () % 16) << 28);
+                break;
+            case 2:
+                *word = next_rand () * 7919;
+                break;
+            default:
+                header.img_size = (next_rand () % (num_words + 1)) * sizeof (unsigned int) +
+                    next_rand () % 4;
+                break;
+            }
+        }
+
+        valid = oif_validate (&header, compr_data, 0);
+        memset (decoded, 0, size);
+        decoded[num_pixels] = GUARD;
+        ret = oif_uncompress (&header, compr_data, (unsigned char *) decoded);
+        CHECK (valid == ret, "encoder %d %ux%u: oif_validate %d, oif_uncompress %d",
+               encoder, width, height, valid, ret);
+        CHECK (decoded[num_pixels] == GUARD, "encoder %d %ux%u: overrun of a corrupted image",
+               encoder, width, height);
+        if (valid == 0) {
+            memset (trusted, 0, size);
+            trusted[num_pixels] = GUARD;
+            oif_uncompress_trusted (&header, compr_data, (unsigned char *) trusted, 0);
+            CHECK (memcmp (decoded, trusted, size + sizeof (unsigned int)) == 0,
+                   "encoder %d %ux%u: oif_uncompress_trusted differs", encoder, width, height);
+        }
+    } while (0);
+
+    free (prev);
+    free (img);
+    free (expected);
+    free (decoded);
+    free (trusted);
+    free (compr_data);
+}
+
+
+/*
+ * Converts an image into a pixel format, the reference for
+ * oif_uncompress_format.
+ */
+static void
+convert_image (
+    const unsigned int *img,
+    unsigned int width,
+    unsigned int height,
+    int format,
+    unsigned int stride,
+    unsigned char *dst)
+{
+    static const unsigned int bpp[] = { 4, 4, 3, 2 };
+    unsigned int pixel;
+    unsigned int value;
+    unsigned char *d;
+    unsigned int x;
+    unsigned int y;
+
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            pixel = img[y * width + x];
+            d = dst + y * stride + x * bpp[format];
+            switch (format) {
+            case OIF_FORMAT_BGRA:
+                d[0] = pixel;
+                d[1] = pixel >> 8;
+                d[2] = pixel >> 16;
+                d[3] = pixel >> 24;
+                break;
+            case OIF_FORMAT_ARGB:
+                d[0] = pixel >> 24;
+                d[1] = pixel >> 16;
+                d[2] = pixel >> 8;
+                d[3] = pixel;
+                break;
+            case OIF_FORMAT_RGB888:
+                d[0] = pixel;
+                d[1] = pixel >> 8;
+                d[2] = pixel >> 16;
+                break;
+            default:
+                value = (((pixel >> 19) & 0x1F) << 11) | (((pixel >> 10) & 0x3F) << 5) |
+                    ((pixel >> 3) & 0x1F);
+                d[0] = value;
+                d[1] = value >> 8;
+                break;
+            }
+        }
+    }
+}
+
+
+/*
+ * oif_uncompress_format and the incremental decoder with
+ * oif_decoder_set_format must give the converted image.
+ */
+static void
+check_format (
+    int encoder,
+    unsigned int width,
+    unsigned int height)
+{
+    static const unsigned int bpp[] = { 4, 4, 3, 2 };
+    unsigned int size = width * height * sizeof (unsigned int);
+    unsigned int *prev = (unsigned int *) malloc (size);
+    unsigned int *img = (unsigned int *) malloc (size);
+    unsigned int *expected = (unsigned int *) malloc (size);
+    unsigned char *compr_data = (unsigned char *) malloc (OIF_COMPRESS_BOUND (width, height) + 64);
+    int format = next_rand () % 4;
+    unsigned int stride = (next_rand () % 2) ? 0 : width * bpp[format] + next_rand () % 9;
+    unsigned int line_size = stride ? stride : width * bpp[format];
+    unsigned char *start = (unsigned char *) malloc (line_size * height);
+    unsigned char *reference = (unsigned char *) malloc (line_size * height);
+    unsigned char *decoded = (unsigned char *) malloc (line_size * height);
+    struct oif_header header;
+    int ret;
+
+    random_image (prev, width, height, 1 + next_rand () % 8);
+    random_image (img, width, height, 1 + next_rand () % 8);
+    if (encoder == ENC_SKIP) {
+        memset (prev, 0, size);
+    }
+    header.width = width;
+    header.height = height;
+    compress_image (encoder, &header, prev, img, expected, compr_data);
+
+    /* The padding at the end of the lines must not be written */
+    memset (start, 0xCD, line_size * height);
+    convert_image (prev, width, height, format, line_size, start);
+    memcpy (reference, start, line_size * height);
+    convert_image (expected, width, height, format, line_size, reference);
+
+    do {
+        memcpy (decoded, start, line_size * height);
+        ret = oif_uncompress_format (&header, compr_data, decoded, format, stride);
+        CHECK ((ret == 0) && (memcmp (decoded, reference, line_size * height) == 0),
+               "encoder %d %ux%u: oif_uncompress_format %d stride %u: %d",
+               encoder, width, height, format, stride, ret);
+
+        memcpy (decoded, start, line_size * height);
+        ret = decode_incremental (&header, compr_data, decoded, format, stride);
+        CHECK ((ret == 1) && (memcmp (decoded, reference, line_size * height) == 0),
+               "encoder %d %ux%u: incremental decoder format %d stride %u: %d",
+               encoder, width, height, format, stride, ret);
+
+        CHECK (oif_uncompress_format (&header, compr_data, decoded, 7, 0) == OIF_ERR_RANGE,
+               "unknown format accepted");
+        CHECK (oif_uncompress_format (&header, compr_data, decoded, format,
+                                      width * bpp[format] - 1) == OIF_ERR_RANGE,
+               "stride %u accepted for format %d", width * bpp[format] - 1, format);
+    } while (0);
+
+    free (prev);
+    free (img);
+    free (expected);
+    free (compr_data);
+    free (start);
+    free (reference);
+    free (decoded);
+}
+
+
+/*
+ * Frames sent by oif_sender over a socketpair.
+ */
+#define SEND_FRAMES 200
+#define SEND_BUFFERS 4
+#define SEND_BUFFER_SIZE 300000
+
+struct receiver {
+    int fd;
+    unsigned int sizes[SEND_FRAMES];
+    const char *error;
+};
+
+
+static int
+read_all (
+    int fd,
+    void *data,
+    unsigned int size)
+{
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = read (fd, data, size);
+        if (ret <= 0) {
+            return -1;
+        }
+        data = (char *) data + ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+
+/*
+ * Reads the frames and checks id, size and data, the data of frame n
+ * is byte i = n * 7 + i.
+ */
+static void *
+receive_frames (
+    void *arg)
+{
+    struct receiver *recv = (struct receiver *) arg;
+    unsigned char *data = (unsigned char *) malloc (SEND_BUFFER_SIZE);
+    struct oif_header header;
+    unsigned int n;
+    unsigned int i;
+
+    for (n = 0; (n < SEND_FRAMES) && (recv->error == 0); n++) {
+        if ((read_all (recv->fd, &header, sizeof (header)) < 0) ||
+                (read_all (recv->fd, data, header.img_size) < 0)) {
+            recv->error = "connection closed";
+        } else if (((unsigned int) header.id != n) || (header.img_size != recv->sizes[n])) {
+            recv->error = "wrong header";
+        } else {
+            for (i = 0; i < header.img_size; i++) {
+                if (data[i] != (unsigned char) (n * 7 + i)) {
+                    recv->error = "wrong data";
+                    break;
+                }
+            }
+        }
+        if (n % 16 == 0) {
+            /* A slow receiver, so the sender has partial writes */
+            usleep (1000);
+        }
+    }
+    /* After an error the sender gets an error too instead of waiting */
+    shutdown (recv->fd, SHUT_RDWR);
+    free (data);
+    return 0;
+}
+
+
+static void
+check_sender (
+    int flags)
+{
+    struct oif_sender sender;
+    struct oif_send_buffer *buf;
+    struct receiver recv;
+    pthread_t thread;
+    unsigned long long frames_sent;
+    int send_size = 8192;
+    int fds[2];
+    unsigned int n;
+    unsigned int i;
+    int ret;
+
+    CHECK (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) == 0, "socketpair failed");
+    fcntl (fds[0], F_SETFL, fcntl (fds[0], F_GETFL) | O_NONBLOCK);
+    setsockopt (fds[0], SOL_SOCKET, SO_SNDBUF, &send_size, sizeof (send_size));
+    recv.fd = fds[1];
+    recv.error = 0;
+    for (n = 0; n < SEND_FRAMES; n++) {
+        recv.sizes[n] = (n % 10 == 0) ? 0 : next_rand () % SEND_BUFFER_SIZE;
+    }
+
+    if (oif_sender_init (&sender, fds[0], SEND_BUFFERS, SEND_BUFFER_SIZE, flags) != 0) {
+        close (fds[0]);
+        close (fds[1]);
+        CHECK (0, "sender flags %d: oif_sender_init failed", flags);
+    }
+    pthread_create (&thread, 0, receive_frames, &recv);
+    ret = 0;
+    for (n = 0; (n < SEND_FRAMES) && (ret >= 0); n++) {
+        while (((buf = oif_sender_get_buffer (&sender)) == 0) && (ret >= 0)) {
+            ret = oif_sender_wait (&sender, 1000);
+        }
+        if (buf == 0) {
+            break;
+        }
+        oif_init_header (&buf->header, 1, 1);
+        buf->header.id = n;
+        buf->header.img_size = recv.sizes[n];
+        for (i = 0; i < recv.sizes[n]; i++) {
+            buf->data[i] = (unsigned char) (n * 7 + i);
+        }
+        ret = oif_sender_queue (&sender, buf);
+    }
+    while (ret == 0) {
+        ret = oif_sender_wait (&sender, 1000);
+    }
+    /* The receiver stops at the end of the data, also after an error */
+    shutdown (fds[0], SHUT_WR);
+    pthread_join (thread, 0);
+    frames_sent = sender.frames_sent;
+    oif_sender_destroy (&sender);
+    close (fds[0]);
+    close (fds[1]);
+
+    CHECK (ret == 1, "sender flags %d: %d", flags, ret);
+    CHECK (recv.error == 0, "sender flags %d: %s", flags, recv.error);
+    CHECK (frames_sent == SEND_FRAMES, "sender flags %d: %llu frames sent", flags, frames_sent);
+}
+
+
+/*
+ * Blends src over dst like the compositor, the reference for
+ * oif_compositor_compose.
+ */
+static unsigned int
+blend_pixel (
+    unsigned int dst,
+    unsigned int src)
+{
+    unsigned int a = src >> 24;
+    unsigned int result = 0;
+    unsigned int shift;
+    unsigned int s;
+    unsigned int d;
+    unsigned int x;
+
+    if (a == 255) {
+        return src;
+    }
+    if (a == 0) {
+        return dst;
+    }
+    for (shift = 0; shift < 32; shift += 8) {
+        s = (shift == 24) ? 255 : (src >> shift) & 0xFF;
+        d = (dst >> shift) & 0xFF;
+        x = s * a + d * (255 - a) + 128;
+        result |= ((x + (x >> 8)) >> 8) << shift;
+    }
+    return result;
+}
+
+
+/*
+ * Layers with opaque, transparent and translucent pixels must be
+ * composited bottom to top by all blend kernels, only within the
+ * rectangle and with the stride of the target.
+ */
+static void
+check_compose (
+    unsigned int width,
+    unsigned int height)
+{
+    static const int kernels[] = { OIF_KERNEL_SCALAR, OIF_KERNEL_SSE2, OIF_KERNEL_AVX2 };
+    static const unsigned int alphas[] = { 0x00000000, 0xFF000000, 0x80000000, 0x01000000 };
+    unsigned int num_pixels = width * height;
+    unsigned int stride = width + next_rand () % 4;
+    unsigned int *target = (unsigned int *) malloc (stride * height * sizeof (unsigned int));
+    unsigned int *reference = (unsigned int *) malloc (stride * height * sizeof (unsigned int));
+    unsigned int background = next_rand () | 0xFF000000;
+    struct oif_compositor comp;
+    struct oif_layer *layers[3];
+    struct oif_rect rect;
+    unsigned int pixel;
+    unsigned int x;
+    unsigned int y;
+    unsigned int i;
+    unsigned int k;
+    int failed = 0;
+
+    oif_compositor_init (&comp, width, height, background);
+    for (i = 0; i < 3; i++) {
+        layers[i] = oif_compositor_get_layer (&comp, (int) (next_rand () % 8));
+    }
+    for (i = 0; i < 3; i++) {
+        for (k = 0; k < num_pixels; k++) {
+            /* Mostly transparent or opaque, like overlays */
+            layers[i]->pixels[k] = (next_rand () & 0x00FFFFFF) | alphas[next_rand () % 4];
+            if (next_rand () % 4 == 0) {
+                layers[i]->pixels[k] = next_rand ();
+            }
+        }
+    }
+    /* The first layer goes to the top */
+    oif_compositor_set_z (&comp, layers[0], 100);
+
+    rect.x = next_rand () % width;
+    rect.y = next_rand () % height;
+    rect.width = 1 + next_rand () % (width - rect.x);
+    rect.height = 1 + next_rand () % (height - rect.y);
+    for (k = 0; k < stride * height; k++) {
+        reference[k] = next_rand ();
+    }
+    for (y = rect.y; y < rect.y + rect.height; y++) {
+        for (x = rect.x; x < rect.x + rect.width; x++) {
+            pixel = background;
+            for (i = 0; i < comp.num_layers; i++) {
+                pixel = blend_pixel (pixel, comp.layers[i]->pixels[y * width + x]);
+            }
+            reference[y * stride + x] = pixel;
+        }
+    }
+
+    for (k = 0; (k < sizeof (kernels) / sizeof (kernels[0])) && !failed; k++) {
+        oif_select_blend_kernel (kernels[k]);
+        memcpy (target, reference, stride * height * sizeof (unsigned int));
+        for (y = rect.y; y < rect.y + rect.height; y++) {
+            memset (target + y * stride + rect.x, 0, rect.width * sizeof (unsigned int));
+        }
+        oif_compositor_compose (&comp, (unsigned char *) target,
+                                stride * sizeof (unsigned int), &rect);
+        failed = (memcmp (target, reference, stride * height * sizeof (unsigned int)) != 0);
+    }
+    oif_select_blend_kernel (OIF_KERNEL_AUTO);
+    oif_compositor_destroy (&comp);
+    free (target);
+    free (reference);
+
+    CHECK (!failed, "compositor %ux%u kernel %d: wrong pixels", width, height, kernels[k - 1]);
+    CHECK (comp.num_layers == 0, "compositor: %u layers left", comp.num_layers);
+}
+
+
+/*
+ * Opens the container file and decodes every frame. cut is set to an
+ * offset within the last frame.
+ * Returns 0, the error of the file API or the decoder, or -1 if a frame
+ * is wrong.
+ */
+static int
+read_file (
+    const char *path,
+    const unsigned int *images,
+    unsigned int width,
+    unsigned int height,
+    unsigned int num_frames,
+    unsigned long long *cut)
+{
+    unsigned int num_pixels = width * height;
+    unsigned int *decoded = (unsigned int *) malloc (num_pixels * sizeof (unsigned int));
+    const struct oif_header *header;
+    const unsigned char *data;
+    struct oif_file file;
+    unsigned int n;
+    int ret;
+
+    ret = oif_file_open (&file, path);
+    if (ret < 0) {
+        free (decoded);
+        return ret;
+    }
+    if (file.num_frames != num_frames) {
+        ret = -1;
+    }
+    for (n = 0; (ret == 0) && (n < num_frames); n++) {
+        ret = oif_file_frame (&file, n, &header, &data);
+        if ((ret == 0) && ((header->width != width) || (file.index[n].timestamp != 1000 * n) ||
+                           (oif_file_find_time (&file, 1000 * n + 999) != n))) {
+            ret = -1;
+        }
+        if (ret == 0) {
+            memset (decoded, 0, num_pixels * sizeof (unsigned int));
+            ret = oif_file_decode (&file, n, (unsigned char *) decoded, 0);
+        }
+        if ((ret == 0) && (memcmp (decoded, images + n * num_pixels,
+                                   num_pixels * sizeof (unsigned int)) != 0)) {
+            ret = -1;
+        }
+        *cut = file.index[n].offset + sizeof (*header) + header->img_size - 1;
+    }
+    if ((ret == 0) && (oif_file_frame (&file, num_frames, &header, &data) != OIF_ERR_RANGE)) {
+        ret = -1;
+    }
+    oif_file_close (&file);
+    free (decoded);
+    return ret;
+}
+
+
+/*
+ * Images of two ids, full images and changed lines, are written to a
+ * container file. The frames must be found by time and decoded with
+ * the frames they depend on, also after the index and a part of the
+ * last frame are cut off and the index is rebuilt.
+ */
+#define FILE_FRAMES 24
+
+static void
+check_file (
+    unsigned int width,
+    unsigned int height)
+{
+    unsigned int num_pixels = width * height;
+    unsigned int *images = (unsigned int *) malloc (FILE_FRAMES * num_pixels *
+                                                    sizeof (unsigned int));
+    unsigned char *compr_data = (unsigned char *) malloc (OIF_COMPRESS_BOUND (width, height));
+    const unsigned int *prev[2] = { 0, 0 };
+    char path[] = "/tmp/oif_check_XXXXXX";
+    struct oif_file_writer wr;
+    struct oif_header header;
+    unsigned long long cut = 0;
+    unsigned int *img;
+    unsigned int n;
+    int id;
+    int fd;
+    int ret;
+
+    fd = mkstemp (path);
+    do {
+        CHECK (fd >= 0, "cannot create %s", path);
+        close (fd);
+        ret = oif_file_create (&wr, path);
+        for (n = 0; (ret == 0) && (n < FILE_FRAMES); n++) {
+            id = next_rand () % 2;
+            img = images + n * num_pixels;
+            random_image (img, width, height, 4);
+            oif_init_header (&header, width, height);
+            header.id = id;
+            if ((prev[id] == 0) || (next_rand () % 3 == 0)) {
+                oif_compress (&header, (unsigned char *) img, compr_data);
+            } else {
+                oif_compress_delta (&header, (unsigned char *) prev[id], (unsigned char *) img,
+                                    compr_data);
+            }
+            prev[id] = img;
+            ret = oif_file_append (&wr, &header, compr_data, 1000 * n);
+        }
+        if (ret == 0) {
+            ret = oif_file_finish (&wr);
+        }
+        CHECK (ret == 0, "writing %s: %d", path, ret);
+
+        ret = read_file (path, images, width, height, FILE_FRAMES, &cut);
+        CHECK (ret == 0, "file %ux%u: %d", width, height, ret);
+        CHECK (truncate (path, cut) == 0, "cannot truncate %s", path);
+        ret = read_file (path, images, width, height, FILE_FRAMES - 1, &cut);
+        CHECK (ret == 0, "file %ux%u without index: %d", width, height, ret);
+    } while (0);
+
+    if (fd >= 0) {
+        unlink (path);
+    }
+    free (images);
+    free (compr_data);
+}
+
+
+int
+main ()
+{
+    static const unsigned int sizes[][2] = {
+        { 1, 1 }, { 1, 100 }, { 100, 1 }, { 70000, 2 }, { 8, 5000 }
+    };
+    unsigned int width;
+    unsigned int height;
+    unsigned int encoder;
+    unsigned int i;
+
+    for (i = 0; i < 4000; i++) {
+        encoder = i % NUM_ENCODERS;
+        width = 1 + next_rand () % 70;
+        height = 1 + next_rand () % 70;
+        check_roundtrip (encoder, width, height);
+        check_validate (encoder, width, height);
+        if (i % 2 == 0) {
+            check_format (encoder, width, height);
+        }
+    }
+    /* Long lines and many lines need the EXT codes */
+    for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]) * NUM_ENCODERS; i++) {
+        check_roundtrip (i % NUM_ENCODERS, sizes[i / NUM_ENCODERS][0], sizes[i / NUM_ENCODERS][1]);
+        check_format (i % NUM_ENCODERS, sizes[i / NUM_ENCODERS][0], sizes[i / NUM_ENCODERS][1]);
+    }
+    for (i = 0; i < 200; i++) {
+        check_kernels (1 + next_rand () % 300, 1 + next_rand () % 20);
+    }
+    check_up_tall (4096, 4200);
+    check_sender (OIF_SEND_NODELAY);
+    check_sender (OIF_SEND_ZEROCOPY);
+    for (i = 0; i < 200; i++) {
+        check_compose (1 + next_rand () % 70, 1 + next_rand () % 40);
+    }
+    for (i = 0; i < 10; i++) {
+        check_file (1 + next_rand () % 40, 1 + next_rand () % 40);
+    }
+
+    if (failures > 0) {
+        printf ("%d checks failed\n", failures);
+        return 1;
+    }
+    printf ("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) 2023 by Frank Storm <frank.storm@storm-se.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "oif_compose.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OIF_X86 1
+#include <immintrin.h>
+#endif
+
+
+/*
+ * Blend kernels.
+ *
+ * oif_blend blends count pixels of src over dst. Each color channel is
+ * (src * a + dst * (255 - a)) / 255, rounded, with the alpha a of src.
+ * The alpha of the result is a + dst_alpha * (255 - a) / 255, which is
+ * the same formula with 255 as the source value.
+ * All kernels give the same result. Pixels with a = 0 are skipped,
+ * pixels with a = 255 are copied.
+ */
+typedef void (*oif_blend_fn) (
+    unsigned int *dst,
+    const unsigned int *src,
+    unsigned int count);
+
+static oif_blend_fn oif_blend = 0;
+
+
+static inline unsigned int
+oif_div255 (
+    unsigned int x)
+{
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+
+static inline unsigned int
+oif_blend_pixel (
+    unsigned int d,
+    unsigned int s)
+{
+    unsigned int a = s >> 24;
+    unsigned int ia = 255 - a;
+
+    s |= 0xFF000000;
+    return oif_div255 ((s & 0xFF) * a + (d & 0xFF) * ia) |
+        (oif_div255 (((s >> 8) & 0xFF) * a + ((d >> 8) & 0xFF) * ia) << 8) |
+        (oif_div255 (((s >> 16) & 0xFF) * a + ((d >> 16) & 0xFF) * ia) << 16) |
+        (oif_div255 ((s >> 24) * a + (d >> 24) * ia) << 24);
+}
+
+
+static void
+oif_blend_scalar (
+    unsigned int *dst,
+    const unsigned int *src,
+    unsigned int count)
+{
+    unsigned int i;
+    unsigned int a;
+
+    for (i = 0; i < count; i++) {
+        a = src[i] >> 24;
+        if (a == 255) {
+            dst[i] = src[i];
+        } else if (a != 0) {
+            dst[i] = oif_blend_pixel (dst[i], src[i]);
+        }
+    }
+}
+
+
+#ifdef OIF_X86
+
+/*
+ * Blends the pixels of s over d, 16 bit per channel.
+ */
+__attribute__ ((target ("sse2")))
+static inline __m128i
+oif_blend_sse2_4 (
+    __m128i d,
+    __m128i s)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i c255 = _mm_set1_epi16 (255);
+    const __m128i c128 = _mm_set1_epi16 (128);
+    __m128i a = _mm_srli_epi32 (s, 24);
+    __m128i lo;
+    __m128i hi;
+    __m128i alo;
+    __m128i ahi;
+
+    a = _mm_or_si128 (a, _mm_slli_epi32 (a, 16));
+    alo = _mm_unpacklo_epi32 (a, a);
+    ahi = _mm_unpackhi_epi32 (a, a);
+    s = _mm_or_si128 (s, _mm_set1_epi32 ((int) 0xFF000000));
+
+    lo = _mm_add_epi16 (_mm_mullo_epi16 (_mm_unpacklo_epi8 (s, zero), alo),
+                        _mm_mullo_epi16 (_mm_unpacklo_epi8 (d, zero), _mm_sub_epi16 (c255, alo)));
+    hi = _mm_add_epi16 (_mm_mullo_epi16 (_mm_unpackhi_epi8 (s, zero), ahi),
+                        _mm_mullo_epi16 (_mm_unpackhi_epi8 (d, zero), _mm_sub_epi16 (c255, ahi)));
+    lo = _mm_add_epi16 (lo, c128);
+    hi = _mm_add_epi16 (hi, c128);
+    lo = _mm_srli_epi16 (_mm_add_epi16 (lo, _mm_srli_epi16 (lo, 8)), 8);
+    hi = _mm_srli_epi16 (_mm_add_epi16 (hi, _mm_srli_epi16 (hi, 8)), 8);
+    return _mm_packus_epi16 (lo, hi);
+}
+
+
+__attribute__ ((target ("sse2")))
+static void
+oif_blend_sse2 (
+    unsigned int *dst,
+    const unsigned int *src,
+    unsigned int count)
+{
+    const __m128i alpha = _mm_set1_epi32 ((int) 0xFF000000);
+    const __m128i zero = _mm_setzero_si128 ();
+    __m128i s;
+    __m128i a;
+
+    for (; count >= 4; count -= 4) {
+        s = _mm_loadu_si128 ((const __m128i *) src);
+        a = _mm_and_si128 (s, alpha);
+        if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (a, alpha)) == 0xFFFF) {
+            _mm_storeu_si128 ((__m128i *) dst, s);
+        } else if (_mm_movemask_epi8 (_mm_cmpeq_epi32 (a, zero)) != 0xFFFF) {
+            _mm_storeu_si128 ((__m128i *) dst,
+                              oif_blend_sse2_4 (_mm_loadu_si128 ((const __m128i *) dst), s));
+        }
+        dst += 4;
+        src += 4;
+    }
+    oif_blend_scalar (dst, src, count);
+}
+
+
+__attribute__ ((target ("avx2")))
+static void
+oif_blend_avx2 (
+    unsigned int *dst,
+    const unsigned int *src,
+    unsigned int count)
+{
+    const __m256i alpha = _mm256_set1_epi32 ((int) 0xFF000000);
+    const __m256i zero = _mm256_setzero_si256 ();
+    const __m256i c255 = _mm256_set1_epi16 (255);
+    const __m256i c128 = _mm256_set1_epi16 (128);
+    __m256i s;
+    __m256i d;
+    __m256i a;
+    __m256i alo;
+    __m256i ahi;
+    __m256i lo;
+    __m256i hi;
+
+    for (; count >= 8; count -= 8) {
+        s = _mm256_loadu_si256 ((const __m256i *) src);
+        a = _mm256_and_si256 (s, alpha);
+        if (_mm256_movemask_epi8 (_mm256_cmpeq_epi32 (a, alpha)) == -1) {
+            _mm256_storeu_si256 ((__m256i *) dst, s);
+        } else if (_mm256_movemask_epi8 (_mm256_cmpeq_epi32 (a, zero)) != -1) {
+            /* As oif_blend_sse2_4, in both 128 bit lanes */
+            d = _mm256_loadu_si256 ((const __m256i *) dst);
+            a = _mm256_srli_epi32 (s, 24);
+            a = _mm256_or_si256 (a, _mm256_slli_epi32 (a, 16));
+            alo = _mm256_unpacklo_epi32 (a, a);
+            ahi = _mm256_unpackhi_epi32 (a, a);
+            s = _mm256_or_si256 (s, alpha);
+            lo = _mm256_add_epi16 (_mm256_mullo_epi16 (_mm256_unpacklo_epi8 (s, zero), alo),
+                                   _mm256_mullo_epi16 (_mm256_unpacklo_epi8 (d, zero),
+                                                       _mm256_sub_epi16 (c255, alo)));
+            hi = _mm256_add_epi16 (_mm256_mullo_epi16 (_mm256_unpackhi_epi8 (s, zero), ahi),
+                                   _mm256_mullo_epi16 (_mm256_unpackhi_epi8 (d, zero),
+                                                       _mm256_sub_epi16 (c255, ahi)));
+            lo = _mm256_add_epi16 (lo, c128);
+            hi = _mm256_add_epi16 (hi, c128);
+            lo = _mm256_srli_epi16 (_mm256_add_epi16 (lo, _mm256_srli_epi16 (lo, 8)), 8);
+            hi = _mm256_srli_epi16 (_mm256_add_epi16 (hi, _mm256_srli_epi16 (hi, 8)), 8);
+            _mm256_storeu_si256 ((__m256i *) dst, _mm256_packus_epi16 (lo, hi));
+        }
+        dst += 8;
+        src += 8;
+    }
+    oif_blend_sse2 (dst, src, count);
+}
+
+#endif
+
+
+/*
+ * Sets the blend kernel. With OIF_KERNEL_AUTO the fastest kernel
+ * supported by the CPU is used.
+ */
+static int
+oif_set_blend_kernel (
+    int kernels)
+{
+#ifdef OIF_X86
+    __builtin_cpu_init ();
+    if (kernels == OIF_KERNEL_AUTO) {
+        kernels = OIF_KERNEL_AVX2;
+    }
+    if ((kernels == OIF_KERNEL_AVX2) && !__builtin_cpu_supports ("avx2")) {
+        kernels = OIF_KERNEL_SSE2;
+    }
+    if ((kernels == OIF_KERNEL_SSE2) && !__builtin_cpu_supports ("sse2")) {
+        kernels = OIF_KERNEL_SCALAR;
+    }
+#endif
+
+    switch (kernels) {
+#ifdef OIF_X86
+    case OIF_KERNEL_AVX2:
+        oif_blend = oif_blend_avx2;
+        break;
+    case OIF_KERNEL_SSE2:
+        oif_blend = oif_blend_sse2;
+        break;
+#endif
+    default:
+        kernels = OIF_KERNEL_SCALAR;
+        oif_blend = oif_blend_scalar;
+        break;
+    }
+    return kernels;
+}
+
+
+static pthread_once_t oif_blend_once = PTHREAD_ONCE_INIT;
+
+
+static void
+oif_set_auto_blend_kernel (void)
+{
+    oif_set_blend_kernel (OIF_KERNEL_AUTO);
+}
+
+
+/*
+ * Selects the blend kernel. The automatic selection is done once
+ * first, also by oif_compositor_init, so it cannot replace the kernel
+ * selected here later.
+ */
+int
+oif_select_blend_kernel (
+    int kernels)
+{
+    pthread_once (&oif_blend_once, oif_set_auto_blend_kernel);
+    return oif_set_blend_kernel (kernels);
+}
+
+
+/*
+ * Initializes the compositor.
+ */
+void
+oif_compositor_init (
+    struct oif_compositor *comp,
+    unsigned int width,
+    unsigned int height,
+    unsigned int background)
+{
+    pthread_once (&oif_blend_once, oif_set_auto_blend_kernel);
+
+    memset (comp, 0, sizeof (*comp));
+    comp->width = width;
+    comp->height = height;
+    comp->background = background;
+    comp->dirty.width = width;
+    comp->dirty.height = height;
+}
+
+
+/*
+ * Marks the whole screen as dirty.
+ */
+static void
+oif_compositor_damage_all (
+    struct oif_compositor *comp)
+{
+    comp->dirty.x = 0;
+    comp->dirty.y = 0;
+    comp->dirty.width = comp->width;
+    comp->dirty.height = comp->height;
+}
+
+
+/*
+ * Returns the layer for id, a new one if needed.
+ */
+struct oif_layer *
+oif_compositor_get_layer (
+    struct oif_compositor *comp,
+    int id)
+{
+    struct oif_layer *layer;
+    unsigned int i;
+
+    for (i = 0; i < comp->num_layers; i++) {
+        if (comp->layers[i]->id == id) {
+            return comp->layers[i];
+        }
+    }
+    if (comp->num_layers == OIF_MAX_LAYERS) {
+        return 0;
+    }
+
+    layer = (struct oif_layer *) malloc (sizeof (*layer));
+    if (layer == 0) {
+        return 0;
+    }
+    layer->pixels = (unsigned int *) calloc ((size_t) comp->width * comp->height,
+                                             sizeof (unsigned int));
+    if (layer->pixels == 0) {
+        free (layer);
+        return 0;
+    }
+    layer->id = id;
+    layer->z = id;
+    comp->layers[comp->num_layers++] = layer;
+    oif_compositor_set_z (comp, layer, id);
+    return layer;
+}
+
+
+/*
+ * Moves the layer to its place in the z-order.
+ */
+void
+oif_compositor_set_z (
+    struct oif_compositor *comp,
+    struct oif_layer *layer,
+    int z)
+{
+    unsigned int i;
+    unsigned int j;
+
+    for (i = 0; comp->layers[i] != layer; i++) {
+    }
+    for (; i + 1 < comp->num_layers; i++) {
+        comp->layers[i] = comp->layers[i + 1];
+    }
+    layer->z = z;
+    for (j = comp->num_layers - 1; (j > 0) && (comp->layers[j - 1]->z > z); j--) {
+        comp->layers[j] = comp->layers[j - 1];
+    }
+    comp->layers[j] = layer;
+    oif_compositor_damage_all (comp);
+}
+
+
+/*
+ * Removes and frees the layer for id.
+ */
+void
+oif_compositor_remove_layer (
+    struct oif_compositor *comp,
+    int id)
+{
+    unsigned int i;
+
+    for (i = 0; (i < comp->num_layers) && (comp->layers[i]->id != id); i++) {
+    }
+    if (i == comp->num_layers) {
+        return;
+    }
+    free (comp->layers[i]->pixels);
+    free (comp->layers[i]);
+    for (; i + 1 < comp->num_layers; i++) {
+        comp->layers[i] = comp->layers[i + 1];
+    }
+    comp->num_layers--;
+    oif_compositor_damage_all (comp);
+}
+
+
+/*
+ * Adds a changed rectangle to the dirty part of the screen.
+ */
+void
+oif_compositor_damage (
+    struct oif_compositor *comp,
+    const struct oif_rect *rect)
+{
+    oif_rect_union (&comp->dirty, rect);
+}
+
+
+/*
+ * Composites the rectangle row by row: the background, then the
+ * layers bottom to top.
+ */
+void
+oif_compositor_compose (
+    struct oif_compositor *comp,
+    unsigned char *target,
+    unsigned int stride,
+    const struct oif_rect *rect)
+{
+    unsigned int x = rect->x;
+    unsigned int width = rect->width;
+    unsigned int height = rect->height;
+    unsigned int *dst;
+    unsigned int y;
+    unsigned int i;
+
+    if ((x >= comp->width) || (rect->y >= comp->height)) {
+        width = 0;
+    }
+    if (width > comp->width - x) {
+        width = comp->width - x;
+    }
+    if (height > comp->height - rect->y) {
+        height = comp->height - rect->y;
+    }
+
+    for (y = rect->y; (width > 0) && (y < rect->y + height); y++) {
+        dst = (unsigned int *) (target + (size_t) y * stride) + x;
+        for (i = 0; i < width; i++) {
+            dst[i] = comp->background;
+        }
+        for (i = 0; i < comp->num_layers; i++) {
+            oif_blend (dst, comp->layers[i]->pixels + (size_t) y * comp->width + x, width);
+        }
+    }
+    memset (&comp->dirty, 0, sizeof (comp->dirty));
+}
+
+
+/*
+ * Frees all layers.
+ */
+void
+oif_compositor_destroy (
+    struct oif_compositor *comp)
+{
+    while (comp->num_layers > 0) {
+        oif_compositor_remove_layer (comp, comp->layers[0]->id);
+    }
+}
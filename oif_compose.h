@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2023 by Frank Storm <frank.storm@storm-se.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ *
+ * Compositor for several overlays on one screen.
+ *
+ * Each overlay id has its own layer with a full-screen image, the
+ * overlays are decoded into the layers. Only the changed parts of the
+ * layers are composited onto the screen, bottom to top in z-order:
+ *
+ *     oif_compositor_init (&comp, width, height, background);
+ *     layer = oif_compositor_get_layer (&comp, header.id);
+ *     decode into layer->pixels, e.g. with OIF_FLAG_DAMAGE
+ *     oif_compositor_damage (&comp, &dec.damage);
+ *     oif_compositor_compose (&comp, screen, stride, &comp.dirty);
+ *
+ * The pixels are blended with their alpha channel (bit 31-24) over the
+ * layers below, the background is opaque. An alpha of 0 is transparent.
+ */
+
+#ifndef OIF_COMPOSE_H
+#define OIF_COMPOSE_H 1
+
+#include "oif.h"
+
+/* Maximum number of layers */
+#define OIF_MAX_LAYERS 16
+
+
+/*
+ * A layer, its image has the size of the screen.
+ */
+struct oif_layer {
+    int id;
+    int z;
+    unsigned int *pixels;
+};
+
+
+/*
+ * State of the compositor, see oif_compositor_init.
+ * dirty may be read, the other members are private.
+ */
+struct oif_compositor {
+    unsigned int width;
+    unsigned int height;
+    unsigned int background;
+    /* Sorted by z, the bottom layer first */
+    struct oif_layer *layers[OIF_MAX_LAYERS];
+    unsigned int num_layers;
+    /* The part of the screen that has to be composited */
+    struct oif_rect dirty;
+};
+
+
+/*
+ * Initializes the compositor for a screen of width x height pixels.
+ * background is the color below all layers. The whole screen is dirty.
+ */
+extern void
+oif_compositor_init (
+    struct oif_compositor *comp,
+    unsigned int width,
+    unsigned int height,
+    unsigned int background);
+
+/*
+ * Returns the layer for id. A new layer is transparent and gets the
+ * z-order id, i.e. higher ids are on top.
+ * Returns 0 if there are OIF_MAX_LAYERS layers or not enough memory.
+ */
+extern struct oif_layer *
+oif_compositor_get_layer (
+    struct oif_compositor *comp,
+    int id);
+
+/*
+ * Moves the layer to z-order z. Layers with the same z keep their order.
+ */
+extern void
+oif_compositor_set_z (
+    struct oif_compositor *comp,
+    struct oif_layer *layer,
+    int z);
+
+/*
+ * Removes the layer for id, the screen below it becomes dirty.
+ */
+extern void
+oif_compositor_remove_layer (
+    struct oif_compositor *comp,
+    int id);
+
+/*
+ * Marks a changed part of a layer.
+ */
+extern void
+oif_compositor_damage (
+    struct oif_compositor *comp,
+    const struct oif_rect *rect);
+
+/*
+ * Composites rect of all layers into the 32 bit image target with
+ * stride bytes per line, and clears dirty. rect is usually dirty, or
+ * a larger rectangle if target is older than the last composition,
+ * e.g. the hidden half of a double-buffered framebuffer.
+ */
+extern void
+oif_compositor_compose (
+    struct oif_compositor *comp,
+    unsigned char *target,
+    unsigned int stride,
+    const struct oif_rect *rect);
+
+/*
+ * Frees the layers.
+ */
+extern void
+oif_compositor_destroy (
+    struct oif_compositor *comp);
+
+/*
+ * Selects the blend kernel, one of the OIF_KERNEL_* types.
+ * Returns the kernel type actually selected.
+ */
+extern int
+oif_select_blend_kernel (
+    int kernels);
+
+#endif
@@ -19,10 +19,12 @@
 
 
 #include <iostream>
+#include <algorithm>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <errno.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
@@ -30,6 +32,7 @@
 #include <opencv2/opencv.hpp>
 
 #include "oif.h"
+#include "oif_send.h"
 
 // Adjust to the actual display size
 #define IMG_WIDTH 1600
@@ -130,11 +133,11 @@ main (
     char *argv[])
 {
     cv::Mat img(IMG_HEIGHT, IMG_WIDTH, CV_8UC4, cv::Scalar(0, 0, 0, 0));
+    cv::Mat prev_img(IMG_HEIGHT, IMG_WIDTH, CV_8UC4, cv::Scalar(0, 0, 0, 0));
     cv::Mat logo;
     cv::Mat logo_alpha;
     int sockfd;
     struct sockaddr_in serv_addr;
-    int size;
     char *ipAddr;
     struct timespec now;
     clockid_t clkid = CLOCK_REALTIME;
@@ -147,10 +150,23 @@ main (
     int ret;
     int port;
     char *endptr;
+    int lines;
+    bool first_frame = true;
+    int prev_x = logo_x;
+    int prev_y = logo_y;
+    int mx;
+    int my;
+    int left;
+    int top;
+    int right;
+    int bottom;
+    struct oif_motion move;
+    unsigned int num_moves;
 
 
     struct oif_header header;
-    unsigned char coding_buffer[IMG_HEIGHT * IMG_WIDTH * 4 + 256];
+    struct oif_sender sender;
+    struct oif_send_buffer *buf;
 
     // We need at least an IP address as argument
     if ((argc != 2) && (argc != 3)) {
@@ -185,10 +201,20 @@ main (
         return 1;
     }
 
-    // Initialize the OIF header
-    header.magic = OIF_MAGIC;
-    header.width = IMG_WIDTH;
-    header.height = IMG_HEIGHT;
+    // The images are encoded into the buffers of the sender and sent
+    // from there, the socket does not block
+    fcntl (sockfd, F_SETFL, fcntl (sockfd, F_GETFL) | O_NONBLOCK);
+    // Room for an incompressible image and the one move
+    if (oif_sender_init (&sender, sockfd, 3,
+                         OIF_COMPRESS_BOUND (IMG_WIDTH, IMG_HEIGHT) + 6 * 4,
+                         OIF_SEND_NODELAY | OIF_SEND_ZEROCOPY) < 0) {
+        std::cout << "Error: Cannot allocate send buffers" << std::endl;
+        close (sockfd);
+        return 1;
+    }
+
+    // Initialize the OIF header, the flags and the reserved words are cleared
+    oif_init_header (&header, IMG_WIDTH, IMG_HEIGHT);
     header.id = 1;
 
     // Read the logo
@@ -203,38 +229,90 @@ main (
         cv::Mat roi(img, cv::Rect(logo_x, logo_y, logo.cols, logo.rows));
         logo_alpha.copyTo(roi);
 
-        // Compress the image
-        oif_compress (&header, img.ptr<unsigned char>(0), coding_buffer);
+        // Get a free buffer, the others may still be sent
+        while ((buf = oif_sender_get_buffer (&sender)) == 0) {
+            if (oif_sender_wait (&sender, -1) < 0) {
+                std::cout << "Error: Cannot send image (" << strerror(errno) << ")" << std::endl;
+                close (sockfd);
+                return 1;
+            }
+        }
+        buf->header = header;
+
+        // Compress the image. The first frame is sent completely,
+        // afterwards only the lines that changed since the last frame.
+        if (first_frame) {
+            oif_compress (&buf->header, img.ptr<unsigned char>(0), buf->data);
+            lines = img.rows;
+            first_frame = false;
+        } else {
+            // The logo has moved by mx, my. The background it uncovers
+            // moves with it, so the move is the union of the old and the
+            // new logo rectangle, clipped so that the source is inside
+            // the image as well. Only the remaining pixels are encoded.
+            mx = logo_x - prev_x;
+            my = logo_y - prev_y;
+            left = std::max (std::min (prev_x, logo_x), mx);
+            top = std::max (std::min (prev_y, logo_y), my);
+            right = std::min (std::max (prev_x, logo_x) + logo.cols, IMG_WIDTH + mx);
+            bottom = std::min (std::max (prev_y, logo_y) + logo.rows, IMG_HEIGHT + my);
+            num_moves = 0;
+            if (((mx != 0) || (my != 0)) && (left < right) && (top < bottom)) {
+                move.x = left - mx;
+                move.y = top - my;
+                move.width = right - left;
+                move.height = bottom - top;
+                move.dx = mx;
+                move.dy = my;
+                num_moves = 1;
+            }
+            lines = oif_compress_motion (&buf->header, prev_img.ptr<unsigned char>(0),
+                                         img.ptr<unsigned char>(0), buf->data,
+                                         &move, num_moves);
+            if (lines < 0) {
+                std::cout << "Error: Cannot compress image (" << lines << ")" << std::endl;
+                close (sockfd);
+                return 1;
+            }
+            if (num_moves > 0) {
+                // The copy has to be sent even without other changes
+                lines += move.height;
+            }
+        }
+        prev_x = logo_x;
+        prev_y = logo_y;
 
         // Report statistics
+        std::cout << "Changed lines:" << lines << std::endl;
         std::cout << "Uncompressed size:" << img.cols * img.rows * 4 << std::endl;
-        std::cout << "Compressed size:" << header.img_size << std::endl;
-        std::cout << "Compression ratio:" << (double) header.img_size /
+        std::cout << "Compressed size:" << buf->header.img_size << std::endl;
+        std::cout << "Compression ratio:" << (double) buf->header.img_size /
             (double) (img.cols * img.rows * 4) << std::endl;
 
-        std::cout << "Sending image..." << std::endl;
-
         // Allign the sending of the overlay to 30 fps
         waitForEndOfInterval (delay, &now);
         clock_gettime (clkid, &now);
 
-        // Send the overlay. First send the header
-        size = write (sockfd, &header, sizeof (header));
-        if (size < 0) {
-            std::cout << "Error: Cannot send image header (" << strerror(errno) << ")" << std::endl;
-            close (sockfd);
-            return 1;
-        }
-        // and the the image data
-        size = write (sockfd, coding_buffer, header.img_size);
-        if (size < 0) {
-            std::cout << "Error: Cannot send image data (" << strerror(errno) << ")" << std::endl;
-            close (sockfd);
-            return 1;
+        // The current image becomes the reference for the next delta
+        cv::swap (img, prev_img);
+
+        if (lines == 0) {
+            // Nothing changed, nothing to send
+            oif_sender_release (&sender, buf);
+            calculateLogoPosition (logo.cols, logo.rows);
+            continue;
         }
 
-        if (size != (int) header.img_size) {
-            std::cout << "Error: Image data not fully sent" << std::endl;
+        std::cout << "Sending image..." << std::endl;
+
+        // Send header and image data with one call. What the socket
+        // does not take now is sent when it is writable again.
+        ret = oif_sender_queue (&sender, buf);
+        while (ret == 0) {
+            ret = oif_sender_wait (&sender, -1);
+        }
+        if (ret < 0) {
+            std::cout << "Error: Cannot send image (" << strerror(errno) << ")" << std::endl;
             close (sockfd);
             return 1;
         }
@@ -243,6 +321,7 @@ main (
         calculateLogoPosition (logo.cols, logo.rows);
     }
     close (sockfd);
+    oif_sender_destroy (&sender);
     return 0;
 }
 
@@ -1,6 +1,7 @@
 /*
- * Example program that receives OIF images over a socket connection
- * and writes them to a Linux framebuffer device.
+ * Example program that receives OIF images from any number of socket
+ * connections and writes them to Linux framebuffer devices, selected
+ * by the id of the image.
  *
  * Copyright (C) 2023 by Frank Storm <frank.storm@storm-se.com>
  *
@@ -32,149 +33,907 @@
 #include <unistd.h>
 #include <linux/fb.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <time.h>
 
 #include "oif.h"
+#include "oif_compose.h"
 
 
-#define FB_DEVICE "/dev/fb0"
+// The image with id n is shown on /dev/fb<n>, or with -c
+// composited as a layer on /dev/fb0
+#define FB_DEVICE "/dev/fb%d"
+#define MAX_OUTPUTS 8
 
 #define PORT 5018
 
+#define RCV_BUFFER_SIZE 65536
+// With -l the buffer grows up to this size, so that complete images
+// can be skipped
+#define RCV_BUFFER_MAX (64 * 1024 * 1024)
 
-void
-oifServerLoop (
-    int listenfd,
-    unsigned char *frameBuffer,
-    int fdFb)
-{
-    int size;
-    int bufferSize;
-    int sizeReceived;
-    int connfd;
+// Refresh period if it is not known from the screen info
+#define DEFAULT_FRAME_NS 16666667LL
+
+#define MAX_EVENTS 32
+
+// Rectangles of a damage set, more are merged
+#define MAX_DAMAGE_RECTS 8
+
+
+/*
+ * The changed parts of an image.
+ */
+struct oifDamage {
+    struct oif_rect rects[MAX_DAMAGE_RECTS];
+    unsigned int numRects;
+};
+
+/*
+ * A framebuffer device.
+ */
+struct oifScreen {
+    int fdFb;
+    unsigned char *frameBuffer;
+    unsigned int mapSize;
+    unsigned int stride;
+    // OIF_FORMAT_* of the pixels, the images are decoded into it
+    int format;
+    struct fb_var_screeninfo vinfo;
+    // The parts that changed with the last image shown, the hidden half
+    // of a double-buffered framebuffer misses them
+    struct oifDamage prevDirty;
+    // The parts decoded into the hidden half since it was shown
+    struct oifDamage dirty;
+    // With -l: an image is complete but not shown yet
+    int pending;
+    // FBIO_WAITFORVSYNC works, otherwise the images are shown at most
+    // once per frameNs
+    int vsync;
+    long long frameNs;
+    long long lastShown;
+};
+
+/*
+ * The target of the images with one id: a framebuffer, or a layer
+ * of the compositor.
+ */
+struct oifOutput {
+    struct oifScreen *screen;
+    struct oif_layer *layer;
+    // The client that is decoding an image into the output
+    struct oifClient *owner;
+};
+
+/*
+ * A connected producer. The image data is decoded while it is received,
+ * so the buffer does not need to hold a complete image.
+ */
+struct oifClient {
+    int fd;
     unsigned char *rcvBuffer;
-    unsigned char *currBufferPos;
+    unsigned int rcvSize;
+    unsigned int rcvLen;
+    int headerValid;
     struct oif_header header;
-    struct fb_var_screeninfo vinfo;
+    struct oif_decoder decoder;
+    struct oifOutput *output;
+    // Waits until another client has finished its image on output,
+    // the socket is not polled meanwhile
+    int waiting;
+    // Has data in rcvBuffer that can be processed now
+    int resume;
+    // Images dropped with -l
+    unsigned long long skipped;
+    struct oifClient *next;
+};
+
+struct oifServer {
+    int epollfd;
+    int listenfd;
+    struct oifOutput *outputs[MAX_OUTPUTS];
+    struct oifScreen *screens[MAX_OUTPUTS];
+    struct oifClient *clients;
+    // All ids are layers on screen 0 if != NULL
+    struct oif_compositor *compositor;
+    // Only the latest image is shown, see -l
+    int latest;
+};
+
+
+/*
+ * Returns the time of CLOCK_MONOTONIC in ns.
+ */
+long long
+monotonicNs (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/*
+ * Returns the area of the bounding rectangle of a and b.
+ */
+unsigned long long
+unionArea (
+    const struct oif_rect *a,
+    const struct oif_rect *b)
+{
+    struct oif_rect rect = *a;
+
+    oif_rect_union (&rect, b);
+    return (unsigned long long) rect.width * rect.height;
+}
+
+
+/*
+ * Adds a rectangle to a damage set. If the set is full, it is merged
+ * with the rectangle that grows least.
+ */
+void
+addDamage (
+    struct oifDamage *damage,
+    const struct oif_rect *rect)
+{
+    unsigned long long growth;
+    unsigned long long best = 0;
+    unsigned int merge = 0;
+    unsigned int i;
+
+    if ((rect->width == 0) || (rect->height == 0)) {
+        return;
+    }
+    if (damage->numRects < MAX_DAMAGE_RECTS) {
+        damage->rects[damage->numRects++] = *rect;
+        return;
+    }
+    for (i = 0; i < damage->numRects; i++) {
+        growth = unionArea (&damage->rects[i], rect) -
+            (unsigned long long) damage->rects[i].width * damage->rects[i].height;
+        if ((i == 0) || (growth < best)) {
+            best = growth;
+            merge = i;
+        }
+    }
+    oif_rect_union (&damage->rects[merge], rect);
+}
+
+
+/*
+ * Returns the framebuffer /dev/fb<n>, it is opened and mapped
+ * when it is used first.
+ */
+struct oifScreen *
+getScreen (
+    struct oifServer *server,
+    int n)
+{
+    struct oifScreen *screen;
+    struct fb_fix_screeninfo finfo;
+    char device[32];
     int ret;
 
+    if (server->screens[n] != NULL) {
+        return server->screens[n];
+    }
+
+    screen = (struct oifScreen *) calloc (1, sizeof (*screen));
+    if (screen == NULL) {
+        printf ("Error: Cannot allocate memory.\n");
+        return NULL;
+    }
+    snprintf (device, sizeof (device), FB_DEVICE, n);
+    screen->fdFb = open (device, O_RDWR);
+    if (screen->fdFb < 0) {
+        printf ("Error: Cannot open framebuffer device \"%s\" (%s)\n", device, strerror (errno));
+        free (screen);
+        return NULL;
+    }
     // Get the screen info, the structure is later used to switch the frame halves
-    ret = ioctl (fdFb, FBIOGET_VSCREENINFO, &vinfo);
+    ret = ioctl (screen->fdFb, FBIOGET_VSCREENINFO, &screen->vinfo);
     if (ret < 0) {
         printf ("Error: Cannot get framebuffer screen info (%s).\n", strerror (errno));
+        close (screen->fdFb);
+        free (screen);
+        return NULL;
+    }
+    // The lines may be padded, line_length is the stride
+    ret = ioctl (screen->fdFb, FBIOGET_FSCREENINFO, &finfo);
+    if (ret < 0) {
+        printf ("Error: Cannot get framebuffer fixed screen info (%s).\n", strerror (errno));
+        close (screen->fdFb);
+        free (screen);
+        return NULL;
+    }
+
+    switch (screen->vinfo.bits_per_pixel) {
+    case 16:
+        screen->format = OIF_FORMAT_RGB565;
+        break;
+    case 24:
+        screen->format = OIF_FORMAT_RGB888;
+        break;
+    case 32:
+        screen->format = (screen->vinfo.blue.offset == 24) ? OIF_FORMAT_ARGB : OIF_FORMAT_BGRA;
+        break;
+    default:
+        printf ("Error: %d bits per pixel are not supported\n", screen->vinfo.bits_per_pixel);
+        close (screen->fdFb);
+        free (screen);
+        return NULL;
     }
 
-    // Allocate the receive buffer
-    bufferSize = vinfo.xres * vinfo.yres * sizeof (unsigned int);
-    rcvBuffer = (unsigned char *) malloc (bufferSize);
-    if (rcvBuffer == NULL) {
+    /* Map the frame buffer to user space, with both halves if it is
+     * double-buffered */
+    screen->stride = finfo.line_length;
+    screen->mapSize = screen->stride * screen->vinfo.yres;
+    if (screen->vinfo.yres_virtual > screen->vinfo.yres) {
+        screen->mapSize *= 2;
+    }
+    screen->frameBuffer = (unsigned char *) mmap (0, screen->mapSize, PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED, screen->fdFb, 0);
+    if (screen->frameBuffer == MAP_FAILED) {
+        printf ("Error: Cannot map memory for framebuffer device %s\n", device);
+        close (screen->fdFb);
+        free (screen);
+        return NULL;
+    }
+    // The refresh period from the video timing, pixclock is in ps
+    screen->frameNs = (long long) screen->vinfo.pixclock *
+        (screen->vinfo.xres + screen->vinfo.left_margin + screen->vinfo.right_margin +
+         screen->vinfo.hsync_len) *
+        (screen->vinfo.yres + screen->vinfo.upper_margin + screen->vinfo.lower_margin +
+         screen->vinfo.vsync_len) / 1000;
+    if ((screen->frameNs < 1000000) || (screen->frameNs > 1000000000)) {
+        screen->frameNs = DEFAULT_FRAME_NS;
+    }
+    screen->vsync = 1;
+    // Nothing is known about the content of the hidden half
+    screen->prevDirty.rects[0].width = screen->vinfo.xres;
+    screen->prevDirty.rects[0].height = screen->vinfo.yres;
+    screen->prevDirty.numRects = 1;
+    printf ("Using %s\n", device);
+    server->screens[n] = screen;
+    return screen;
+}
+
+
+/*
+ * Returns the output for an id.
+ */
+struct oifOutput *
+getOutput (
+    struct oifServer *server,
+    int id)
+{
+    struct oifOutput *output;
+    struct oifScreen *screen;
+
+    if ((id < 0) || (id >= MAX_OUTPUTS)) {
+        printf ("Error: No output for id %d\n", id);
+        return NULL;
+    }
+    if (server->outputs[id] != NULL) {
+        return server->outputs[id];
+    }
+
+    screen = getScreen (server, (server->compositor != NULL) ? 0 : id);
+    if (screen == NULL) {
+        return NULL;
+    }
+    output = (struct oifOutput *) calloc (1, sizeof (*output));
+    if (output == NULL) {
         printf ("Error: Cannot allocate memory.\n");
+        return NULL;
+    }
+    output->screen = screen;
+    if (server->compositor != NULL) {
+        if (screen->format != OIF_FORMAT_BGRA) {
+            printf ("Error: The compositor needs a framebuffer with 32 bits per pixel\n");
+            free (output);
+            return NULL;
+        }
+        if (server->compositor->width == 0) {
+            oif_compositor_init (server->compositor, screen->vinfo.xres, screen->vinfo.yres,
+                                 0xFF000000);
+        }
+        output->layer = oif_compositor_get_layer (server->compositor, id);
+        if (output->layer == NULL) {
+            printf ("Error: Cannot allocate layer for id %d\n", id);
+            free (output);
+            return NULL;
+        }
+        printf ("Images with id %d are layer %d\n", id, output->layer->z);
+    }
+    server->outputs[id] = output;
+    return output;
+}
+
+
+/*
+ * Returns the hidden half of a double-buffered framebuffer,
+ * otherwise the framebuffer.
+ */
+unsigned char *
+backBuffer (
+    struct oifScreen *screen)
+{
+    if (screen->vinfo.yres_virtual > screen->vinfo.yres) {
+        return screen->frameBuffer + ((screen->vinfo.yoffset > 0) ? 0 : screen->vinfo.yres) *
+            screen->stride;
+    }
+    return screen->frameBuffer;
+}
+
+
+/*
+ * Copies the parts the hidden half of a double-buffered framebuffer
+ * misses from the visible half, before the next image is decoded
+ * into it. The image may only update a part of the screen.
+ */
+void
+updateBackBuffer (
+    struct oifScreen *screen)
+{
+    unsigned int bytesPerPixel = screen->vinfo.bits_per_pixel >> 3;
+    unsigned char *front = screen->frameBuffer + screen->vinfo.yoffset * screen->stride;
+    unsigned char *back = backBuffer (screen);
+    struct oif_rect *rect;
+    unsigned int offset;
+    unsigned int i;
+    unsigned int y;
+
+    if (screen->vinfo.yres_virtual <= screen->vinfo.yres) {
         return;
     }
+    for (i = 0; i < screen->prevDirty.numRects; i++) {
+        rect = &screen->prevDirty.rects[i];
+        for (y = rect->y; y < rect->y + rect->height; y++) {
+            offset = y * screen->stride + rect->x * bytesPerPixel;
+            memcpy (back + offset, front + offset, rect->width * bytesPerPixel);
+        }
+    }
+    screen->prevDirty.numRects = 0;
+}
 
-    while (1) {
-        connfd = accept (listenfd, (struct sockaddr*) NULL, NULL);
-        if (connfd >= 0) {
-            printf ("Connected.\n");
-
-            while (1) {
-                /* The connection is open until it is closed by a disconnect request
-                 * or if we loose connection.
-                 */
-                size = read (connfd, &header, sizeof (header));
-                if (size < 0) {
-                    printf ("Error: %s\n", strerror (errno));
+
+/*
+ * Shows the image in the hidden half of a double-buffered framebuffer.
+ */
+void
+showBackBuffer (
+    struct oifScreen *screen)
+{
+    if (screen->vinfo.yres_virtual > screen->vinfo.yres) {
+        /* Now switch to the other half of the frame */
+        screen->vinfo.yoffset = (screen->vinfo.yoffset > 0) ? 0 : screen->vinfo.yres;
+        if (ioctl (screen->fdFb, FBIOPAN_DISPLAY, &screen->vinfo) < 0) {
+            printf ("Error: %s\n", strerror (errno));
+        }
+    }
+}
+
+
+/*
+ * Composites the changed part of the layers into the framebuffer.
+ * The hidden half also misses the changes of the previous image.
+ */
+void
+composeScreen (
+    struct oifServer *server,
+    struct oifScreen *screen)
+{
+    struct oif_rect dirty = server->compositor->dirty;
+    unsigned int i;
+
+    // Composing is cheaper than copying the missing parts
+    if (screen->vinfo.yres_virtual > screen->vinfo.yres) {
+        for (i = 0; i < screen->prevDirty.numRects; i++) {
+            oif_compositor_compose (server->compositor, backBuffer (screen), screen->stride,
+                                    &screen->prevDirty.rects[i]);
+        }
+    }
+    oif_compositor_compose (server->compositor, backBuffer (screen), screen->stride, &dirty);
+    showBackBuffer (screen);
+    screen->prevDirty.numRects = 0;
+    addDamage (&screen->prevDirty, &dirty);
+}
+
+
+/*
+ * Shows the decoded images of a screen.
+ */
+void
+presentScreen (
+    struct oifServer *server,
+    struct oifScreen *screen)
+{
+    __u32 crtc = 0;
+
+    if (server->compositor != NULL) {
+        composeScreen (server, screen);
+    } else {
+        showBackBuffer (screen);
+        screen->prevDirty = screen->dirty;
+        screen->dirty.numRects = 0;
+    }
+    screen->pending = 0;
+    screen->lastShown = monotonicNs ();
+    if (server->latest && screen->vsync) {
+        /* Wait until the new half is shown, so the next image cannot be
+         * decoded into the visible half. Meanwhile newer images arrive,
+         * which replace the older ones. */
+        if (ioctl (screen->fdFb, FBIO_WAITFORVSYNC, &crtc) < 0) {
+            printf ("No vsync (%s), using a timer\n", strerror (errno));
+            screen->vsync = 0;
+        }
+    }
+}
+
+
+/*
+ * Shows the pending images with -l. Returns the time in ms until the
+ * next screen without vsync may be updated, or -1 if none is pending.
+ */
+int
+presentScreens (
+    struct oifServer *server)
+{
+    struct oifScreen *screen;
+    long long now;
+    long long wait;
+    int timeout = -1;
+    int n;
+
+    for (n = 0; n < MAX_OUTPUTS; n++) {
+        screen = server->screens[n];
+        if ((screen == NULL) || !screen->pending) {
+            continue;
+        }
+        now = monotonicNs ();
+        wait = screen->lastShown + screen->frameNs - now;
+        if (screen->vsync || (wait <= 0)) {
+            presentScreen (server, screen);
+        } else if ((timeout < 0) || (wait / 1000000 + 1 < timeout)) {
+            timeout = (int) (wait / 1000000 + 1);
+        }
+    }
+    return timeout;
+}
+
+
+/*
+ * Starts decoding the image of the client into its output.
+ */
+void
+beginImage (
+    struct oifClient *client)
+{
+    struct oifOutput *output = client->output;
+
+    output->owner = client;
+    if (output->layer != NULL) {
+        // The layer is read again for the composition, so keep it in the cache
+        oif_decoder_begin (&client->decoder, &client->header,
+                           (unsigned char *) output->layer->pixels, OIF_FLAG_DAMAGE);
+    } else {
+        /* Use double-buffering, decode into the hidden half. The pixels
+         * are converted to the format of the framebuffer while they are
+         * written. */
+        updateBackBuffer (output->screen);
+        oif_decoder_begin (&client->decoder, &client->header, backBuffer (output->screen),
+                           OIF_FLAG_NONTEMPORAL | OIF_FLAG_DAMAGE);
+        oif_decoder_set_format (&client->decoder, output->screen->format,
+                                output->screen->stride);
+    }
+}
+
+
+/*
+ * Releases the output of the client after its image, or when it
+ * disconnects. The next client waiting for the output gets it.
+ */
+void
+releaseOutput (
+    struct oifServer *server,
+    struct oifClient *client)
+{
+    struct oifOutput *output = client->output;
+    struct oifClient *next;
+
+    if ((output == NULL) || (output->owner != client)) {
+        return;
+    }
+    output->owner = NULL;
+    for (next = server->clients; next != NULL; next = next->next) {
+        if (next->waiting && (next->output == output)) {
+            next->waiting = 0;
+            next->resume = 1;
+            beginImage (next);
+            break;
+        }
+    }
+}
+
+
+/*
+ * Finds the last complete image with OIF_RES_FLAG_KEY for each id in
+ * the received data from rcvPos, which is the start of a header.
+ * keyPos[id] is its position, or 0 if there is none.
+ */
+void
+findKeyImages (
+    struct oifClient *client,
+    unsigned int rcvPos,
+    unsigned int *keyPos)
+{
+    struct oif_header header;
+
+    memset (keyPos, 0, MAX_OUTPUTS * sizeof (*keyPos));
+    while (client->rcvLen - rcvPos >= sizeof (header)) {
+        memcpy (&header, client->rcvBuffer + rcvPos, sizeof (header));
+        if ((header.magic != OIF_MAGIC) || (header.img_size == OIF_IMG_SIZE_UNKNOWN) ||
+                (client->rcvLen - rcvPos - sizeof (header) < header.img_size)) {
+            break;
+        }
+        if ((header.id >= 0) && (header.id < MAX_OUTPUTS) &&
+                (header.reserved[OIF_RES_FLAGS] & OIF_RES_FLAG_KEY)) {
+            keyPos[header.id] = rcvPos;
+        }
+        rcvPos += sizeof (header) + header.img_size;
+    }
+}
+
+
+/*
+ * Decodes the received data of a client.
+ * Returns 0, or -1 if the connection has to be closed.
+ */
+int
+processClient (
+    struct oifServer *server,
+    struct oifClient *client)
+{
+    struct oifOutput *output;
+    unsigned int keyPos[MAX_OUTPUTS];
+    int keysFound = 0;
+    unsigned int rcvPos = 0;
+    unsigned int frameSize;
+    unsigned int consumed;
+    int ret = 0;
+
+    while ((rcvPos < client->rcvLen) && !client->waiting) {
+        if (!client->headerValid) {
+            if (client->rcvLen - rcvPos < sizeof (client->header)) {
+                break;
+            }
+            memcpy (&client->header, client->rcvBuffer + rcvPos, sizeof (client->header));
+            frameSize = sizeof (client->header) + client->header.img_size;
+
+            if (server->latest && (client->header.img_size != OIF_IMG_SIZE_UNKNOWN) &&
+                    (client->header.img_size <= RCV_BUFFER_MAX - sizeof (client->header))) {
+                if (!keysFound) {
+                    findKeyImages (client, rcvPos, keyPos);
+                    keysFound = 1;
+                }
+                if ((client->header.id >= 0) && (client->header.id < MAX_OUTPUTS) &&
+                        (rcvPos < keyPos[client->header.id])) {
+                    // A later image replaces all pixels of this one
+                    rcvPos += frameSize;
+                    client->skipped++;
+                    continue;
+                }
+                if (client->rcvLen - rcvPos < frameSize) {
+                    // Wait for the complete image, a newer one may follow
                     break;
+                }
+            }
+            rcvPos += sizeof (client->header);
 
-                } else if (size == sizeof (header)) {
-                    if (header.magic == OIF_MAGIC) {
-                        // Some sanity checking
-                        size = header.img_size;
-                        if (size > bufferSize) {
-                            break;
-                        }
-                        if ((header.width != vinfo.xres) || (header.width != vinfo.yres)) {
-                            break;
-                        }
-
-                        // Receive the data
-                        currBufferPos = rcvBuffer;
-                        while (size > 0)  {
-                            sizeReceived = read (connfd, currBufferPos, size);
-                            if (size < 0) {
-                                printf ("Error: %s\n", strerror (errno));
-                            } else {
-                                size -= sizeReceived;
-                                currBufferPos += sizeReceived;
-                            }
-                        }
-                        if (size < 0) {
-                            break;
-                        }
-
-                        if (vinfo.yres_virtual > vinfo.yres) {
-                            /* Use double-buffering, toggle between upper and lower frame buffer */
-                            if (vinfo.yoffset > 0) {
-                                vinfo.yoffset = 0;
-                            } else {
-                                vinfo.yoffset = vinfo.yres;
-                            }
-                            oif_uncompress (&header, rcvBuffer, frameBuffer +
-                                            vinfo.yoffset * vinfo.xres * (vinfo.bits_per_pixel >> 3));
-
-                            /* Now switch to the other half of the frame */
-                            ret = ioctl (fdFb, FBIOPAN_DISPLAY, &vinfo);
-                            if (ret < 0) {
-                                printf ("Error: %s\n", strerror (errno));
-                            }
-                        } else {
-                            oif_uncompress (&header, rcvBuffer, frameBuffer);
-                        }
-                    }
+            // Some sanity checking
+            output = (client->header.magic == OIF_MAGIC) ?
+                getOutput (server, client->header.id) : NULL;
+            if ((output == NULL) ||
+                    (client->header.width != output->screen->vinfo.xres) ||
+                    (client->header.height != output->screen->vinfo.yres)) {
+                printf ("Error: Invalid image header\n");
+                ret = -1;
+                break;
+            }
+            if ((output->layer != NULL) &&
+                    (client->header.reserved[OIF_RES_FLAGS] & OIF_RES_FLAG_Z) &&
+                    ((int) client->header.reserved[OIF_RES_Z] != output->layer->z)) {
+                oif_compositor_set_z (server->compositor, output->layer,
+                                      (int) client->header.reserved[OIF_RES_Z]);
+            }
+            client->output = output;
+            client->headerValid = 1;
+            if ((output->owner != NULL) && (output->owner != client)) {
+                // Another client is drawing, continue when it is done
+                client->waiting = 1;
+                break;
+            }
+            beginImage (client);
+        } else {
+            // Decode the image data while it is received
+            ret = oif_decoder_feed (&client->decoder, client->rcvBuffer + rcvPos,
+                                    client->rcvLen - rcvPos, &consumed);
+            rcvPos += consumed;
+            if (ret < 0) {
+                printf ("Error: Error while uncompressing image (%d)\n", ret);
+                break;
+            }
+            if (ret == 1) {
+                // The image is complete, with -l it is shown later
+                output = client->output;
+                client->headerValid = 0;
+                if (output->layer != NULL) {
+                    oif_compositor_damage (server->compositor, &client->decoder.damage);
                 } else {
-                    printf ("Disconnected.\n");
-                    break;
+                    addDamage (&output->screen->dirty, &client->decoder.damage);
                 }
+                output->screen->pending = 1;
+                if (!server->latest) {
+                    presentScreen (server, output->screen);
+                }
+                releaseOutput (server, client);
+                ret = 0;
+            }
+        }
+    }
+
+    // Keep an incomplete header or the data after it for the next read
+    memmove (client->rcvBuffer, client->rcvBuffer + rcvPos, client->rcvLen - rcvPos);
+    client->rcvLen -= rcvPos;
+    return ret;
+}
+
+
+/*
+ * Closes the connection of a client.
+ */
+void
+closeClient (
+    struct oifServer *server,
+    struct oifClient *client)
+{
+    struct oifClient **prev;
+
+    releaseOutput (server, client);
+    for (prev = &server->clients; *prev != client; prev = &(*prev)->next) {
+    }
+    *prev = client->next;
+    if (client->skipped > 0) {
+        printf ("%llu old images skipped.\n", client->skipped);
+    }
+    close (client->fd);
+    free (client->rcvBuffer);
+    free (client);
+}
+
+
+/*
+ * Accepts all pending connections.
+ */
+void
+acceptClients (
+    struct oifServer *server)
+{
+    struct oifClient *client;
+    struct epoll_event ev;
+    int connfd;
+
+    while ((connfd = accept4 (server->listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        client = (struct oifClient *) calloc (1, sizeof (*client));
+        if (client != NULL) {
+            client->rcvBuffer = (unsigned char *) malloc (RCV_BUFFER_SIZE);
+            if (client->rcvBuffer == NULL) {
+                free (client);
+                client = NULL;
             }
         }
+        if (client == NULL) {
+            printf ("Error: Cannot allocate memory.\n");
+            close (connfd);
+            continue;
+        }
+        client->fd = connfd;
+        client->rcvSize = RCV_BUFFER_SIZE;
+        ev.events = EPOLLIN;
+        ev.data.ptr = client;
+        if (epoll_ctl (server->epollfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            printf ("Error: %s\n", strerror (errno));
+            close (connfd);
+            free (client->rcvBuffer);
+            free (client);
+            continue;
+        }
+        client->next = server->clients;
+        server->clients = client;
+        printf ("Connected.\n");
     }
 }
 
 
+/*
+ * Reads from a client. With -l everything is read that has arrived,
+ * so older images can be skipped. A waiting client is removed from
+ * the epoll set until it can continue, so the data stays in the socket.
+ * Returns 0, or -1 if the connection has to be closed.
+ */
 int
-main (void)
+readClient (
+    struct oifServer *server,
+    struct oifClient *client)
 {
-    int listenfd = 0;
-    struct sockaddr_in serv_addr;
-    int fdFb;
-    unsigned char *frameBuffer;
-    struct fb_var_screeninfo vinfo;
-    unsigned int size;
-    int ret;
+    unsigned char *buffer;
+    int closed = 0;
+    int size;
 
-    printf ("OIF Example Server\n");
+    do {
+        if (client->rcvLen == client->rcvSize) {
+            if (!server->latest || (client->rcvSize >= RCV_BUFFER_MAX)) {
+                break;
+            }
+            buffer = (unsigned char *) realloc (client->rcvBuffer, client->rcvSize * 2);
+            if (buffer == NULL) {
+                break;
+            }
+            client->rcvBuffer = buffer;
+            client->rcvSize *= 2;
+        }
+        size = read (client->fd, client->rcvBuffer + client->rcvLen,
+                     client->rcvSize - client->rcvLen);
+        if (size < 0) {
+            if ((errno == EAGAIN) || (errno == EINTR)) {
+                break;
+            }
+            printf ("Error: %s\n", strerror (errno));
+            return -1;
+        } else if (size == 0) {
+            // Show what has been received before
+            printf ("Disconnected.\n");
+            closed = 1;
+            break;
+        }
+        client->rcvLen += size;
+    } while (server->latest);
 
-    fdFb = open (FB_DEVICE, O_RDWR);
-    if (fdFb < 0) {
-        printf ("Error: Cannot open framebuffer device \"%s\" (%s)\n",
-                FB_DEVICE, strerror (errno));
+    if ((processClient (server, client) < 0) || closed) {
+        // The stream cannot be resynchronized
         return -1;
     }
-    ret = ioctl (fdFb, FBIOGET_VSCREENINFO, &vinfo);
-    if (ret < 0) {
-        printf ("Error: Cannot get framebuffer screen info (%s).\n", strerror (errno));
+    if (client->waiting) {
+        epoll_ctl (server->epollfd, EPOLL_CTL_DEL, client->fd, NULL);
     }
+    return 0;
+}
 
-    /* Map the frame buffer to user space */
-    size = vinfo.xres * vinfo.yres * sizeof (unsigned int);
-    frameBuffer = (unsigned char *) mmap (0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fdFb, 0);
-    if (frameBuffer == MAP_FAILED) {
-        close (fdFb);
-        printf ("Error: Cannot map memory for framebuffer device %s\n", FB_DEVICE);
-        return -1;
+
+/*
+ * Serves any number of producers. Only epoll_wait blocks, so the server
+ * sleeps while no data arrives.
+ */
+void
+oifServerLoop (
+    int listenfd,
+    struct oif_compositor *compositor,
+    int latest)
+{
+    struct oifServer server;
+    struct oifClient *client;
+    struct oifClient *next;
+    struct epoll_event ev;
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = -1;
+    int num;
+    int i;
+
+    memset (&server, 0, sizeof (server));
+    server.listenfd = listenfd;
+    server.compositor = compositor;
+    server.latest = latest;
+    server.epollfd = epoll_create1 (0);
+    if (server.epollfd < 0) {
+        printf ("Error: %s\n", strerror (errno));
+        return;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl (server.epollfd, EPOLL_CTL_ADD, listenfd, &ev);
+
+    while (1) {
+        num = epoll_wait (server.epollfd, events, MAX_EVENTS, timeout);
+        if (num < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf ("Error: %s\n", strerror (errno));
+            break;
+        }
+        for (i = 0; i < num; i++) {
+            client = (struct oifClient *) events[i].data.ptr;
+            if (client == NULL) {
+                acceptClients (&server);
+            } else if (readClient (&server, client) < 0) {
+                closeClient (&server, client);
+            }
+        }
+
+        // Clients that got their output while data was waiting in rcvBuffer.
+        // Processing one can resume a client before it in the list, so the
+        // list is searched again from the start until none is left.
+        for (client = server.clients; client != NULL; client = next) {
+            next = client->next;
+            if (!client->resume) {
+                continue;
+            }
+            client->resume = 0;
+            next = server.clients;
+            if (processClient (&server, client) < 0) {
+                closeClient (&server, client);
+                next = server.clients;
+                continue;
+            }
+            if (!client->waiting) {
+                ev.events = EPOLLIN;
+                ev.data.ptr = client;
+                epoll_ctl (server.epollfd, EPOLL_CTL_ADD, client->fd, &ev);
+            }
+        }
+
+        if (server.latest) {
+            timeout = presentScreens (&server);
+        }
     }
+}
+
 
-    /* Open a socket connection */
+void
+usage (
+    char *prog)
+{
+    printf ("usage: %s [-c] [-l]\n", prog);
+    printf ("  -c  composite the images of all ids as layers on %s\n", "/dev/fb0");
+    printf ("  -l  show only the latest image, once per vsync\n");
+}
+
+
+int
+main (
+    int argc,
+    char *argv[])
+{
+    int listenfd = 0;
+    struct sockaddr_in serv_addr;
+    int on = 1;
+    struct oif_compositor compositor;
+    struct oif_compositor *comp = NULL;
+    int latest = 0;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp (argv[i], "-c") == 0) {
+            // Initialized with the size of the framebuffer
+            memset (&compositor, 0, sizeof (compositor));
+            comp = &compositor;
+        } else if (strcmp (argv[i], "-l") == 0) {
+            latest = 1;
+        } else {
+            usage (argv[0]);
+            return 1;
+        }
+    }
+
+    printf ("OIF Example Server\n");
+
+    /* Open a socket connection. It is non-blocking, because all
+     * connections are accepted when epoll reports one. */
     listenfd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    setsockopt (listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
 
     memset (&serv_addr, '0', sizeof (serv_addr));
 
@@ -189,9 +948,7 @@ main (void)
         return -1;
     }
 
-    oifServerLoop (listenfd, frameBuffer, fdFb);
+    oifServerLoop (listenfd, comp, latest);
 
     return 0;
 }
-
-
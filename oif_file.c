@@ -0,0 +1,480 @@
+/*
+ * Copyright (C) 2023 by Frank Storm <frank.storm@storm-se.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "oif_file.h"
+
+/* Size of the timestamp before the header of a frame */
+#define OIF_FILE_TIMESTAMP_SIZE 8
+
+/* Frames and the index start at multiples of this size */
+#define OIF_FILE_ALIGN 8
+
+
+/*
+ * Returns != 0 if a valid image header is at offset and its image data
+ * lies within the file.
+ */
+static int
+oif_file_check_frame (
+    const struct oif_file *file,
+    unsigned long long offset)
+{
+    struct oif_header header;
+
+    if ((offset & 3) || (offset > file->size) || (file->size - offset < sizeof (header))) {
+        return 0;
+    }
+    memcpy (&header, file->map + offset, sizeof (header));
+    return (header.magic == OIF_MAGIC) && (header.img_size != OIF_IMG_SIZE_UNKNOWN) &&
+        (header.img_size <= file->size - offset - sizeof (header));
+}
+
+
+/*
+ * Returns the size of a frame of a container file, including padding.
+ */
+static unsigned long long
+oif_file_frame_size (
+    const struct oif_header *header)
+{
+    unsigned long long size = OIF_FILE_TIMESTAMP_SIZE + sizeof (*header) + header->img_size;
+
+    return (size + OIF_FILE_ALIGN - 1) & ~(unsigned long long) (OIF_FILE_ALIGN - 1);
+}
+
+
+/*
+ * Sets the index entry for the frame whose header is at offset.
+ */
+static void
+oif_file_set_entry (
+    struct oif_index_entry *entry,
+    const unsigned char *map,
+    unsigned long long offset,
+    unsigned long long timestamp)
+{
+    struct oif_header header;
+
+    memcpy (&header, map + offset, sizeof (header));
+    entry->offset = offset;
+    entry->timestamp = timestamp;
+    entry->id = header.id;
+    entry->flags = header.reserved[OIF_RES_FLAGS];
+}
+
+
+/*
+ * Rebuilds the index of a container file that was not finished from
+ * the frames. A truncated last frame is ignored.
+ */
+static int
+oif_file_scan (
+    struct oif_file *file)
+{
+    unsigned long long offset = sizeof (struct oif_file_header);
+    unsigned long long timestamp;
+    struct oif_index_entry *index;
+    struct oif_header header;
+    unsigned int max_frames = 0;
+
+    file->num_frames = 0;
+    while (oif_file_check_frame (file, offset + OIF_FILE_TIMESTAMP_SIZE)) {
+        if (file->num_frames == max_frames) {
+            max_frames = (max_frames > 0) ? max_frames * 2 : 256;
+            index = (struct oif_index_entry *) realloc (file->index,
+                                                        max_frames * sizeof (*index));
+            if (index == 0) {
+                return -1;
+            }
+            file->index = index;
+            file->own_index = 1;
+        }
+        memcpy (&timestamp, file->map + offset, sizeof (timestamp));
+        memcpy (&header, file->map + offset + OIF_FILE_TIMESTAMP_SIZE, sizeof (header));
+        oif_file_set_entry (&file->index[file->num_frames++], file->map,
+                            offset + OIF_FILE_TIMESTAMP_SIZE, timestamp);
+        offset += oif_file_frame_size (&header);
+    }
+    return 0;
+}
+
+
+/*
+ * Opens and maps an OIF file.
+ */
+int
+oif_file_open (
+    struct oif_file *file,
+    const char *path)
+{
+    struct oif_file_header file_header;
+    struct stat st;
+    unsigned long long i;
+    int fd;
+    int ret = 0;
+
+    memset (file, 0, sizeof (*file));
+    fd = open (path, O_RDONLY);
+    if (fd < 0) {
+        return OIF_ERR_IO;
+    }
+    if (fstat (fd, &st) < 0) {
+        close (fd);
+        return OIF_ERR_IO;
+    }
+    file->size = (unsigned long long) st.st_size;
+    if (file->size < sizeof (struct oif_header)) {
+        close (fd);
+        return OIF_ERR_RANGE;
+    }
+    file->map = (unsigned char *) mmap (0, file->size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (file->map == MAP_FAILED) {
+        file->map = 0;
+        return OIF_ERR_IO;
+    }
+
+    memcpy (&file_header, file->map, sizeof (file_header.magic));
+    if (file_header.magic == OIF_MAGIC) {
+        /* A single image */
+        if (!oif_file_check_frame (file, 0)) {
+            ret = OIF_ERR_RANGE;
+        } else {
+            file->index = (struct oif_index_entry *) malloc (sizeof (*file->index));
+            if (file->index == 0) {
+                ret = -1;
+            } else {
+                file->own_index = 1;
+                file->num_frames = 1;
+                oif_file_set_entry (file->index, file->map, 0, 0);
+            }
+        }
+    } else if ((file_header.magic == OIF_FILE_MAGIC) && (file->size >= sizeof (file_header))) {
+        memcpy (&file_header, file->map, sizeof (file_header));
+        if ((file_header.index_offset != 0) && (file_header.index_offset % OIF_FILE_ALIGN == 0) &&
+                (file_header.index_offset <= file->size) &&
+                ((file->size - file_header.index_offset) / sizeof (struct oif_index_entry) >=
+                 file_header.num_frames)) {
+            file->index = (struct oif_index_entry *) (file->map + file_header.index_offset);
+            file->num_frames = file_header.num_frames;
+            for (i = 0; i < file->num_frames; i++) {
+                if (!oif_file_check_frame (file, file->index[i].offset)) {
+                    break;
+                }
+            }
+            if (i < file->num_frames) {
+                file->index = 0;
+                file->num_frames = 0;
+            }
+        }
+        if (file->index == 0) {
+            /* Not finished or truncated, the frames are scanned */
+            ret = oif_file_scan (file);
+        }
+    } else {
+        ret = OIF_ERR_RANGE;
+    }
+
+    if (ret < 0) {
+        oif_file_close (file);
+    }
+    return ret;
+}
+
+
+/*
+ * Returns the header and the image data of a frame.
+ */
+int
+oif_file_frame (
+    const struct oif_file *file,
+    unsigned int n,
+    const struct oif_header **header,
+    const unsigned char **data)
+{
+    if (n >= file->num_frames) {
+        return OIF_ERR_RANGE;
+    }
+    *header = (const struct oif_header *) (file->map + file->index[n].offset);
+    *data = file->map + file->index[n].offset + sizeof (struct oif_header);
+    return 0;
+}
+
+
+/*
+ * Finds the frame for a time.
+ */
+unsigned int
+oif_file_find_time (
+    const struct oif_file *file,
+    unsigned long long timestamp)
+{
+    unsigned int low = 0;
+    unsigned int high = file->num_frames;
+    unsigned int mid;
+
+    /* The first frame with a later timestamp is searched */
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (file->index[mid].timestamp <= timestamp) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return (low > 0) ? low - 1 : 0;
+}
+
+
+/*
+ * Decodes a frame and the frames of the same id it depends on.
+ */
+int
+oif_file_decode (
+    const struct oif_file *file,
+    unsigned int n,
+    unsigned char *img_data,
+    int flags)
+{
+    struct oif_palette palette;
+    const struct oif_header *target;
+    const struct oif_header *header;
+    const unsigned char *data;
+    unsigned int first = n;
+    unsigned int i;
+    int ret;
+
+    ret = oif_file_frame (file, n, &target, &data);
+    if (ret < 0) {
+        return ret;
+    }
+    while ((first > 0) && !((file->index[first].id == target->id) &&
+                            (file->index[first].flags & OIF_RES_FLAG_KEY))) {
+        first--;
+    }
+
+    memset (&palette, 0, sizeof (palette));
+    for (i = first; i <= n; i++) {
+        ret = oif_file_frame (file, i, &header, &data);
+        if (ret < 0) {
+            return ret;
+        }
+        if ((header->id != target->id) || (header->width != target->width) ||
+                (header->height != target->height)) {
+            continue;
+        }
+        ret = oif_uncompress_palette (header, data, img_data, flags, &palette);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Unmaps the file.
+ */
+void
+oif_file_close (
+    struct oif_file *file)
+{
+    if (file->own_index) {
+        free (file->index);
+    }
+    if (file->map != 0) {
+        munmap (file->map, file->size);
+    }
+    memset (file, 0, sizeof (*file));
+}
+
+
+/*
+ * Writes size bytes, continuing after partial writes.
+ */
+static int
+oif_file_write_all (
+    int fd,
+    const void *data,
+    unsigned long long size)
+{
+    const unsigned char *pos = (const unsigned char *) data;
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = write (fd, pos, size);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return OIF_ERR_IO;
+        }
+        pos += ret;
+        size -= (unsigned long long) ret;
+    }
+    return 0;
+}
+
+
+/*
+ * Writes a .oif file.
+ */
+int
+oif_file_write_image (
+    const char *path,
+    const struct oif_header *header,
+    const unsigned char *data)
+{
+    int fd;
+    int ret;
+
+    fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return OIF_ERR_IO;
+    }
+    ret = oif_file_write_all (fd, header, sizeof (*header));
+    if (ret == 0) {
+        ret = oif_file_write_all (fd, data, header->img_size);
+    }
+    if ((close (fd) < 0) && (ret == 0)) {
+        ret = OIF_ERR_IO;
+    }
+    return ret;
+}
+
+
+/*
+ * Creates a container file, the header is completed by oif_file_finish.
+ */
+int
+oif_file_create (
+    struct oif_file_writer *wr,
+    const char *path)
+{
+    struct oif_file_header file_header;
+    int ret;
+
+    memset (wr, 0, sizeof (*wr));
+    wr->fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (wr->fd < 0) {
+        return OIF_ERR_IO;
+    }
+    memset (&file_header, 0, sizeof (file_header));
+    file_header.magic = OIF_FILE_MAGIC;
+    file_header.version = OIF_FILE_VERSION;
+    ret = oif_file_write_all (wr->fd, &file_header, sizeof (file_header));
+    if (ret < 0) {
+        close (wr->fd);
+        return ret;
+    }
+    wr->offset = sizeof (file_header);
+    return 0;
+}
+
+
+/*
+ * Appends a frame to a container file.
+ */
+int
+oif_file_append (
+    struct oif_file_writer *wr,
+    const struct oif_header *header,
+    const unsigned char *data,
+    unsigned long long timestamp)
+{
+    static const unsigned char padding[OIF_FILE_ALIGN] = { 0 };
+    struct oif_index_entry *index;
+    unsigned long long size;
+    unsigned int max_frames;
+    int ret;
+
+    if (header->img_size == OIF_IMG_SIZE_UNKNOWN) {
+        return OIF_ERR_RANGE;
+    }
+    if (wr->num_frames == wr->max_frames) {
+        max_frames = (wr->max_frames > 0) ? wr->max_frames * 2 : 256;
+        index = (struct oif_index_entry *) realloc (wr->index, max_frames * sizeof (*index));
+        if (index == 0) {
+            return -1;
+        }
+        wr->index = index;
+        wr->max_frames = max_frames;
+    }
+
+    size = oif_file_frame_size (header);
+    ret = oif_file_write_all (wr->fd, &timestamp, sizeof (timestamp));
+    if (ret == 0) {
+        ret = oif_file_write_all (wr->fd, header, sizeof (*header));
+    }
+    if (ret == 0) {
+        ret = oif_file_write_all (wr->fd, data, header->img_size);
+    }
+    if (ret == 0) {
+        ret = oif_file_write_all (wr->fd, padding,
+                                  size - OIF_FILE_TIMESTAMP_SIZE - sizeof (*header) -
+                                  header->img_size);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    index = &wr->index[wr->num_frames++];
+    index->offset = wr->offset + OIF_FILE_TIMESTAMP_SIZE;
+    index->timestamp = timestamp;
+    index->id = header->id;
+    index->flags = header->reserved[OIF_RES_FLAGS];
+    wr->offset += size;
+    return 0;
+}
+
+
+/*
+ * Writes the index and completes the header of a container file.
+ */
+int
+oif_file_finish (
+    struct oif_file_writer *wr)
+{
+    struct oif_file_header file_header;
+    int ret;
+
+    ret = oif_file_write_all (wr->fd, wr->index, wr->num_frames * sizeof (*wr->index));
+    if (ret == 0) {
+        memset (&file_header, 0, sizeof (file_header));
+        file_header.magic = OIF_FILE_MAGIC;
+        file_header.version = OIF_FILE_VERSION;
+        file_header.num_frames = wr->num_frames;
+        file_header.index_offset = wr->offset;
+        if (pwrite (wr->fd, &file_header, sizeof (file_header), 0) != sizeof (file_header)) {
+            ret = OIF_ERR_IO;
+        }
+    }
+    if ((close (wr->fd) < 0) && (ret == 0)) {
+        ret = OIF_ERR_IO;
+    }
+    free (wr->index);
+    memset (wr, 0, sizeof (*wr));
+    return ret;
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2023 by Frank Storm <frank.storm@storm-se.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ *
+ * OIF files.
+ *
+ * A .oif file contains one image: the header followed by img_size bytes
+ * of image data. A container file contains a sequence of images, e.g.
+ * an animation or a recorded session:
+ *
+ *     struct oif_file_header
+ *     for each frame:
+ *         unsigned long long timestamp
+ *         struct oif_header
+ *         img_size bytes of image data
+ *     index: num_frames x struct oif_index_entry, at index_offset
+ *
+ * All numbers are in the byte order of the host. The index is written
+ * when the file is finished. If it is missing, e.g. because the recording
+ * was interrupted, it is rebuilt from the frames when the file is opened.
+ *
+ * Both kinds of files are opened with oif_file_open. The file is mapped
+ * into memory and the images are decoded directly from the mapping:
+ *
+ *     oif_file_open (&file, "session.oifs");
+ *     n = oif_file_find_time (&file, timestamp);
+ *     oif_file_decode (&file, n, img_data, 0);
+ *     oif_file_close (&file);
+ */
+
+#ifndef OIF_FILE_H
+#define OIF_FILE_H 1
+
+#include "oif.h"
+
+#define OIF_FILE_MAGIC 0x5346494F  /* "OIFS" */
+#define OIF_FILE_VERSION 1
+
+
+/*
+ * Header of a container file.
+ */
+struct oif_file_header {
+    /* Must be OIF_FILE_MAGIC */
+    unsigned int magic;
+    unsigned short version;
+    unsigned short sub_version;
+    unsigned int num_frames;
+    unsigned int reserved0;
+    /* Byte offset of the index, 0 if the file is not finished */
+    unsigned long long index_offset;
+    unsigned long long reserved[5];
+};
+
+
+/*
+ * Entry of the frame index.
+ */
+struct oif_index_entry {
+    /* Byte offset of the struct oif_header of the frame */
+    unsigned long long offset;
+    /* Time of the frame, e.g. in us since the start of the recording */
+    unsigned long long timestamp;
+    /* id and reserved[OIF_RES_FLAGS] of the header */
+    int id;
+    unsigned int flags;
+};
+
+
+/*
+ * A mapped OIF file, see oif_file_open. The members may be read.
+ */
+struct oif_file {
+    unsigned char *map;
+    unsigned long long size;
+    /* The frames in the order of the file. A single image is one frame
+     * with timestamp 0. */
+    struct oif_index_entry *index;
+    unsigned int num_frames;
+    /* The index is allocated, not part of the mapping */
+    int own_index;
+};
+
+
+/*
+ * State of a container file that is written, see oif_file_create.
+ * The members are private.
+ */
+struct oif_file_writer {
+    int fd;
+    unsigned long long offset;
+    struct oif_index_entry *index;
+    unsigned int num_frames;
+    unsigned int max_frames;
+};
+
+
+/*
+ * Opens and maps a .oif file or a container file. The headers and the
+ * index are checked, so every frame lies within the file. If the index
+ * is missing or does not match the file, it is rebuilt from the frames.
+ * Returns 0, OIF_ERR_IO, OIF_ERR_RANGE if the file is not a valid OIF
+ * file, or -1 if there is not enough memory.
+ */
+extern int
+oif_file_open (
+    struct oif_file *file,
+    const char *path);
+
+/*
+ * Returns the header and the image data of frame n. Both point into the
+ * mapping, which is read-only. The image data may be decoded as often as
+ * needed, e.g. with oif_uncompress_trusted after oif_validate.
+ * Returns 0, or OIF_ERR_RANGE if there is no frame n.
+ */
+extern int
+oif_file_frame (
+    const struct oif_file *file,
+    unsigned int n,
+    const struct oif_header **header,
+    const unsigned char **data);
+
+/*
+ * Returns the last frame with a timestamp <= timestamp, or 0 if there is
+ * none. The timestamps must not decrease. This is a binary search in the
+ * index.
+ */
+extern unsigned int
+oif_file_find_time (
+    const struct oif_file *file,
+    unsigned long long timestamp);
+
+/*
+ * Decodes the image of frame n into img_data as it is shown after frame
+ * n. Frames that only update a part of the image are decoded starting
+ * with the last frame of the same id with OIF_RES_FLAG_KEY.
+ * flags are the same as for oif_uncompress_ex.
+ * Returns 0, OIF_ERR_RANGE if there is no frame n, or the error of the
+ * decoder.
+ */
+extern int
+oif_file_decode (
+    const struct oif_file *file,
+    unsigned int n,
+    unsigned char *img_data,
+    int flags);
+
+/*
+ * Unmaps the file.
+ */
+extern void
+oif_file_close (
+    struct oif_file *file);
+
+/*
+ * Writes a .oif file with one image.
+ * Returns 0 or OIF_ERR_IO.
+ */
+extern int
+oif_file_write_image (
+    const char *path,
+    const struct oif_header *header,
+    const unsigned char *data);
+
+/*
+ * Creates a container file.
+ * Returns 0 or OIF_ERR_IO.
+ */
+extern int
+oif_file_create (
+    struct oif_file_writer *wr,
+    const char *path);
+
+/*
+ * Appends a frame to a container file.
+ * Returns 0, OIF_ERR_IO, OIF_ERR_RANGE if img_size is OIF_IMG_SIZE_UNKNOWN,
+ * or -1 if there is not enough memory.
+ */
+extern int
+oif_file_append (
+    struct oif_file_writer *wr,
+    const struct oif_header *header,
+    const unsigned char *data,
+    unsigned long long timestamp);
+
+/*
+ * Writes the index and closes the container file.
+ * Returns 0 or OIF_ERR_IO.
+ */
+extern int
+oif_file_finish (
+    struct oif_file_writer *wr);
+
+#endif
@@ -0,0 +1,440 @@
+/*
+ * Records the OIF images sent by producers over TCP into a container
+ * file, with the time each image arrived. With -f the recorder is a
+ * proxy in front of a server, which receives the same stream.
+ *
+ * Copyright (C) 2023 by Frank Storm <frank.storm@storm-se.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "oif.h"
+#include "oif_file.h"
+
+
+#define PORT 5018
+
+#define MAX_CLIENTS 32
+
+#define RCV_BUFFER_SIZE 65536
+/* The buffer holds a complete image, larger images close the connection */
+#define RCV_BUFFER_MAX (256 * 1024 * 1024)
+
+
+/*
+ * A connected producer. The received data is kept until the image
+ * is complete and appended to the file.
+ */
+struct recClient {
+    int fd;
+    /* Connection to the server with -f, or -1 */
+    int upstream;
+    unsigned char *rcvBuffer;
+    unsigned int rcvSize;
+    unsigned int rcvLen;
+    int headerValid;
+    struct oif_header header;
+    /* For images with OIF_IMG_SIZE_UNKNOWN the end is found by decoding
+     * them, dataLen is the image data decoded so far */
+    struct oif_decoder decoder;
+    unsigned int *scratch;
+    unsigned int scratchPixels;
+    unsigned int dataLen;
+};
+
+
+static volatile sig_atomic_t stopped = 0;
+
+static void
+stop (
+    int sig)
+{
+    (void) sig;
+    stopped = 1;
+}
+
+
+static unsigned long long
+nowUs ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+
+/*
+ * Writes size bytes to a blocking socket.
+ * Returns 0, or -1 on an error.
+ */
+static int
+sendAll (
+    int fd,
+    const unsigned char *data,
+    unsigned int size)
+{
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = send (fd, data, size, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+
+/*
+ * Appends the complete images in the received data to the file.
+ * An image is stamped when it is complete, so the timestamps in the file
+ * do not decrease even if the images of several producers overlap.
+ * Returns 0, or -1 if the connection has to be closed.
+ */
+static int
+processClient (
+    struct recClient *client,
+    struct oif_file_writer *wr,
+    unsigned long long start,
+    unsigned int *numFrames)
+{
+    unsigned int rcvPos = 0;
+    unsigned int avail;
+    unsigned int consumed;
+    unsigned int pixels;
+    unsigned int *scratch;
+    int ret = 0;
+
+    while (1) {
+        if (!client->headerValid) {
+            if (client->rcvLen - rcvPos < sizeof (client->header)) {
+                break;
+            }
+            memcpy (&client->header, client->rcvBuffer + rcvPos, sizeof (client->header));
+            if ((client->header.magic != OIF_MAGIC) || ((client->header.img_size !=
+                    OIF_IMG_SIZE_UNKNOWN) && (client->header.img_size >
+                    RCV_BUFFER_MAX - sizeof (client->header)))) {
+                fprintf (stderr, "Error: Invalid image header\n");
+                ret = -1;
+                break;
+            }
+            client->headerValid = 1;
+            client->dataLen = 0;
+            if (client->header.img_size == OIF_IMG_SIZE_UNKNOWN) {
+                pixels = client->header.width * client->header.height;
+                if ((client->header.height != 0) &&
+                        (pixels / client->header.height != client->header.width)) {
+                    ret = -1;
+                    break;
+                }
+                if (pixels > client->scratchPixels) {
+                    scratch = (unsigned int *) realloc (client->scratch,
+                                                        pixels * sizeof (*scratch));
+                    if (scratch == NULL) {
+                        fprintf (stderr, "Error: Cannot allocate memory\n");
+                        ret = -1;
+                        break;
+                    }
+                    client->scratch = scratch;
+                    client->scratchPixels = pixels;
+                }
+                oif_decoder_begin (&client->decoder, &client->header,
+                                   (unsigned char *) client->scratch, 0);
+            }
+        }
+
+        avail = client->rcvLen - rcvPos - sizeof (client->header);
+        if (client->header.img_size == OIF_IMG_SIZE_UNKNOWN) {
+            /* The data stays in the buffer until the EOI code is found */
+            ret = oif_decoder_feed (&client->decoder, client->rcvBuffer + rcvPos +
+                                    sizeof (client->header) + client->dataLen,
+                                    avail - client->dataLen, &consumed);
+            client->dataLen += consumed;
+            if (ret < 0) {
+                fprintf (stderr, "Error: Invalid image data (%d)\n", ret);
+                break;
+            }
+            if (ret == 0) {
+                break;
+            }
+            /* The recording has the actual size */
+            client->header.img_size = client->dataLen;
+        } else if (avail < client->header.img_size) {
+            break;
+        }
+
+        ret = oif_file_append (wr, &client->header,
+                               client->rcvBuffer + rcvPos + sizeof (client->header),
+                               nowUs () - start);
+        if (ret < 0) {
+            fprintf (stderr, "Error: Cannot write the recording (%d)\n", ret);
+            stopped = 1;
+            break;
+        }
+        (*numFrames)++;
+        rcvPos += sizeof (client->header) + client->header.img_size;
+        client->headerValid = 0;
+    }
+
+    memmove (client->rcvBuffer, client->rcvBuffer + rcvPos, client->rcvLen - rcvPos);
+    client->rcvLen -= rcvPos;
+    return ret;
+}
+
+
+/*
+ * Reads from a client and forwards the data to the server.
+ * Returns 0, or -1 if the connection has to be closed.
+ */
+static int
+readClient (
+    struct recClient *client,
+    struct oif_file_writer *wr,
+    unsigned long long start,
+    unsigned int *numFrames)
+{
+    unsigned char *buffer;
+    int size;
+
+    if (client->rcvLen == client->rcvSize) {
+        if (client->rcvSize >= RCV_BUFFER_MAX) {
+            fprintf (stderr, "Error: Image too large\n");
+            return -1;
+        }
+        buffer = (unsigned char *) realloc (client->rcvBuffer, client->rcvSize * 2);
+        if (buffer == NULL) {
+            fprintf (stderr, "Error: Cannot allocate memory\n");
+            return -1;
+        }
+        client->rcvBuffer = buffer;
+        client->rcvSize *= 2;
+    }
+    size = read (client->fd, client->rcvBuffer + client->rcvLen,
+                 client->rcvSize - client->rcvLen);
+    if (size < 0) {
+        return (errno == EINTR) ? 0 : -1;
+    } else if (size == 0) {
+        printf ("Disconnected.\n");
+        return -1;
+    }
+    if ((client->upstream >= 0) &&
+            (sendAll (client->upstream, client->rcvBuffer + client->rcvLen, size) < 0)) {
+        fprintf (stderr, "Error: Cannot forward to the server (%s)\n", strerror (errno));
+        return -1;
+    }
+    client->rcvLen += size;
+    return processClient (client, wr, start, numFrames);
+}
+
+
+static void
+closeClient (
+    struct recClient *client)
+{
+    close (client->fd);
+    if (client->upstream >= 0) {
+        close (client->upstream);
+    }
+    free (client->rcvBuffer);
+    free (client->scratch);
+    free (client);
+}
+
+
+static void
+usage ()
+{
+    printf ("Usage: oif_record [-h] [-p <port>] [-f <ip-addr>[:<port>]] [-n <frames>] <file>\n");
+    printf ("\n");
+    printf ("Arguments:\n");
+    printf ("    -h                       Display this text\n");
+    printf ("    -p <port>                Port to listen on, default %d\n", PORT);
+    printf ("    -f <ip-addr>[:<port>]    Forward the stream to this server\n");
+    printf ("    -n <frames>              Stop after this number of images\n");
+    printf ("\n");
+    printf ("Records the images of all producers that connect into a container file\n");
+    printf ("(see oif_file.h), with the time in us since the start as timestamp.\n");
+    printf ("The recording stops with Ctrl-C. It can be sent again with oif_replay.\n");
+}
+
+
+int
+main (
+    int argc,
+    char *argv[])
+{
+    struct recClient *clients[MAX_CLIENTS];
+    struct pollfd fds[MAX_CLIENTS + 1];
+    struct recClient *client;
+    struct oif_file_writer wr;
+    struct sockaddr_in serv_addr;
+    struct sockaddr_in fwd_addr;
+    struct sigaction sa;
+    const char *fileName = 0;
+    char *colon;
+    unsigned long long start;
+    unsigned int numFrames = 0;
+    unsigned int maxFrames = 0;
+    unsigned int numClients = 0;
+    int forward = 0;
+    int port = PORT;
+    int listenfd;
+    int connfd;
+    int on = 1;
+    unsigned int i;
+    int k;
+
+    memset (&fwd_addr, 0, sizeof (fwd_addr));
+    for (k = 1; k < argc; k++) {
+        if ((strcmp (argv[k], "-h") == 0) || (strcmp (argv[k], "--help") == 0)) {
+            usage ();
+            return 0;
+        } else if ((k + 1 < argc) && (strcmp (argv[k], "-p") == 0)) {
+            port = atoi (argv[++k]);
+        } else if ((k + 1 < argc) && (strcmp (argv[k], "-f") == 0)) {
+            k++;
+            fwd_addr.sin_family = AF_INET;
+            fwd_addr.sin_port = htons (PORT);
+            colon = strchr (argv[k], ':');
+            if (colon != NULL) {
+                *colon = 0;
+                fwd_addr.sin_port = htons (atoi (colon + 1));
+            }
+            fwd_addr.sin_addr.s_addr = inet_addr (argv[k]);
+            forward = 1;
+        } else if ((k + 1 < argc) && (strcmp (argv[k], "-n") == 0)) {
+            maxFrames = atoi (argv[++k]);
+        } else if ((argv[k][0] != '-') && (fileName == 0)) {
+            fileName = argv[k];
+        } else {
+            usage ();
+            return 1;
+        }
+    }
+    if (fileName == 0) {
+        usage ();
+        return 1;
+    }
+
+    listenfd = socket (AF_INET, SOCK_STREAM, 0);
+    setsockopt (listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+    memset (&serv_addr, 0, sizeof (serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl (INADDR_ANY);
+    serv_addr.sin_port = htons (port);
+    if ((bind (listenfd, (struct sockaddr *) &serv_addr, sizeof (serv_addr)) < 0) ||
+            (listen (listenfd, 10) < 0)) {
+        fprintf (stderr, "Error: Cannot listen on port %d (%s)\n", port, strerror (errno));
+        return 1;
+    }
+
+    if (oif_file_create (&wr, fileName) < 0) {
+        fprintf (stderr, "Error: Cannot create %s\n", fileName);
+        return 1;
+    }
+
+    /* Ctrl-C interrupts poll, the index is written before exiting */
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = stop;
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGTERM, &sa, NULL);
+
+    printf ("Recording to %s, waiting for producers on port %d\n", fileName, port);
+    start = nowUs ();
+    while (!stopped && ((maxFrames == 0) || (numFrames < maxFrames))) {
+        fds[0].fd = listenfd;
+        fds[0].events = (numClients < MAX_CLIENTS) ? POLLIN : 0;
+        for (i = 0; i < numClients; i++) {
+            fds[i + 1].fd = clients[i]->fd;
+            fds[i + 1].events = POLLIN;
+        }
+        if (poll (fds, numClients + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf (stderr, "Error: %s\n", strerror (errno));
+            break;
+        }
+
+        for (i = numClients; i > 0; i--) {
+            if (fds[i].revents && (readClient (clients[i - 1], &wr, start, &numFrames) < 0)) {
+                closeClient (clients[i - 1]);
+                clients[i - 1] = clients[--numClients];
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            connfd = accept (listenfd, NULL, NULL);
+            if (connfd < 0) {
+                continue;
+            }
+            client = (struct recClient *) calloc (1, sizeof (*client));
+            if (client != NULL) {
+                client->rcvBuffer = (unsigned char *) malloc (RCV_BUFFER_SIZE);
+                client->rcvSize = RCV_BUFFER_SIZE;
+            }
+            if ((client == NULL) || (client->rcvBuffer == NULL)) {
+                fprintf (stderr, "Error: Cannot allocate memory\n");
+                free (client);
+                close (connfd);
+                continue;
+            }
+            client->fd = connfd;
+            client->upstream = -1;
+            if (forward) {
+                client->upstream = socket (AF_INET, SOCK_STREAM, 0);
+                setsockopt (client->upstream, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+                if (connect (client->upstream, (struct sockaddr *) &fwd_addr,
+                             sizeof (fwd_addr)) < 0) {
+                    fprintf (stderr, "Error: Cannot connect to the server (%s)\n",
+                             strerror (errno));
+                    closeClient (client);
+                    continue;
+                }
+            }
+            clients[numClients++] = client;
+            printf ("Connected.\n");
+        }
+    }
+
+    for (i = 0; i < numClients; i++) {
+        closeClient (clients[i]);
+    }
+    close (listenfd);
+    if (oif_file_finish (&wr) < 0) {
+        fprintf (stderr, "Error: Cannot write the index of %s\n", fileName);
+        return 1;
+    }
+    printf ("%u images recorded in %.1f s.\n", numFrames, (nowUs () - start) * 1e-6);
+    return 0;
+}
@@ -0,0 +1,308 @@
+/*
+ * Sends a recording of oif_record to a server, at the original timing,
+ * faster, or as fast as possible, over several parallel connections,
+ * and reports the throughput.
+ *
+ * Copyright (C) 2023 by Frank Storm <frank.storm@storm-se.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "oif.h"
+#include "oif_file.h"
+
+
+#define PORT 5018
+
+#define MAX_CONNECTIONS 256
+
+
+/*
+ * A connection to the server, each one sends the whole recording.
+ */
+struct connection {
+    pthread_t thread;
+    int fd;
+    const struct oif_file *file;
+    /* Replay speed, 0 = as fast as possible */
+    double speed;
+    unsigned int loops;
+    /* Time of the first frame, in ns of CLOCK_MONOTONIC */
+    long long start;
+    /* Statistics */
+    unsigned long long frames;
+    unsigned long long bytes;
+    /* How late the frames were sent compared to the recording */
+    long long lateSum;
+    long long lateMax;
+    /* Time the server closed the connection after all data */
+    long long end;
+    int error;
+};
+
+
+static long long
+nowNs ()
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/*
+ * Sends the recording over one connection. The frames are sent
+ * directly from the mapped file, header and image data are contiguous.
+ * A frame with an earlier timestamp than the frame before it is sent
+ * right after that frame.
+ */
+static void *
+replay (
+    void *arg)
+{
+    struct connection *conn = (struct connection *) arg;
+    const struct oif_file *file = conn->file;
+    const struct oif_index_entry *index = file->index;
+    unsigned long long first = index[0].timestamp;
+    unsigned long long last = first;
+    unsigned long long timestamp;
+    unsigned long long period = 0;
+    const struct oif_header *header;
+    const unsigned char *data;
+    struct timespec ts;
+    unsigned int size;
+    unsigned int loop;
+    unsigned int n;
+    long long due;
+    long long late;
+    char buffer[256];
+    ssize_t ret;
+
+    /* The next loop starts one average frame interval after the last frame */
+    for (n = 1; n < file->num_frames; n++) {
+        if (index[n].timestamp > last) {
+            last = index[n].timestamp;
+        }
+    }
+    if (file->num_frames > 1) {
+        period = (last - first) * file->num_frames / (file->num_frames - 1);
+    }
+
+    for (loop = 0; loop < conn->loops; loop++) {
+        timestamp = first;
+        for (n = 0; n < file->num_frames; n++) {
+            if (index[n].timestamp > timestamp) {
+                timestamp = index[n].timestamp;
+            }
+            if (conn->speed > 0) {
+                due = conn->start + (long long) ((loop * period + timestamp - first) *
+                                                 1000.0 / conn->speed);
+                ts.tv_sec = due / 1000000000LL;
+                ts.tv_nsec = due % 1000000000LL;
+                while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+                }
+                late = nowNs () - due;
+                conn->lateSum += late;
+                if (late > conn->lateMax) {
+                    conn->lateMax = late;
+                }
+            }
+
+            oif_file_frame (file, n, &header, &data);
+            /* The header is followed by the image data */
+            data = file->map + index[n].offset;
+            size = sizeof (*header) + header->img_size;
+            while (size > 0) {
+                ret = send (conn->fd, data, size, MSG_NOSIGNAL);
+                if (ret < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    conn->error = errno;
+                    conn->end = nowNs ();
+                    return NULL;
+                }
+                data += ret;
+                size -= ret;
+                conn->bytes += ret;
+            }
+            conn->frames++;
+        }
+    }
+
+    /* The data may still be in the socket buffers, the server closes the
+     * connection when it has processed all of it */
+    shutdown (conn->fd, SHUT_WR);
+    while (((ret = read (conn->fd, buffer, sizeof (buffer))) > 0) ||
+           ((ret < 0) && (errno == EINTR))) {
+    }
+    conn->end = nowNs ();
+    return NULL;
+}
+
+
+static void
+usage ()
+{
+    printf ("Usage: oif_replay [-h] [-c <connections>] [-s <speed>] [-l <loops>]\n");
+    printf ("                  <ip-addr>[:<port>] <file>\n");
+    printf ("\n");
+    printf ("Arguments:\n");
+    printf ("    -h                 Display this text\n");
+    printf ("    -c <connections>   Number of parallel connections, default 1\n");
+    printf ("    -s <speed>         Factor of the recorded speed, default 1,\n");
+    printf ("                       0 sends as fast as possible\n");
+    printf ("    -l <loops>         Number of times the recording is sent, default 1\n");
+    printf ("\n");
+    printf ("Each connection sends all images of the file, a recording of oif_record\n");
+    printf ("or a single .oif file. The throughput is measured until the server has\n");
+    printf ("closed all connections after the end of the data. The default port is %d.\n", PORT);
+}
+
+
+int
+main (
+    int argc,
+    char *argv[])
+{
+    static struct connection conns[MAX_CONNECTIONS];
+    struct sockaddr_in serv_addr;
+    struct oif_file file;
+    const char *address = 0;
+    const char *fileName = 0;
+    char *colon;
+    unsigned int numConns = 1;
+    unsigned int loops = 1;
+    double speed = 1.0;
+    unsigned long long frames = 0;
+    unsigned long long bytes = 0;
+    long long lateSum = 0;
+    long long lateMax = 0;
+    long long start;
+    long long end = 0;
+    double elapsed;
+    int failed = 0;
+    int on = 1;
+    unsigned int i;
+    int k;
+    int ret;
+
+    memset (&serv_addr, 0, sizeof (serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons (PORT);
+    for (k = 1; k < argc; k++) {
+        if ((strcmp (argv[k], "-h") == 0) || (strcmp (argv[k], "--help") == 0)) {
+            usage ();
+            return 0;
+        } else if ((k + 1 < argc) && (strcmp (argv[k], "-c") == 0)) {
+            numConns = atoi (argv[++k]);
+        } else if ((k + 1 < argc) && (strcmp (argv[k], "-s") == 0)) {
+            speed = atof (argv[++k]);
+        } else if ((k + 1 < argc) && (strcmp (argv[k], "-l") == 0)) {
+            loops = atoi (argv[++k]);
+        } else if ((argv[k][0] != '-') && (address == 0)) {
+            colon = strchr (argv[k], ':');
+            if (colon != NULL) {
+                *colon = 0;
+                serv_addr.sin_port = htons (atoi (colon + 1));
+            }
+            address = argv[k];
+        } else if ((argv[k][0] != '-') && (fileName == 0)) {
+            fileName = argv[k];
+        } else {
+            usage ();
+            return 1;
+        }
+    }
+    if ((fileName == 0) || (numConns < 1) || (numConns > MAX_CONNECTIONS) ||
+            (loops < 1) || (speed < 0)) {
+        usage ();
+        return 1;
+    }
+    serv_addr.sin_addr.s_addr = inet_addr (address);
+
+    ret = oif_file_open (&file, fileName);
+    if (ret < 0) {
+        fprintf (stderr, "Error: Cannot open %s (%d)\n", fileName, ret);
+        return 1;
+    }
+    if (file.num_frames == 0) {
+        fprintf (stderr, "Error: %s contains no images\n", fileName);
+        oif_file_close (&file);
+        return 1;
+    }
+
+    for (i = 0; i < numConns; i++) {
+        conns[i].fd = socket (AF_INET, SOCK_STREAM, 0);
+        if ((conns[i].fd < 0) ||
+                (connect (conns[i].fd, (struct sockaddr *) &serv_addr, sizeof (serv_addr)) < 0)) {
+            fprintf (stderr, "Error: Connect failed (%s)\n", strerror (errno));
+            return 1;
+        }
+        setsockopt (conns[i].fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+        conns[i].file = &file;
+        conns[i].speed = speed;
+        conns[i].loops = loops;
+    }
+
+    printf ("Sending %u images %u times over %u connections\n", file.num_frames, loops, numConns);
+    start = nowNs ();
+    for (i = 0; i < numConns; i++) {
+        conns[i].start = start;
+        if (pthread_create (&conns[i].thread, NULL, replay, &conns[i]) != 0) {
+            fprintf (stderr, "Error: Cannot create thread\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < numConns; i++) {
+        pthread_join (conns[i].thread, NULL);
+        close (conns[i].fd);
+        if (conns[i].error != 0) {
+            fprintf (stderr, "Error: Connection %u: %s\n", i, strerror (conns[i].error));
+            failed = 1;
+        }
+        frames += conns[i].frames;
+        bytes += conns[i].bytes;
+        lateSum += conns[i].lateSum;
+        if (conns[i].lateMax > lateMax) {
+            lateMax = conns[i].lateMax;
+        }
+        if (conns[i].end > end) {
+            end = conns[i].end;
+        }
+    }
+    elapsed = (end - start) * 1e-9;
+    oif_file_close (&file);
+
+    printf ("%llu images, %.1f MB in %.3f s\n", frames, bytes * 1e-6, elapsed);
+    printf ("%.1f images/s, %.1f MB/s\n", frames / elapsed, bytes * 1e-6 / elapsed);
+    if ((speed > 0) && (frames > 0)) {
+        printf ("Sent late by %.2f ms on average, %.2f ms at most\n",
+                lateSum * 1e-6 / frames, lateMax * 1e-6);
+    }
+    return failed;
+}
@@ -0,0 +1,401 @@
+/*
+ * Copyright (C) 2023 by Frank Storm <frank.storm@storm-se.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+
+#include "oif_send.h"
+
+/* States of a buffer */
+#define OIF_SEND_FREE 0
+#define OIF_SEND_PRODUCER 1
+#define OIF_SEND_QUEUED 2
+#define OIF_SEND_KERNEL 3
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define OIF_HAVE_ZEROCOPY 1
+#endif
+
+
+/*
+ * Initializes the sender and allocates the buffers.
+ */
+int
+oif_sender_init (
+    struct oif_sender *snd,
+    int fd,
+    unsigned int num_buffers,
+    unsigned int buffer_size,
+    int flags)
+{
+    unsigned int i;
+    int on = 1;
+
+    if ((num_buffers == 0) || (num_buffers > OIF_SEND_MAX_BUFFERS)) {
+        return OIF_ERR_RANGE;
+    }
+
+    memset (snd, 0, sizeof (*snd));
+    snd->fd = fd;
+    snd->num_buffers = num_buffers;
+    snd->buffer_size = buffer_size;
+    for (i = 0; i < num_buffers; i++) {
+        snd->buffers[i].data = (unsigned char *) malloc (buffer_size);
+        if (snd->buffers[i].data == 0) {
+            oif_sender_destroy (snd);
+            return -1;
+        }
+    }
+
+    /* The frames are sent with one call each, so there is nothing to
+     * collect. Without Nagle the end of a frame is sent immediately. */
+    if (flags & OIF_SEND_NODELAY) {
+        setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+    }
+#ifdef OIF_HAVE_ZEROCOPY
+    if ((flags & OIF_SEND_ZEROCOPY) &&
+            (setsockopt (fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof (on)) < 0)) {
+        flags &= ~OIF_SEND_ZEROCOPY;
+    }
+#else
+    flags &= ~OIF_SEND_ZEROCOPY;
+#endif
+    snd->flags = flags;
+    return 0;
+}
+
+
+#ifdef OIF_HAVE_ZEROCOPY
+/*
+ * Marks the zero-copy sends first to last as completed. A buffer is
+ * free when all sends with its data are completed.
+ */
+static void
+oif_sender_complete (
+    struct oif_sender *snd,
+    unsigned int first,
+    unsigned int last)
+{
+    struct oif_send_buffer *buf;
+    unsigned int lo;
+    unsigned int hi;
+    unsigned int i;
+
+    for (i = 0; i < snd->num_buffers; i++) {
+        buf = snd->buffers + i;
+        if ((buf->state != OIF_SEND_KERNEL) || (buf->zc_pending == 0)) {
+            continue;
+        }
+        lo = (first > buf->zc_first) ? first : buf->zc_first;
+        hi = (last < buf->zc_last) ? last : buf->zc_last;
+        if (lo > hi) {
+            continue;
+        }
+        /* The kernel completes the sends in order, so the range
+         * is cut from the front */
+        if ((lo == buf->zc_first) && (hi == buf->zc_last)) {
+            buf->zc_pending = 0;
+        } else if (lo == buf->zc_first) {
+            buf->zc_first = hi + 1;
+        } else if (hi == buf->zc_last) {
+            buf->zc_last = lo - 1;
+        }
+        /* The first queued buffer may still have data to send */
+        if ((buf->zc_pending == 0) &&
+                ((snd->queue_count == 0) || (snd->queue[snd->queue_head] != buf))) {
+            buf->state = OIF_SEND_FREE;
+        }
+    }
+}
+
+
+/*
+ * Reads the zero-copy notifications from the error queue.
+ */
+static int
+oif_sender_completions (
+    struct oif_sender *snd)
+{
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct sock_extended_err *serr;
+    char control[256];
+
+    for (;;) {
+        memset (&msg, 0, sizeof (msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof (control);
+        if (recvmsg (snd->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                return 0;
+            }
+            return OIF_ERR_IO;
+        }
+        for (cmsg = CMSG_FIRSTHDR (&msg); cmsg != 0; cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+            if (!(((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_RECVERR)) ||
+                    ((cmsg->cmsg_level == SOL_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR)))) {
+                continue;
+            }
+            serr = (struct sock_extended_err *) CMSG_DATA (cmsg);
+            if ((serr->ee_errno != 0) || (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)) {
+                continue;
+            }
+            /* The kernel copied the data, e.g. on loopback */
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                snd->zc_copied += serr->ee_data - serr->ee_info + 1;
+            }
+            oif_sender_complete (snd, serr->ee_info, serr->ee_data);
+        }
+    }
+}
+#endif
+
+
+/*
+ * Returns a free buffer of the pool.
+ */
+struct oif_send_buffer *
+oif_sender_get_buffer (
+    struct oif_sender *snd)
+{
+    unsigned int i;
+
+#ifdef OIF_HAVE_ZEROCOPY
+    if (snd->flags & OIF_SEND_ZEROCOPY) {
+        oif_sender_completions (snd);
+    }
+#endif
+    for (i = 0; i < snd->num_buffers; i++) {
+        if (snd->buffers[i].state == OIF_SEND_FREE) {
+            snd->buffers[i].state = OIF_SEND_PRODUCER;
+            return snd->buffers + i;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Returns an unused buffer to the pool.
+ */
+void
+oif_sender_release (
+    struct oif_sender *snd,
+    struct oif_send_buffer *buf)
+{
+    (void) snd;
+    buf->state = OIF_SEND_FREE;
+}
+
+
+/*
+ * Queues a buffer and sends as much as possible.
+ */
+int
+oif_sender_queue (
+    struct oif_sender *snd,
+    struct oif_send_buffer *buf)
+{
+    if (buf->header.img_size > snd->buffer_size) {
+        return OIF_ERR_RANGE;
+    }
+    buf->state = OIF_SEND_QUEUED;
+    snd->queue[(snd->queue_head + snd->queue_count) % OIF_SEND_MAX_BUFFERS] = buf;
+    snd->queue_count++;
+    return oif_sender_flush (snd);
+}
+
+
+/*
+ * Sends the queued frames, all of them with one sendmsg call if the
+ * socket takes them. After a partial write the next call continues
+ * at snd->sent bytes of the first frame.
+ */
+int
+oif_sender_flush (
+    struct oif_sender *snd)
+{
+    struct iovec iov[2 * OIF_SEND_MAX_BUFFERS];
+    struct msghdr msg;
+    struct oif_send_buffer *buf;
+    unsigned int num_iov;
+    unsigned int offset;
+    unsigned int frame_size;
+    unsigned int i;
+    ssize_t size;
+    int send_flags;
+    int zerocopy;
+
+#ifdef OIF_HAVE_ZEROCOPY
+    if ((snd->flags & OIF_SEND_ZEROCOPY) && (oif_sender_completions (snd) < 0)) {
+        return OIF_ERR_IO;
+    }
+#endif
+
+    while (snd->queue_count > 0) {
+        /* Header and data of all queued frames */
+        num_iov = 0;
+        offset = snd->sent;
+        for (i = 0; i < snd->queue_count; i++) {
+            buf = snd->queue[(snd->queue_head + i) % OIF_SEND_MAX_BUFFERS];
+            if (offset < sizeof (buf->header)) {
+                iov[num_iov].iov_base = (unsigned char *) &buf->header + offset;
+                iov[num_iov].iov_len = sizeof (buf->header) - offset;
+                num_iov++;
+                offset = 0;
+            } else {
+                offset -= sizeof (buf->header);
+            }
+            if (offset < buf->header.img_size) {
+                iov[num_iov].iov_base = buf->data + offset;
+                iov[num_iov].iov_len = buf->header.img_size - offset;
+                num_iov++;
+            }
+            offset = 0;
+        }
+
+        memset (&msg, 0, sizeof (msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = num_iov;
+        send_flags = MSG_NOSIGNAL;
+        zerocopy = 0;
+#ifdef OIF_HAVE_ZEROCOPY
+        if (snd->flags & OIF_SEND_ZEROCOPY) {
+            send_flags |= MSG_ZEROCOPY;
+            zerocopy = 1;
+        }
+#endif
+        size = sendmsg (snd->fd, &msg, send_flags);
+        if ((size < 0) && zerocopy && (errno == ENOBUFS)) {
+            /* Out of memory for pinned pages, copy this time */
+            zerocopy = 0;
+            size = sendmsg (snd->fd, &msg, MSG_NOSIGNAL);
+        }
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                return 0;
+            }
+            return OIF_ERR_IO;
+        }
+        snd->send_calls++;
+        snd->bytes_sent += size;
+
+        /* Advance, the buffers with data in this send are
+         * free when the kernel has completed it */
+        while (snd->queue_count > 0) {
+            buf = snd->queue[snd->queue_head];
+            if (zerocopy) {
+                if (buf->zc_pending == 0) {
+                    buf->zc_first = snd->zc_next;
+                    buf->zc_pending = 1;
+                }
+                buf->zc_last = snd->zc_next;
+                buf->state = OIF_SEND_KERNEL;
+            }
+            frame_size = sizeof (buf->header) + buf->header.img_size;
+            if ((size_t) size < frame_size - snd->sent) {
+                snd->sent += (unsigned int) size;
+                break;
+            }
+            size -= frame_size - snd->sent;
+            snd->sent = 0;
+            snd->queue_head = (snd->queue_head + 1) % OIF_SEND_MAX_BUFFERS;
+            snd->queue_count--;
+            snd->frames_sent++;
+            if (buf->zc_pending == 0) {
+                buf->state = OIF_SEND_FREE;
+            }
+            if (size == 0) {
+                break;
+            }
+        }
+        if (zerocopy) {
+            snd->zc_next++;
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Returns the poll events of the sender.
+ */
+short
+oif_sender_events (
+    struct oif_sender *snd)
+{
+    return (snd->queue_count > 0) ? POLLOUT : 0;
+}
+
+
+/*
+ * Waits until the socket is writable or a completion arrives.
+ */
+int
+oif_sender_wait (
+    struct oif_sender *snd,
+    int timeout)
+{
+    struct pollfd pfd;
+    unsigned int i;
+
+    /* Nothing to wait for */
+    for (i = 0; (i < snd->num_buffers) && (snd->buffers[i].state != OIF_SEND_KERNEL); i++) {
+    }
+    if ((snd->queue_count == 0) && (i == snd->num_buffers)) {
+        return 1;
+    }
+
+    pfd.fd = snd->fd;
+    pfd.events = oif_sender_events (snd);
+    pfd.revents = 0;
+    if ((poll (&pfd, 1, timeout) < 0) && (errno != EINTR)) {
+        return OIF_ERR_IO;
+    }
+    return oif_sender_flush (snd);
+}
+
+
+/*
+ * Frees the buffers of the pool.
+ */
+void
+oif_sender_destroy (
+    struct oif_sender *snd)
+{
+    unsigned int i;
+
+    for (i = 0; i < snd->num_buffers; i++) {
+        free (snd->buffers[i].data);
+        snd->buffers[i].data = 0;
+    }
+    snd->queue_count = 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2023 by Frank Storm <frank.storm@storm-se.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL
+ * THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING
+ * FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF
+ * CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ *
+ *
+ * Sender for OIF images over a stream socket.
+ *
+ * The images are encoded directly into buffers of a pool, which is
+ * allocated once, and sent from there without copying:
+ *
+ *     oif_sender_init (&snd, fd, 4, buffer_size, OIF_SEND_NODELAY);
+ *     for each image:
+ *         buf = oif_sender_get_buffer (&snd);
+ *         if (buf == 0)
+ *             oif_sender_wait (&snd, -1), try again
+ *         oif_compress (&buf->header, img_data, buf->data);
+ *         oif_sender_queue (&snd, buf);
+ *     oif_sender_destroy (&snd);
+ *
+ * Header and image data of a frame are sent with one sendmsg call, which
+ * also takes the following queued frames. The socket may be non-blocking,
+ * a partial write is continued by the next oif_sender_flush, e.g. when
+ * poll reports POLLOUT (see oif_sender_events).
+ *
+ * With OIF_SEND_ZEROCOPY, MSG_ZEROCOPY is used if the kernel supports it.
+ * The kernel then sends from the buffer itself, the buffer is free again
+ * when the completion notification has been read from the error queue.
+ * This pays off for large frames, small frames are better copied.
+ */
+
+#ifndef OIF_SEND_H
+#define OIF_SEND_H 1
+
+#include "oif.h"
+
+/* Flags for oif_sender_init */
+#define OIF_SEND_NODELAY 0x0001
+#define OIF_SEND_ZEROCOPY 0x0002
+
+/* Maximum number of buffers in the pool */
+#define OIF_SEND_MAX_BUFFERS 32
+
+
+/*
+ * A buffer of the pool. header and data are set by the producer,
+ * data has buffer_size bytes, header.img_size is the number of bytes sent.
+ */
+struct oif_send_buffer {
+    struct oif_header header;
+    unsigned char *data;
+    /* Private to the sender */
+    int state;
+    /* Sequence numbers of the zero-copy sends with data of this buffer
+     * that are not completed yet, if zc_pending != 0 */
+    unsigned int zc_first;
+    unsigned int zc_last;
+    int zc_pending;
+};
+
+
+/*
+ * State of the sender, see oif_sender_init.
+ * The members are private to the sender, except the statistics.
+ */
+struct oif_sender {
+    int fd;
+    int flags;
+    struct oif_send_buffer buffers[OIF_SEND_MAX_BUFFERS];
+    unsigned int num_buffers;
+    unsigned int buffer_size;
+    /* Queued buffers in the order of sending */
+    struct oif_send_buffer *queue[OIF_SEND_MAX_BUFFERS];
+    unsigned int queue_head;
+    unsigned int queue_count;
+    /* Bytes of the first queued frame already sent */
+    unsigned int sent;
+    /* Sequence number of the next zero-copy send */
+    unsigned int zc_next;
+    /* Statistics */
+    unsigned long long bytes_sent;
+    unsigned long long frames_sent;
+    unsigned long long send_calls;
+    /* Zero-copy sends the kernel had to copy anyway */
+    unsigned long long zc_copied;
+};
+
+
+/*
+ * Initializes the sender for the connected socket fd with a pool of
+ * num_buffers buffers of buffer_size bytes each. flags is a combination
+ * of OIF_SEND_NODELAY (set TCP_NODELAY) and OIF_SEND_ZEROCOPY.
+ * OIF_SEND_ZEROCOPY is cleared in snd->flags if the kernel does not
+ * support it.
+ * Returns 0, OIF_ERR_RANGE for more than OIF_SEND_MAX_BUFFERS buffers,
+ * or -1 if there is not enough memory.
+ */
+extern int
+oif_sender_init (
+    struct oif_sender *snd,
+    int fd,
+    unsigned int num_buffers,
+    unsigned int buffer_size,
+    int flags);
+
+/*
+ * Returns a free buffer, or 0 if all buffers are queued or still
+ * in use by the kernel.
+ */
+extern struct oif_send_buffer *
+oif_sender_get_buffer (
+    struct oif_sender *snd);
+
+/*
+ * Returns a buffer from oif_sender_get_buffer to the pool without
+ * sending it.
+ */
+extern void
+oif_sender_release (
+    struct oif_sender *snd,
+    struct oif_send_buffer *buf);
+
+/*
+ * Queues the buffer with the encoded image and sends as much as
+ * possible. The buffer must not be changed until it is returned by
+ * oif_sender_get_buffer again.
+ * Returns 1 if all queued frames are sent, 0 if data is left,
+ * OIF_ERR_RANGE if img_size is larger than the buffer, or OIF_ERR_IO.
+ */
+extern int
+oif_sender_queue (
+    struct oif_sender *snd,
+    struct oif_send_buffer *buf);
+
+/*
+ * Sends as much of the queued frames as possible without blocking
+ * on a non-blocking socket, and processes zero-copy completions.
+ * Returns 1 if all queued frames are sent, 0 if data is left,
+ * or OIF_ERR_IO.
+ */
+extern int
+oif_sender_flush (
+    struct oif_sender *snd);
+
+/*
+ * Returns the poll events the sender waits for, POLLOUT if data is
+ * left, 0 if nothing is pending. Zero-copy completions are reported
+ * as POLLERR, which poll always returns.
+ */
+extern short
+oif_sender_events (
+    struct oif_sender *snd);
+
+/*
+ * Waits up to timeout ms (-1 = no limit) until data can be sent or a
+ * buffer is completed, and calls oif_sender_flush.
+ * Returns the result of oif_sender_flush, or OIF_ERR_IO.
+ */
+extern int
+oif_sender_wait (
+    struct oif_sender *snd,
+    int timeout);
+
+/*
+ * Frees the buffers. Frames that are not sent yet are dropped.
+ */
+extern void
+oif_sender_destroy (
+    struct oif_sender *snd);
+
+#endif
@@ -36,7 +36,7 @@ int main (void)
     int ret;
 
     struct oif_header header;
-    unsigned char coding_buffer[IMG_HEIGHT * IMG_WIDTH * 4 + 256];
+    unsigned char coding_buffer[OIF_COMPRESS_BOUND (IMG_WIDTH, IMG_HEIGHT)];
 
     std::cout << "OIF Test" << std::endl;
     std::cout << "Place a logo on an overlay screen and then compress" << std::endl;
@@ -15,11 +15,41 @@
  */
 
 #include <iostream>
-#include <fstream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <cstring>
 
 #include <opencv2/opencv.hpp>
 
 #include "oif.h"
+#include "oif_file.h"
+
+
+/*
+ * Buffers of a conversion thread. They grow to the largest image and
+ * are reused for the following files.
+ */
+struct convertBuffers {
+    std::vector<unsigned int> rgba;
+    std::vector<unsigned char> compr;
+};
+
+/*
+ * Result of the conversion of one file.
+ */
+struct convertResult {
+    int width;
+    int height;
+    int channels;
+    unsigned int imgSize;
+};
 
 
 int writeOifFile (
@@ -27,43 +57,147 @@ int writeOifFile (
     struct oif_header *header,
     const char *imgData)
 {
-    std::ofstream wf (fileName, std::ios::out | std::ios::binary);
-
-    wf.write((char *) header, sizeof (*header));
-    wf.write(imgData, header->img_size);
-    wf.close();
+    if (oif_file_write_image (fileName.c_str (), header, (const unsigned char *) imgData)) {
+        std::cout << "Error: Cannot write " << fileName << std::endl;
+        return -1;
+    }
     return 0;
 }
 
 
-void setAlpha (
-    cv::Mat &img,
+/*
+ * Converts an image with 1, 3 or 4 channels of 8 bit into the 32 bit
+ * pixels of OIF. If bg_r != -1, the color bg_r, bg_g, bg_b gets the
+ * alpha value 0 and all other colors 255, in the same pass. As before,
+ * the color is compared with the channels in the order of the image.
+ */
+void toRgba (
+    const cv::Mat &img,
+    unsigned int *dst,
     int bg_r,
     int bg_g,
     int bg_b)
 {
-    int channels = img.channels ();
-
-    for (int y = 0; y < img.size().height; y++) {
-        uchar* ptr = img.ptr (y);
-        for (int x = 0; x < img.size ().width; x++) {
-            if ((ptr[x * channels] == bg_r) && (ptr[x * channels + 1] == bg_g) &&
-                    (ptr[x * channels + 2] == bg_b)) {
-                ptr[x * channels + 3] = 0;
+    const int channels = img.channels ();
+    // Never matches a 24 bit color if there is no background color
+    const unsigned int key = (bg_r == -1) ? 0xFFFFFFFF :
+        (unsigned int) (bg_r | (bg_g << 8) | (bg_b << 16));
+    unsigned int color;
+
+    for (int y = 0; y < img.rows; y++) {
+        const uchar *src = img.ptr<uchar>(y);
+        unsigned int *out = dst + y * img.cols;
+
+        if ((channels == 4) && (bg_r == -1)) {
+            memcpy (out, src, img.cols * 4);
+            continue;
+        }
+        for (int x = 0; x < img.cols; x++) {
+            if (channels == 1) {
+                color = src[x] * 0x010101;
             } else {
-                ptr[x * channels + 3] = 255;
+                color = src[x * channels] | (src[x * channels + 1] << 8) |
+                    (src[x * channels + 2] << 16);
             }
+            out[x] = color | ((color == key) ? 0 : 0xFF000000);
         }
     }
 }
 
 
+/*
+ * Converts a PNG file into an OIF file with the same name and the
+ * extension .oif.
+ * Returns 0, or -1 on an error.
+ */
+int convertFile (
+    const std::string &pngFileName,
+    int bg_r,
+    int bg_g,
+    int bg_b,
+    const struct oif_options *opts,
+    struct convertBuffers &buf,
+    struct convertResult &result)
+{
+    cv::Mat srcImg;
+    struct oif_header header;
+    unsigned char *imgData;
+    std::string oifFileName;
+    size_t pixels;
+
+    srcImg = cv::imread (pngFileName, cv::IMREAD_UNCHANGED);
+    if (srcImg.empty ()) {
+        std::cout << "Error: Cannot read " << pngFileName << std::endl;
+        return -1;
+    }
+    if (srcImg.depth () != CV_8U) {
+        // 16 bit PNG
+        srcImg.convertTo (srcImg, CV_8U, 1.0 / 257.0);
+    }
+    result.width = srcImg.cols;
+    result.height = srcImg.rows;
+    result.channels = srcImg.channels ();
+    if ((result.channels != 1) && (result.channels != 3) && (result.channels != 4)) {
+        std::cout << "Error: " << pngFileName << " has " << result.channels << " channels"
+            << std::endl;
+        return -1;
+    }
+
+    pixels = (size_t) srcImg.cols * srcImg.rows;
+    if ((bg_r == -1) && (result.channels == 4) && srcImg.isContinuous ()) {
+        // The image already has the pixels of OIF
+        imgData = srcImg.ptr<unsigned char>(0);
+    } else {
+        if (buf.rgba.size () < pixels) {
+            buf.rgba.resize (pixels);
+        }
+        toRgba (srcImg, buf.rgba.data (), bg_r, bg_g, bg_b);
+        imgData = (unsigned char *) buf.rgba.data ();
+    }
+    if (buf.compr.size () < OIF_COMPRESS_BOUND ((size_t) srcImg.cols, (size_t) srcImg.rows)) {
+        buf.compr.resize (OIF_COMPRESS_BOUND ((size_t) srcImg.cols, (size_t) srcImg.rows));
+    }
+
+    oif_init_header (&header, srcImg.cols, srcImg.rows);
+    oif_compress_ex (&header, imgData, buf.compr.data (), opts);
+    result.imgSize = header.img_size;
+
+    oifFileName = pngFileName.substr(0,pngFileName.find_last_of('.')) + ".oif";
+    return writeOifFile (oifFileName, &header, (const char *) buf.compr.data ());
+}
+
+
+/*
+ * Adds the .png files in the directory and its subdirectories to files,
+ * sorted by name.
+ */
+void findPngFiles (
+    const std::string &dir,
+    std::vector<std::string> &files)
+{
+    std::vector<std::string> found;
+    std::error_code ec;
+
+    for (auto it = std::filesystem::recursive_directory_iterator (dir, ec);
+            it != std::filesystem::recursive_directory_iterator (); it.increment (ec)) {
+        std::string ext = it->path ().extension ().string ();
+        std::transform (ext.begin (), ext.end (), ext.begin (), ::tolower);
+        if (it->is_regular_file (ec) && (ext == ".png")) {
+            found.push_back (it->path ().string ());
+        }
+    }
+    std::sort (found.begin (), found.end ());
+    files.insert (files.end (), found.begin (), found.end ());
+}
+
+
 void usage ()
 {
     std::cout << "Usage: png2oif [-h] [--help] [--usage] \\" << std::endl;
     std::cout << "               [-bg <red>,<green>,<blue>] \\" << std::endl;
     std::cout << "               [--background <red>,<green>,<blue>] \\" << std::endl;
-    std::cout << "               <PNG image file name>" << std::endl;
+    std::cout << "               [-j <threads>] [-q] \\" << std::endl;
+    std::cout << "               <PNG image file name or directory> ..." << std::endl;
     std::cout << std::endl;
     std::cout << "Arguments:" << std::endl;
     std::cout << "    -h" << std::endl;
@@ -74,9 +208,14 @@ void usage ()
     std::cout << "                                       alpha channel, the specified color" << std::endl;
     std::cout << "                                       is used as background color" << std::endl;
     std::cout << "                                       (alpha value = 0)" << std::endl;
+    std::cout << "    -j <threads>                       Number of files converted in" << std::endl;
+    std::cout << "                                       parallel, default one per CPU" << std::endl;
+    std::cout << "    -q                                 Print only the summary of a batch" << std::endl;
     std::cout << std::endl;
-    std::cout << "Converts a PNG file into the OIF format. If the PNG file does not" << std::endl;
+    std::cout << "Converts PNG files into the OIF format. If the PNG file does not" << std::endl;
     std::cout << "have an alpha channel, a background color can be specified." << std::endl;
+    std::cout << "With several files or a directory, which is searched for .png files" << std::endl;
+    std::cout << "including its subdirectories, the files are converted in parallel." << std::endl;
     std::cout << std::endl;
 }
 
@@ -85,15 +224,18 @@ int main (
     int argc,
     char* argv[])
 {
-    cv::Mat srcImg;
-    cv::Mat dstImg;
-    struct oif_header header;
+    struct oif_options opts;
+    struct convertBuffers buf;
+    struct convertResult result;
     int i;
     int bg_r = -1;
     int bg_g = -1;
     int bg_b = -1;
-    std::string oifFileName;
-    std::string pngFileName;
+    int numThreads = 0;
+    bool quiet = false;
+    bool batch = false;
+    std::vector<std::string> inputs;
+    std::vector<std::string> pngFiles;
 
     if (argc < 2) {
         std::cout << "png2oif <PNG file name>" << std::endl;
@@ -140,52 +282,104 @@ int main (
                 std::cout << "Error: Argument for -bg/--background must have the form <red>,<green>,<blue>" << std::endl;
                 return 1;
             }
+        } else if ((s.compare ("-j") == 0) && (i + 1 < argc)) {
+            i++;
+            numThreads = atoi (argv[i]);
+        } else if (s.compare ("-q") == 0) {
+            quiet = true;
         } else {
-            pngFileName = argv[i];
+            inputs.push_back (argv[i]);
         }
         i++;
     }
 
-    if (pngFileName.length() == 0) {
+    for (const std::string &input : inputs) {
+        if (std::filesystem::is_directory (input)) {
+            findPngFiles (input, pngFiles);
+            batch = true;
+        } else {
+            pngFiles.push_back (input);
+        }
+    }
+    if (pngFiles.size () > 1) {
+        batch = true;
+    }
+
+    if (pngFiles.empty ()) {
         std::cout << "Error: No PNG file specified" << std::endl;
         return 1;
     }
 
-    std::cout << "Reading file " << pngFileName << std::endl;
-    srcImg = cv::imread (pngFileName, cv::IMREAD_UNCHANGED);
+    // The files are converted once, so the smallest size is used
+    oif_init_options (&opts);
+    opts.effort = OIF_EFFORT_MAX;
 
-    std::cout << "File has " << srcImg.channels () << " channels" << std::endl;
-
-    // Initialize header
-    oif_init_header (&header, srcImg.cols, srcImg.rows);
-
-    if ((bg_r == -1) && (srcImg.channels () == 4)) {
-        srcImg.copyTo(dstImg);
-        oif_compress (&header, srcImg.ptr<unsigned char>(0), dstImg.ptr<unsigned char>(0));
-    } else {
-        cv::Mat srcImgAlpha;
-        // Convert to RGBA
-        cv::cvtColor (srcImg, srcImgAlpha, cv::COLOR_RGB2RGBA);
-        srcImgAlpha.copyTo(dstImg);
-
-        // Change color to alpha value
-        if (bg_r != -1) {
-            setAlpha (srcImgAlpha, bg_r, bg_g, bg_b);
+    if (!batch) {
+        std::cout << "Reading file " << pngFiles[0] << std::endl;
+        if (convertFile (pngFiles[0], bg_r, bg_g, bg_b, &opts, buf, result)) {
+            return 1;
         }
-
-        // Compress the image
-        oif_compress (&header, srcImgAlpha.ptr<unsigned char>(0), dstImg.ptr<unsigned char>(0));
+        std::cout << "File has " << result.channels << " channels" << std::endl;
+        std::cout << "Uncompressed size: " << result.width * result.height * 4 << std::endl;
+        std::cout << "Compressed size: " << result.imgSize << std::endl;
+        std::cout << "Compression ratio: " << (double) result.imgSize /
+            (double) (result.width * result.height * 4) << std::endl;
+        return 0;
     }
 
-    std::cout << "Uncompressed size: " << srcImg.cols * srcImg.rows * 4 << std::endl;
-    std::cout << "Compressed size: " << header.img_size << std::endl;
-    std::cout << "Compression ratio: " << (double) header.img_size /
-        (double) (srcImg.cols * srcImg.rows * 4) << std::endl;
+    // Batch: each thread takes the next file and reuses its buffers
+    if (numThreads <= 0) {
+        numThreads = std::max (1U, std::thread::hardware_concurrency ());
+    }
+    numThreads = std::min ((size_t) numThreads, pngFiles.size ());
 
-    oifFileName = pngFileName.substr(0,pngFileName.find_last_of('.')) + ".oif";
-    writeOifFile (oifFileName, &header, dstImg.ptr<char>(0));
+    std::atomic<size_t> next (0);
+    std::mutex mutex;
+    unsigned long long uncomprBytes = 0;
+    unsigned long long comprBytes = 0;
+    unsigned int converted = 0;
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now ();
 
-    return 0;
-}
+    for (i = 0; i < numThreads; i++) {
+        threads.emplace_back ([&] () {
+            struct convertBuffers threadBuf;
+            struct convertResult threadResult;
+            size_t n;
+            int ret;
 
+            while ((n = next++) < pngFiles.size ()) {
+                ret = convertFile (pngFiles[n], bg_r, bg_g, bg_b, &opts, threadBuf,
+                                   threadResult);
+                std::lock_guard<std::mutex> lock (mutex);
+                if (ret == 0) {
+                    converted++;
+                    uncomprBytes += (unsigned long long) threadResult.width *
+                        threadResult.height * 4;
+                    comprBytes += threadResult.imgSize;
+                    if (!quiet) {
+                        std::cout << pngFiles[n] << ": " << threadResult.width << "x" <<
+                            threadResult.height << ", " << threadResult.imgSize <<
+                            " bytes" << std::endl;
+                    }
+                }
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join ();
+    }
 
+    double elapsed = std::chrono::duration<double> (std::chrono::steady_clock::now () -
+                                                    start).count ();
+    std::cout << "Converted " << converted << " of " << pngFiles.size () << " files with " <<
+        numThreads << " threads in " << std::fixed << std::setprecision (2) << elapsed <<
+        " s" << std::endl;
+    std::cout << "Throughput: " << converted / elapsed << " files/s, " <<
+        uncomprBytes / elapsed / 1e6 << " MB/s uncompressed" << std::endl;
+    if (uncomprBytes > 0) {
+        std::cout << "Compression ratio: " << std::setprecision (4) <<
+            (double) comprBytes / (double) uncomprBytes << std::endl;
+    }
+    return (converted == pngFiles.size ()) ? 0 : 1;
+}